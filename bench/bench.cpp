@@ -0,0 +1,430 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <array>
+#include <cstdint> // uint8_t, uint16_t, uint32_t, uint64_t
+#include <memory>  // std::make_shared
+#include <string>
+#include <string_view>
+#include <utility> // std::pair
+#include <vector>
+
+#include "ruc/argparser.h"
+#include "ruc/format/format.h"
+#include "ruc/format/print.h"
+#include "ruc/timer.h"
+
+#include "cpu.h"
+#include "emu.h"
+#include "loader.h"
+#include "ppu.h"
+
+// Benchmarks of the emulator core, the results are printed as JSON so they
+// can be compared across commits
+
+struct Result {
+	std::string group;
+	std::string name;
+	double value;
+	std::string unit;
+};
+
+static std::vector<Result> s_results;
+
+static void addResult(std::string_view group, std::string_view name, double value, std::string_view unit)
+{
+	s_results.push_back({ std::string(group), std::string(name), value, std::string(unit) });
+}
+
+static double elapsedSeconds(const ruc::Timer& timer)
+{
+	return timer.elapsedNanoseconds() / 1000000000.0;
+}
+
+// -----------------------------------------
+
+static std::shared_ptr<CPU> setupCPU()
+{
+	Emu::the().destroy();
+	Emu::the().init(4000000);
+
+	auto cpu = std::make_shared<CPU>(4000000);
+	Emu::the().addProcessingUnit("CPU", cpu);
+	Emu::the().addMemorySpace("FULL", 0x0000, 0xffff);
+
+	return cpu;
+}
+
+static std::shared_ptr<PPU> setupMemoryMap()
+{
+	Emu::the().destroy();
+	Emu::the().init(4000000);
+
+	auto ppu = std::make_shared<PPU>(4000000);
+	Emu::the().addProcessingUnit("PPU", ppu);
+
+	Emu::the().addMemorySpace("CARTROM", 0x0000, 0x7fff);
+	Emu::the().addMemorySpace("VRAM", 0x8000, 0x9fff, 2);
+	Emu::the().addMemorySpace("CARTRAM", 0xa000, 0xbfff);
+	Emu::the().addMemorySpace("WRAM1", 0xc000, 0xcfff);
+	Emu::the().addMemorySpace("WRAM2", 0xd000, 0xdfff, 7);
+	Emu::the().addMemorySpace("OAM", 0xfe00, 0xfe9f);
+	Emu::the().addMemorySpace("Not Usable", 0xfea0, 0xfeff);
+	Emu::the().addMemorySpace("IO", 0xff00, 0xff7f);
+	Emu::the().addMemorySpace("HRAM", 0xff80, 0xfffe);
+	Emu::the().addMemorySpace("IE", 0xffff, 0xffff);
+
+	// Enable the LCD, with the background tile data at 0x8000
+	Emu::the().writeMemory(0xff40, 0x91);
+	Emu::the().writeMemory(0xff47, 0xe4);
+
+	return ppu;
+}
+
+static void loadProgram(uint16_t address, const std::vector<uint8_t>& program)
+{
+	for (size_t i = 0; i < program.size(); ++i) {
+		Emu::the().writeMemory(address + i, program[i]);
+	}
+}
+
+// -----------------------------------------
+
+static void benchmarkOpcodes(std::string_view name, const std::vector<uint8_t>& block, uint64_t cycles)
+{
+	setupCPU();
+
+	std::vector<uint8_t> program = {
+		// clang-format off
+		0x31, 0xfe, 0xff, // LD SP,i16
+		0x21, 0x00, 0xc0, // LD HL,i16, point (HL) into work RAM
+		// clang-format on
+	};
+
+	// Repeat the block to keep the loop overhead small
+	while (program.size() < 0x3000) {
+		program.insert(program.end(), block.begin(), block.end());
+	}
+
+	// JP back to the start of the block
+	program.insert(program.end(), { 0xc3, 0x06, 0x00 });
+	loadProgram(0x0000, program);
+
+	ruc::Timer timer;
+	Emu::the().run(cycles);
+	double seconds = elapsedSeconds(timer);
+
+	addResult("opcode", name, cycles / seconds / 1000000.0, "emulated MHz");
+}
+
+static void benchmarkOpcodes()
+{
+	uint64_t cycles = 40000000;
+
+	// ALU: ADD, ADC, SUB, SBC, AND, XOR, OR, CP with every operand
+	std::vector<uint8_t> alu;
+	for (uint32_t opcode = 0x80; opcode <= 0xbf; ++opcode) {
+		alu.push_back(opcode);
+	}
+	benchmarkOpcodes("alu", alu, cycles);
+
+	// Loads: LD r8,r8 and LD r8,(HL)/LD (HL),r8, without modifying HL
+	std::vector<uint8_t> load;
+	for (uint32_t opcode = 0x40; opcode <= 0x7f; ++opcode) {
+		if ((opcode >= 0x60 && opcode <= 0x6f) || opcode == 0x76) {
+			continue;
+		}
+		load.push_back(opcode);
+	}
+	benchmarkOpcodes("load", load, cycles);
+
+	// CB-prefix: every prefixed opcode, without modifying HL
+	std::vector<uint8_t> prefix;
+	for (uint32_t opcode = 0x00; opcode <= 0xff; ++opcode) {
+		if ((opcode & 0x7) == 0x4 || (opcode & 0x7) == 0x5) {
+			continue;
+		}
+		prefix.push_back(0xcb);
+		prefix.push_back(opcode);
+	}
+	benchmarkOpcodes("prefix", prefix, cycles);
+}
+
+// -----------------------------------------
+
+static void benchmarkMemory()
+{
+	struct Region {
+		std::string_view name;
+		uint16_t address;
+		bool writable;
+	};
+
+	std::array<Region, 8> regions { {
+		{ "cartrom", 0x4000, true },
+		{ "vram", 0x8000, true },
+		{ "cartram", 0xa000, true },
+		{ "wram", 0xc000, true },
+		{ "echoram", 0xe000, true },
+		{ "oam", 0xfe00, true },
+		{ "io", 0xff00, false },
+		{ "hram", 0xff80, true },
+	} };
+
+	setupMemoryMap();
+
+	uint32_t iterations = 200000;
+	for (const auto& region : regions) {
+		// Access 128 consecutive bytes, which fits in every region
+		volatile uint8_t sink = 0;
+		ruc::Timer timer;
+		for (uint32_t i = 0; i < iterations; ++i) {
+			for (uint16_t offset = 0; offset < 128; ++offset) {
+				sink = sink + Emu::the().readMemory(region.address + offset);
+			}
+		}
+		double seconds = elapsedSeconds(timer);
+		addResult("read", region.name, seconds * 1000000000.0 / (iterations * 128.0), "ns");
+
+		if (!region.writable) {
+			continue;
+		}
+
+		ruc::Timer write_timer;
+		for (uint32_t i = 0; i < iterations; ++i) {
+			for (uint16_t offset = 0; offset < 128; ++offset) {
+				Emu::the().writeMemory(region.address + offset, i + offset);
+			}
+		}
+		seconds = elapsedSeconds(write_timer);
+		addResult("write", region.name, seconds * 1000000000.0 / (iterations * 128.0), "ns");
+	}
+}
+
+// -----------------------------------------
+
+static void benchmarkPPU()
+{
+	auto ppu = setupMemoryMap();
+
+	// Checkerboard tiles, so the pixel FIFO has work to do
+	for (uint16_t address = 0x8000; address < 0x9000; ++address) {
+		Emu::the().writeMemory(address, (address & 0x2) ? 0x55 : 0xaa);
+	}
+
+	// Measure the cost of reading the timer, to subtract from each mode
+	uint32_t calibration = 1000000;
+	ruc::Timer calibration_timer;
+	volatile double sink = 0;
+	for (uint32_t i = 0; i < calibration; ++i) {
+		sink = sink + calibration_timer.elapsedNanoseconds();
+	}
+	double overhead = calibration_timer.elapsedNanoseconds() / static_cast<double>(calibration);
+
+	// Only read the timer on mode changes, attributing the time to the previous mode
+	std::array<double, 4> time {};
+	uint64_t total_clocks = 0;
+	uint64_t frames = 300;
+	PPU::State state = ppu->state();
+	ruc::Timer timer;
+	double previous_time = 0;
+	while (total_clocks < frames * CLOCKS_PER_FRAME) {
+		total_clocks += ppu->update();
+
+		if (ppu->state() != state) {
+			double now = timer.elapsedNanoseconds();
+			time[state] += now - previous_time - overhead;
+			previous_time = now;
+			state = ppu->state();
+		}
+	}
+
+	std::array<std::string_view, 4> names { "hblank", "vblank", "oam-search", "pixel-transfer" };
+	for (size_t i = 0; i < names.size(); ++i) {
+		// Cost of a full scanline spent in this mode, per scanline
+		double scanlines = frames * (i == PPU::State::VBlank ? 10.0 : 144.0);
+		addResult("ppu", names[i], time[i] / scanlines, "ns per scanline");
+	}
+}
+
+// -----------------------------------------
+
+static void benchmarkFrames(std::string_view name, uint64_t frames)
+{
+	ruc::Timer timer;
+	Emu::the().run(frames * CLOCKS_PER_FRAME);
+	double seconds = elapsedSeconds(timer);
+
+	addResult("frame", name, frames * CLOCKS_PER_FRAME / seconds / 1000000.0, "emulated MHz");
+}
+
+static void benchmarkFrames(std::string_view bootrom_path, std::string_view rom_path)
+{
+	uint64_t frames = 600;
+
+	// Busy loop, the CPU spins while the PPU draws
+	auto setup = [](const std::vector<uint8_t>& program) {
+		setupMemoryMap();
+		auto cpu = std::make_shared<CPU>(4000000);
+		Emu::the().addProcessingUnit("CPU", cpu);
+		loadProgram(0x0000, program);
+	};
+
+	setup({
+		// clang-format off
+		0x18, 0xfe, // JR s8
+		// clang-format on
+	});
+	benchmarkFrames("busy-loop", frames);
+
+	// Idle loop, the CPU halts until the V-Blank interrupt of every frame
+	setup({
+		// clang-format off
+		0x3e, 0x01, // LD A,i8
+		0xe0, 0xff, // LDH (a8),A, enable the V-Blank interrupt
+		0xfb,       // EI
+		0x76,       // HALT
+		0x18, 0xfd, // JR s8
+		// clang-format on
+	});
+	loadProgram(0x0040, { 0xd9 }); // RETI
+	benchmarkFrames("halt-loop", frames);
+
+	// Copy loop, the CPU continuously copies ROM into VRAM
+	setup({
+		// clang-format off
+		0x21, 0x00, 0x80, // LD HL,i16
+		0x11, 0x00, 0x00, // LD DE,i16
+		0x1a,             // LD A,(DE)
+		0x22,             // LD (HL+),A
+		0x13,             // INC DE
+		0x7c,             // LD A,H
+		0xfe, 0x98,       // CP A,i8
+		0x20, 0xf8,       // JR NZ,s8
+		0x18, 0xf0,       // JR s8
+		// clang-format on
+	});
+	benchmarkFrames("vram-copy", frames);
+
+	// ROM provided on the command line
+	if (!rom_path.empty()) {
+		Loader::the().setBootromPath(bootrom_path);
+		Loader::the().loadRom(rom_path);
+		benchmarkFrames(rom_path, frames);
+	}
+}
+
+// -----------------------------------------
+
+static void benchmarkSaveStates()
+{
+	uint64_t frames = 600;
+
+	// Copy loop, the CPU keeps writing to the tile data
+	setupMemoryMap();
+	Emu::the().addProcessingUnit("CPU", std::make_shared<CPU>(4000000));
+	loadProgram(0x0000, {
+		// clang-format off
+		0x21, 0x00, 0x80, // LD HL,i16
+		0x11, 0x00, 0x00, // LD DE,i16
+		0x1a,             // LD A,(DE)
+		0x22,             // LD (HL+),A
+		0x13,             // INC DE
+		0x7c,             // LD A,H
+		0xfe, 0x98,       // CP A,i8
+		0x20, 0xf8,       // JR NZ,s8
+		0x18, 0xf0,       // JR s8
+		// clang-format on
+	});
+
+	// A snapshot at the end of every frame, as done by tooling
+	std::vector<uint8_t> state;
+	for (auto [name, snapshot] : { std::pair { "full", Emu::Snapshot::Full }, { "incremental", Emu::Snapshot::Incremental } }) {
+		double nanoseconds = 0;
+		size_t size = 0;
+		for (uint64_t i = 0; i < frames; ++i) {
+			Emu::the().run(CLOCKS_PER_FRAME);
+
+			state.clear();
+			ruc::Timer timer;
+			Emu::the().saveState(state, snapshot);
+			nanoseconds += timer.elapsedNanoseconds();
+			size += state.size();
+		}
+
+		addResult("save-state", name, nanoseconds / frames / 1000.0, "us per snapshot");
+		addResult("save-state", std::string(name) + "-size", size / frames / 1024.0, "KiB per snapshot");
+	}
+}
+
+// -----------------------------------------
+
+// Quoted JSON string, the names can contain ROM paths
+static std::string jsonString(std::string_view string)
+{
+	std::string json = "\"";
+	for (char character : string) {
+		switch (character) {
+		case '"':
+			json += "\\\"";
+			break;
+		case '\\':
+			json += "\\\\";
+			break;
+		case '\n':
+			json += "\\n";
+			break;
+		case '\t':
+			json += "\\t";
+			break;
+		default:
+			if (static_cast<uint8_t>(character) < 0x20) {
+				json += format("\\u{:04x}", static_cast<uint8_t>(character));
+				break;
+			}
+			json += character;
+			break;
+		}
+	}
+	json += "\"";
+
+	return json;
+}
+
+static void printResults()
+{
+	std::string json = "{\n\t\"benchmarks\": [\n";
+	for (size_t i = 0; i < s_results.size(); ++i) {
+		const auto& result = s_results[i];
+		json += "\t\t{ \"group\": " + jsonString(result.group) + ", \"name\": " + jsonString(result.name)
+		        + ", \"value\": " + format("{}", result.value) + ", \"unit\": " + jsonString(result.unit) + " }";
+		json += (i + 1 < s_results.size()) ? ",\n" : "\n";
+	}
+	json += "\t]\n}\n";
+
+	print("{}", json);
+}
+
+int main(int argc, const char* argv[])
+{
+	std::string_view bootrom_path = "gbc_bios.bin";
+	std::string_view rom_path;
+
+	ruc::ArgParser argParser;
+	argParser.addOption(bootrom_path, 'b', "bootrom", nullptr, nullptr, "", ruc::ArgParser::Required::Yes);
+	argParser.addOption(rom_path, 'r', "rom", "Also benchmark whole frames of this ROM", nullptr, "", ruc::ArgParser::Required::Yes);
+	argParser.parse(argc, argv);
+
+	benchmarkOpcodes();
+	benchmarkMemory();
+	benchmarkPPU();
+	benchmarkSaveStates();
+	benchmarkFrames(bootrom_path, rom_path);
+
+	printResults();
+
+	return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <cstdint> // uint64_t
+#include <cstddef> // size_t
+#include <fstream>
+#include <string>
+#include <string_view>
+
+#include "ruc/argparser.h"
+#include "ruc/format/print.h"
+#include "ruc/timer.h"
+
+#include "cpu.h"
+#include "emu.h"
+#include "loader.h"
+#include "ppu.h"
+
+// Run a ROM without a window, as fast as the host allows
+
+static void writeFramebuffer(std::string_view path, PPU& ppu)
+{
+	// Binary PPM, which most image viewers and tools understand
+	std::ofstream file(std::string(path), std::ios::binary);
+	file << "P6\n"
+	     << SCREEN_WIDTH << " " << SCREEN_HEIGHT << "\n255\n";
+	auto screen = ppu.screen();
+	for (size_t i = 0; i < screen.size(); i += ppu.formatSize()) {
+		file.write(reinterpret_cast<const char*>(screen.data() + i), 3);
+	}
+}
+
+static void writeSerial(std::string_view path, std::string_view serial)
+{
+	std::ofstream file(std::string(path), std::ios::binary);
+	file.write(serial.data(), serial.size());
+}
+
+int main(int argc, const char* argv[])
+{
+	std::string_view bootrom_path = "gbc_bios.bin";
+	std::string_view rom_path;
+	std::string_view framebuffer_path;
+	std::string_view serial_path;
+	unsigned int frames = 60;
+	unsigned int cycles = 0;
+	bool accurate = false;
+#ifdef GARBAGE_JIT
+	bool differential = false;
+#endif
+
+	ruc::ArgParser argParser;
+	argParser.addOption(bootrom_path, 'b', "bootrom", nullptr, nullptr, "", ruc::ArgParser::Required::Yes);
+	argParser.addOption(rom_path, 'r', "rom", nullptr, nullptr, "", ruc::ArgParser::Required::Yes);
+	argParser.addOption(frames, 'f', "frames", "Amount of frames to run, default 60", nullptr, "", ruc::ArgParser::Required::Yes);
+	argParser.addOption(cycles, 'c', "cycles", "Amount of cycles to run, overrides frames", nullptr, "", ruc::ArgParser::Required::Yes);
+	argParser.addOption(framebuffer_path, 'o', "framebuffer", "Write the final framebuffer to a PPM image", nullptr, "", ruc::ArgParser::Required::Yes);
+	argParser.addOption(serial_path, 's', "serial", "Write the serial output to a file", nullptr, "", ruc::ArgParser::Required::Yes);
+	argParser.addOption(accurate, 'a', "accurate", "Render every scanline with the pixel FIFO", nullptr);
+#ifdef GARBAGE_JIT
+	argParser.addOption(differential, 'd', "differential", "Verify all native code against the interpreter", nullptr);
+#endif
+	argParser.parse(argc, argv);
+
+	Loader::the().setBootromPath(bootrom_path);
+	Loader::the().loadRom(rom_path);
+
+	auto* ppu = static_cast<PPU*>(Emu::the().processingUnit("PPU").get());
+	ppu->setFormat(PPU::Format::RGBA);
+	if (accurate) {
+		ppu->setRenderer(PPU::Renderer::Fifo);
+	}
+
+#ifdef GARBAGE_JIT
+	auto* cpu = static_cast<CPU*>(Emu::the().processingUnit("CPU").get());
+	cpu->setJITDifferential(differential);
+#endif
+
+	uint64_t total_cycles = (cycles != 0) ? cycles : static_cast<uint64_t>(frames) * CLOCKS_PER_FRAME;
+
+	ruc::Timer timer;
+	Emu::the().run(total_cycles);
+	double elapsed = timer.elapsedNanoseconds() / 1000000.0;
+
+	print("ran {} cycles in {}ms\n", total_cycles, elapsed);
+
+	if (!framebuffer_path.empty()) {
+		writeFramebuffer(framebuffer_path, *ppu);
+	}
+
+	if (!serial_path.empty()) {
+		writeSerial(serial_path, Emu::the().serialOutput());
+	}
+
+	// Flush the save file
+	Loader::the().unloadRom();
+
+	return 0;
+}
@@ -0,0 +1,507 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <array>
+#include <chrono>  // std::chrono::system_clock
+#include <cstdint> // int64_t, uint8_t, uint16_t, uint32_t, uint64_t
+#include <cstring> // memcpy
+#include <memory>  // std::make_unique, std::unique_ptr
+#include <string_view>
+
+#include "cartridge.h"
+#include "emu.h"
+#include "ruc/format/log.h"
+#include "save-state.h"
+
+Cartridge::Cartridge(uint32_t rom_banks, uint32_t ram_banks)
+	: m_rom_banks(rom_banks)
+	, m_ram_banks(ram_banks)
+{
+}
+
+Cartridge::~Cartridge()
+{
+}
+
+std::unique_ptr<Cartridge> Cartridge::create(uint8_t type, uint32_t rom_banks, uint32_t ram_banks)
+{
+	std::unique_ptr<Cartridge> cartridge;
+	switch (type) {
+	case 0x00: // ROM ONLY
+	case 0x08: // ROM+RAM
+	case 0x09: // ROM+RAM+BATTERY
+		return std::make_unique<Cartridge>(rom_banks, ram_banks);
+	case 0x01: // MBC1
+	case 0x02: // MBC1+RAM
+	case 0x03: // MBC1+RAM+BATTERY
+		cartridge = std::make_unique<MBC1>(rom_banks, ram_banks);
+		break;
+	case 0x05: // MBC2
+	case 0x06: // MBC2+BATTERY
+		cartridge = std::make_unique<MBC2>(rom_banks, ram_banks);
+		break;
+	case 0x0f: // MBC3+TIMER+BATTERY
+	case 0x10: // MBC3+TIMER+RAM+BATTERY
+		cartridge = std::make_unique<MBC3>(rom_banks, ram_banks, true);
+		break;
+	case 0x11: // MBC3
+	case 0x12: // MBC3+RAM
+	case 0x13: // MBC3+RAM+BATTERY
+		cartridge = std::make_unique<MBC3>(rom_banks, ram_banks, false);
+		break;
+	case 0x19: // MBC5
+	case 0x1a: // MBC5+RAM
+	case 0x1b: // MBC5+RAM+BATTERY
+		cartridge = std::make_unique<MBC5>(rom_banks, ram_banks, false);
+		break;
+	case 0x1c: // MBC5+RUMBLE
+	case 0x1d: // MBC5+RUMBLE+RAM
+	case 0x1e: // MBC5+RUMBLE+RAM+BATTERY
+		cartridge = std::make_unique<MBC5>(rom_banks, ram_banks, true);
+		break;
+	default:
+		ruc::error("unsupported cartridge type: {:#04x}", type);
+		return std::make_unique<Cartridge>(rom_banks, ram_banks);
+	}
+
+	// RAM of the controllers is disabled at power on
+	cartridge->enableRam(false);
+	return cartridge;
+}
+
+bool Cartridge::hasBattery(uint8_t type)
+{
+	switch (type) {
+	case 0x03: // MBC1+RAM+BATTERY
+	case 0x06: // MBC2+BATTERY
+	case 0x09: // ROM+RAM+BATTERY
+	case 0x0f: // MBC3+TIMER+BATTERY
+	case 0x10: // MBC3+TIMER+RAM+BATTERY
+	case 0x13: // MBC3+RAM+BATTERY
+	case 0x1b: // MBC5+RAM+BATTERY
+	case 0x1e: // MBC5+RUMBLE+RAM+BATTERY
+		return true;
+	default:
+		return false;
+	}
+}
+
+uint32_t Cartridge::ramBankSize(uint8_t type)
+{
+	switch (type) {
+	case 0x05: // MBC2
+	case 0x06: // MBC2+BATTERY
+		// Stored as 512 bytes, the same as other emulators do
+		return 512;
+	default:
+		return 8 * 1024;
+	}
+}
+
+uint32_t Cartridge::batteryDataSize(uint8_t type)
+{
+	switch (type) {
+	case 0x0f: // MBC3+TIMER+BATTERY
+	case 0x10: // MBC3+TIMER+RAM+BATTERY
+		return MBC3::clock_data_size;
+	default:
+		return 0;
+	}
+}
+
+void Cartridge::write(uint16_t, uint8_t)
+{
+	// Without a controller there are no registers, writes have no effect
+}
+
+uint8_t Cartridge::readRam(uint16_t) const
+{
+	return 0xff;
+}
+
+void Cartridge::writeRam(uint16_t, uint8_t)
+{
+}
+
+// -----------------------------------------
+
+static void switchBank(std::string_view name, uint32_t bank)
+{
+	// Bank 0 is not mapped while the bootrom is
+	if (!Emu::the().hasMemorySpace(name)) {
+		return;
+	}
+
+	// Every switch invalidates the code the CPU is running, skip the ones that change nothing
+	const MemorySpace& memory_space = Emu::the().memorySpace(name);
+	bank %= memory_space.amount_of_banks;
+	if (bank != memory_space.active_bank) {
+		Emu::the().switchBank(name, bank);
+	}
+}
+
+void Cartridge::switchRomBank0(uint32_t bank)
+{
+	switchBank("CARTROM1", bank % m_rom_banks);
+}
+
+void Cartridge::switchRomBank(uint32_t bank)
+{
+	switchBank("CARTROM2", bank % m_rom_banks);
+}
+
+void Cartridge::switchRamBank(uint32_t bank)
+{
+	switchBank("CARTRAM", bank);
+}
+
+void Cartridge::enableRam(bool enabled)
+{
+	Emu::the().setCartridgeRamTrapped(!enabled);
+}
+
+// -----------------------------------------
+
+void MBC1::write(uint16_t address, uint8_t value)
+{
+	switch (address & 0xe000) {
+	case 0x0000:
+		enableRam((value & 0xf) == 0xa);
+		return;
+	case 0x2000:
+		// Bank 0 can not be selected, the register check happens before masking to the ROM size
+		m_rom_bank = (value & 0x1f) ? value & 0x1f : 1;
+		break;
+	case 0x4000:
+		m_upper_bank = value & 0x3;
+		break;
+	case 0x6000:
+		m_advanced_banking = value & 0x1;
+		break;
+	default:
+		break;
+	}
+
+	updateBanks();
+}
+
+void MBC1::updateBanks()
+{
+	switchRomBank((m_upper_bank << 5) | m_rom_bank);
+
+	// In advanced banking mode the upper bits also apply to 0x0000~0x3fff and RAM
+	switchRomBank0(m_advanced_banking ? m_upper_bank << 5 : 0);
+	switchRamBank(m_advanced_banking ? m_upper_bank : 0);
+}
+
+void MBC1::saveState(StateWriter& state) const
+{
+	state.write(m_rom_bank);
+	state.write(m_upper_bank);
+	state.write(m_advanced_banking);
+}
+
+void MBC1::loadState(StateReader& state)
+{
+	state.read(m_rom_bank);
+	state.read(m_upper_bank);
+	state.read(m_advanced_banking);
+}
+
+// -----------------------------------------
+
+void MBC2::write(uint16_t address, uint8_t value)
+{
+	if (address >= 0x4000) {
+		return;
+	}
+
+	// Bit 8 of the address selects the register
+	if (!(address & 0x100)) {
+		m_ram_enabled = (value & 0xf) == 0xa;
+		return;
+	}
+
+	switchRomBank((value & 0xf) ? value & 0xf : 1);
+}
+
+void MBC2::saveState(StateWriter& state) const
+{
+	state.write(m_ram_enabled);
+}
+
+void MBC2::loadState(StateReader& state)
+{
+	state.read(m_ram_enabled);
+}
+
+// The built-in RAM is kept in CARTRAM, so it is saved like any other cartridge RAM
+
+uint8_t MBC2::readRam(uint16_t address) const
+{
+	if (!m_ram_enabled || !Emu::the().hasMemorySpace("CARTRAM")) {
+		return 0xff;
+	}
+
+	// 512 half bytes, repeated throughout 0xa000~0xbfff, the upper bits are undefined
+	return Emu::the().memorySpace("CARTRAM").data()[address & 0x1ff] | 0xf0;
+}
+
+void MBC2::writeRam(uint16_t address, uint8_t value)
+{
+	if (m_ram_enabled && Emu::the().hasMemorySpace("CARTRAM")) {
+		Emu::the().memorySpace("CARTRAM").data()[address & 0x1ff] = value & 0xf;
+	}
+}
+
+// -----------------------------------------
+
+static int64_t hostSeconds()
+{
+	return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+MBC3::MBC3(uint32_t rom_banks, uint32_t ram_banks, bool has_rtc)
+	: Cartridge(rom_banks, ram_banks)
+	, m_has_rtc(has_rtc)
+	, m_rtc_base(hostSeconds())
+{
+}
+
+void MBC3::setBatteryData(uint8_t* data)
+{
+	m_battery_data = data;
+
+	// A new save file is all zeroes, that starts with the clock at zero
+	uint64_t timestamp;
+	memcpy(&timestamp, data + 40, sizeof(timestamp));
+	if (timestamp == 0) {
+		saveClock();
+		return;
+	}
+
+	std::array<uint32_t, 10> registers;
+	memcpy(registers.data(), data, sizeof(registers));
+	for (uint32_t i = 0; i < m_rtc_latched.size(); ++i) {
+		m_rtc_latched[i] = registers[5 + i];
+	}
+
+	// The clock kept running while the emulator was not
+	uint8_t day_high = registers[4];
+	int64_t seconds = registers[0] % 60 + registers[1] % 60 * 60 + registers[2] % 24 * 3600
+	                  + ((registers[3] & 0xff) | ((day_high & 0x1) << 8)) * 86400;
+	m_rtc_halt = day_high & 0x40;
+	m_rtc_carry = day_high & 0x80;
+	m_rtc_halted = seconds;
+	m_rtc_base = static_cast<int64_t>(timestamp) - seconds;
+}
+
+void MBC3::write(uint16_t address, uint8_t value)
+{
+	switch (address & 0xe000) {
+	case 0x0000:
+		m_ram_enabled = (value & 0xf) == 0xa;
+		updateRam();
+		break;
+	case 0x2000:
+		switchRomBank((value & 0x7f) ? value & 0x7f : 1);
+		break;
+	case 0x4000:
+		m_ram_select = value & 0xf;
+		updateRam();
+		break;
+	case 0x6000: {
+		// Writing 0 then 1 copies the clock into the readable registers
+		if (m_rtc_latch == 0x00 && value == 0x01 && m_has_rtc) {
+			int64_t seconds = rtcSeconds();
+			if (seconds >= 512 * 86400) {
+				m_rtc_carry = true;
+				seconds %= 512 * 86400;
+				setRtcSeconds(seconds);
+			}
+
+			uint32_t days = seconds / 86400;
+			m_rtc_latched = {
+				static_cast<uint8_t>(seconds % 60),
+				static_cast<uint8_t>(seconds / 60 % 60),
+				static_cast<uint8_t>(seconds / 3600 % 24),
+				static_cast<uint8_t>(days & 0xff),
+				static_cast<uint8_t>((days >> 8) | (m_rtc_halt << 6) | (m_rtc_carry << 7)),
+			};
+			saveClock();
+		}
+		m_rtc_latch = value;
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+uint8_t MBC3::readRam(uint16_t) const
+{
+	if (!m_ram_enabled || !m_has_rtc || m_ram_select < RTC::Seconds || m_ram_select > RTC::DayHigh) {
+		return 0xff;
+	}
+
+	return m_rtc_latched[m_ram_select - RTC::Seconds];
+}
+
+void MBC3::writeRam(uint16_t, uint8_t value)
+{
+	if (!m_ram_enabled || !m_has_rtc || m_ram_select < RTC::Seconds || m_ram_select > RTC::DayHigh) {
+		return;
+	}
+
+	int64_t seconds = rtcSeconds() % (512 * 86400);
+	int64_t days = seconds / 86400;
+	int64_t hours = seconds / 3600 % 24;
+	int64_t minutes = seconds / 60 % 60;
+	seconds %= 60;
+
+	switch (m_ram_select) {
+	case RTC::Seconds:
+		seconds = value & 0x3f;
+		break;
+	case RTC::Minutes:
+		minutes = value & 0x3f;
+		break;
+	case RTC::Hours:
+		hours = value & 0x1f;
+		break;
+	case RTC::DayLow:
+		days = (days & 0x100) | value;
+		break;
+	case RTC::DayHigh:
+		days = (days & 0xff) | ((value & 0x1) << 8);
+		m_rtc_halt = value & 0x40;
+		m_rtc_carry = value & 0x80;
+		break;
+	default:
+		break;
+	};
+
+	setRtcSeconds(days * 86400 + hours * 3600 + minutes * 60 + seconds);
+	saveClock();
+}
+
+void MBC3::saveState(StateWriter& state) const
+{
+	state.write(m_ram_enabled);
+	state.write(m_ram_select);
+	state.write(m_rtc_base);
+	state.write(m_rtc_halted);
+	state.write(m_rtc_halt);
+	state.write(m_rtc_carry);
+	state.write(m_rtc_latch);
+	state.write(m_rtc_latched);
+}
+
+void MBC3::loadState(StateReader& state)
+{
+	state.read(m_ram_enabled);
+	state.read(m_ram_select);
+	state.read(m_rtc_base);
+	state.read(m_rtc_halted);
+	state.read(m_rtc_halt);
+	state.read(m_rtc_carry);
+	state.read(m_rtc_latch);
+	state.read(m_rtc_latched);
+
+	saveClock();
+}
+
+void MBC3::updateRam()
+{
+	// The clock registers are not memory, those are trapped just like disabled RAM
+	if (m_ram_select <= 0x3) {
+		switchRamBank(m_ram_select);
+	}
+	enableRam(m_ram_enabled && m_ram_select <= 0x3);
+}
+
+int64_t MBC3::rtcSeconds() const
+{
+	return (m_rtc_halt) ? m_rtc_halted : hostSeconds() - m_rtc_base;
+}
+
+void MBC3::setRtcSeconds(int64_t seconds)
+{
+	if (m_rtc_halt) {
+		m_rtc_halted = seconds;
+		return;
+	}
+
+	m_rtc_base = hostSeconds() - seconds;
+}
+
+void MBC3::saveClock()
+{
+	if (!m_battery_data) {
+		return;
+	}
+
+	// Any point in time describes the running clock, so only store it after changes
+	int64_t timestamp = hostSeconds();
+	int64_t seconds = (m_rtc_halt) ? m_rtc_halted : timestamp - m_rtc_base;
+	uint32_t days = seconds / 86400;
+	std::array<uint32_t, 10> registers = {
+		static_cast<uint32_t>(seconds % 60),
+		static_cast<uint32_t>(seconds / 60 % 60),
+		static_cast<uint32_t>(seconds / 3600 % 24),
+		days & 0xff,
+		((days >> 8) & 0x1) | (m_rtc_halt << 6) | ((m_rtc_carry || days >= 512) << 7),
+	};
+	for (uint32_t i = 0; i < m_rtc_latched.size(); ++i) {
+		registers[5 + i] = m_rtc_latched[i];
+	}
+
+	memcpy(m_battery_data, registers.data(), sizeof(registers));
+	memcpy(m_battery_data + 40, &timestamp, sizeof(timestamp));
+}
+
+// -----------------------------------------
+
+MBC5::MBC5(uint32_t rom_banks, uint32_t ram_banks, bool has_rumble)
+	: Cartridge(rom_banks, ram_banks)
+	, m_has_rumble(has_rumble)
+{
+}
+
+void MBC5::write(uint16_t address, uint8_t value)
+{
+	switch (address & 0xf000) {
+	case 0x0000:
+	case 0x1000:
+		enableRam((value & 0xf) == 0xa);
+		break;
+	case 0x2000:
+		m_rom_bank = (m_rom_bank & 0x100) | value;
+		switchRomBank(m_rom_bank);
+		break;
+	case 0x3000:
+		m_rom_bank = (m_rom_bank & 0xff) | ((value & 0x1) << 8);
+		switchRomBank(m_rom_bank);
+		break;
+	case 0x4000:
+	case 0x5000:
+		// The rumble motor is not emulated
+		switchRamBank(value & (m_has_rumble ? 0x7 : 0xf));
+		break;
+	default:
+		break;
+	}
+}
+
+void MBC5::saveState(StateWriter& state) const
+{
+	state.write(m_rom_bank);
+}
+
+void MBC5::loadState(StateReader& state)
+{
+	state.read(m_rom_bank);
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint> // int64_t, uint8_t, uint16_t, uint32_t
+#include <memory>  // std::unique_ptr
+
+class StateReader;
+class StateWriter;
+
+// Memory bank controller of the cartridge, selected by the cartridge type
+// in the header. Register writes switch the active bank of the CARTROM1,
+// CARTROM2 and CARTRAM memory spaces, which only changes the page pointers
+// of the address map, the banks themselves are never copied.
+// https://gbdev.io/pandocs/MBCs.html
+class Cartridge {
+public:
+	Cartridge(uint32_t rom_banks, uint32_t ram_banks);
+	virtual ~Cartridge();
+
+	// Create the controller for the cartridge type at 0x0147 of the header
+	static std::unique_ptr<Cartridge> create(uint8_t type, uint32_t rom_banks, uint32_t ram_banks);
+	// Whether the cartridge RAM keeps its contents when powered off
+	static bool hasBattery(uint8_t type);
+	// Bytes per RAM bank, MBC2 has 512 half bytes of RAM built in
+	static uint32_t ramBankSize(uint8_t type);
+	// Bytes kept after the RAM in the save file, for the clock of MBC3
+	static uint32_t batteryDataSize(uint8_t type);
+
+	// Write into the ROM area, 0x0000~0x7fff, which holds the registers
+	virtual void write(uint16_t address, uint8_t value);
+
+	// Access to 0xa000~0xbfff while cartridge RAM is trapped
+	virtual uint8_t readRam(uint16_t address) const;
+	virtual void writeRam(uint16_t address, uint8_t value);
+
+	// Memory in the save file after the RAM, see batteryDataSize()
+	virtual void setBatteryData(uint8_t*) {}
+
+	// Registers of the controller, the selected banks are restored by the Emu
+	virtual void saveState(StateWriter&) const {}
+	virtual void loadState(StateReader&) {}
+
+protected:
+	void switchRomBank0(uint32_t bank);
+	void switchRomBank(uint32_t bank);
+	void switchRamBank(uint32_t bank);
+	// Disabled RAM is trapped, reads return 0xff and writes are ignored
+	void enableRam(bool enabled);
+
+	uint32_t m_rom_banks { 0 }; // 16KiB each
+	uint32_t m_ram_banks { 0 }; // 8KiB each
+};
+
+// -----------------------------------------
+
+class MBC1 final : public Cartridge {
+public:
+	using Cartridge::Cartridge;
+
+	void write(uint16_t address, uint8_t value) override;
+
+	void saveState(StateWriter& state) const override;
+	void loadState(StateReader& state) override;
+
+private:
+	void updateBanks();
+
+	uint8_t m_rom_bank { 1 };   // 5-bit
+	uint8_t m_upper_bank { 0 }; // 2-bit, upper ROM bits or RAM bank
+	bool m_advanced_banking { false };
+};
+
+// -----------------------------------------
+
+class MBC2 final : public Cartridge {
+public:
+	using Cartridge::Cartridge;
+
+	void write(uint16_t address, uint8_t value) override;
+
+	uint8_t readRam(uint16_t address) const override;
+	void writeRam(uint16_t address, uint8_t value) override;
+
+	void saveState(StateWriter& state) const override;
+	void loadState(StateReader& state) override;
+
+private:
+	bool m_ram_enabled { false };
+};
+
+// -----------------------------------------
+
+class MBC3 final : public Cartridge {
+public:
+	MBC3(uint32_t rom_banks, uint32_t ram_banks, bool has_rtc);
+
+	// Clock in the save file: the registers, the latched registers, each as
+	// 4 bytes, and the host time they were stored at as 8 bytes, all little
+	// endian. This is the layout other emulators use
+	static constexpr uint32_t clock_data_size = 5 * 4 + 5 * 4 + 8;
+
+	void write(uint16_t address, uint8_t value) override;
+
+	uint8_t readRam(uint16_t address) const override;
+	void writeRam(uint16_t address, uint8_t value) override;
+
+	void setBatteryData(uint8_t* data) override;
+
+	void saveState(StateWriter& state) const override;
+	void loadState(StateReader& state) override;
+
+private:
+	enum RTC : uint8_t {
+		Seconds = 0x08,
+		Minutes = 0x09,
+		Hours = 0x0a,
+		DayLow = 0x0b,
+		DayHigh = 0x0c, // Bit 0 day bit 8, bit 6 halt, bit 7 day carry
+	};
+
+	void updateRam();
+
+	// Seconds counted by the clock, follows the host clock unless halted
+	int64_t rtcSeconds() const;
+	void setRtcSeconds(int64_t seconds);
+	// Store the clock after the RAM in the save file, whenever it is changed
+	void saveClock();
+
+	bool m_has_rtc { false };
+	bool m_ram_enabled { false };
+	uint8_t m_ram_select { 0 }; // RAM bank 0~3 or RTC register 0x08~0x0c
+
+	int64_t m_rtc_base { 0 }; // Host time at which the clock was zero, in seconds
+	int64_t m_rtc_halted { 0 };
+	bool m_rtc_halt { false };
+	bool m_rtc_carry { false };
+	uint8_t m_rtc_latch { 0xff };
+	std::array<uint8_t, 5> m_rtc_latched {};
+
+	uint8_t* m_battery_data { nullptr };
+};
+
+// -----------------------------------------
+
+class MBC5 final : public Cartridge {
+public:
+	MBC5(uint32_t rom_banks, uint32_t ram_banks, bool has_rumble);
+
+	void write(uint16_t address, uint8_t value) override;
+
+	void saveState(StateWriter& state) const override;
+	void loadState(StateReader& state) override;
+
+private:
+	bool m_has_rumble { false }; // Bit 3 of the RAM bank register drives the motor
+	uint16_t m_rom_bank { 1 };   // 9-bit
+};
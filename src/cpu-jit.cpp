@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifdef GARBAGE_JIT
+
+#include <array>
+#include <cstddef> // ptrdiff_t, size_t
+#include <cstdint> // int32_t, uint8_t, uint16_t, uint32_t, uintptr_t
+#include <cstring> // memcpy
+
+#include "cpu.h"
+#include "emu.h"
+#include "jit.h"
+#include "ruc/meta/assert.h"
+#include "save-state.h"
+
+// Instructions that can write to memory, which might switch a bank or write a
+// register, or read memory through a pointer, which might read a register
+static constexpr bool mayAccess(uint8_t opcode)
+{
+	switch (opcode) {
+	case 0x0a: // LD A,(BC)
+	case 0x1a: // LD A,(DE)
+	case 0x2a: // LD A,(HL+)
+	case 0x3a: // LD A,(HL-)
+	case 0x46: // LD B,(HL)
+	case 0x4e: // LD C,(HL)
+	case 0x56: // LD D,(HL)
+	case 0x5e: // LD E,(HL)
+	case 0x66: // LD H,(HL)
+	case 0x6e: // LD L,(HL)
+	case 0x7e: // LD A,(HL)
+	case 0x86: // ADD A,(HL)
+	case 0x8e: // ADC A,(HL)
+	case 0x96: // SUB A,(HL)
+	case 0x9e: // SBC A,(HL)
+	case 0xa6: // AND A,(HL)
+	case 0xae: // XOR A,(HL)
+	case 0xb6: // OR A,(HL)
+	case 0xbe: // CP A,(HL)
+	case 0xc1: // POP BC
+	case 0xd1: // POP DE
+	case 0xe1: // POP HL
+	case 0xf1: // POP AF
+	case 0x02: // LD (BC),A
+	case 0x08: // LD (a16),SP
+	case 0x12: // LD (DE),A
+	case 0x22: // LD (HL+),A
+	case 0x32: // LD (HL-),A
+	case 0x34: // INC (HL)
+	case 0x35: // DEC (HL)
+	case 0x36: // LD (HL),i8
+	case 0x70: // LD (HL),B
+	case 0x71: // LD (HL),C
+	case 0x72: // LD (HL),D
+	case 0x73: // LD (HL),E
+	case 0x74: // LD (HL),H
+	case 0x75: // LD (HL),L
+	case 0x77: // LD (HL),A
+	case 0xc5: // PUSH BC
+	case 0xd5: // PUSH DE
+	case 0xe5: // PUSH HL
+	case 0xf5: // PUSH AF
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Entry point of a non-virtual member function, Itanium C++ ABI
+template<typename T>
+static const void* functionAddress(T function)
+{
+	struct Representation {
+		uintptr_t pointer;
+		ptrdiff_t adjustment;
+	};
+	static_assert(sizeof(T) == sizeof(Representation), "Unsupported member function pointer representation");
+
+	Representation representation;
+	memcpy(&representation, &function, sizeof(representation));
+	VERIFY(!(representation.pointer & 1) && representation.adjustment == 0, "member function can not be called directly");
+
+	return reinterpret_cast<const void*>(representation.pointer);
+}
+
+// -----------------------------------------
+
+void CPU::compileBlock(Block& block)
+{
+	if (emitBlock(block)) {
+		return;
+	}
+
+	// Out of executable memory, throw away all native code and start over
+	for (auto& [key, value] : m_blocks) {
+		value.code = nullptr;
+		value.executions = 0;
+	}
+	m_jit.reset();
+
+	emitBlock(block);
+}
+
+bool CPU::emitBlock(Block& block)
+{
+	auto offset = [this](const void* member) -> int32_t {
+		return static_cast<const uint8_t*>(member) - reinterpret_cast<const uint8_t*>(this);
+	};
+
+	// Registers in the order they are encoded in the opcode, (HL) is not a register
+	const int32_t registers[8] = {
+		offset(&m_b), offset(&m_c), offset(&m_d), offset(&m_e),
+		offset(&m_h), offset(&m_l), -1, offset(&m_a)
+	};
+
+	// Program counter and cycles are only written back when they are needed
+	uint16_t pending_pc = 0;
+	uint32_t pending_cycles = 0;
+	auto flushPC = [&]() {
+		if (pending_pc) {
+			m_jit.add16(offset(&m_pc), pending_pc);
+			pending_pc = 0;
+		}
+	};
+	auto flushCycles = [&]() {
+		if (pending_cycles) {
+			m_jit.add32(offset(&m_wait_cycles), pending_cycles);
+			pending_cycles = 0;
+		}
+	};
+
+	// Same as the interpreter: defer the flags of A operation CL, store the result in A
+	auto arithmetic = [&](uint8_t family) {
+		struct {
+			JIT::Operation operation;
+			FlagOperation flag_operation;
+		} operations[8] = {
+			{ JIT::Operation::Add, FlagOperation::Add },           // ADD
+			{},                                                    // ADC
+			{ JIT::Operation::Subtract, FlagOperation::Subtract }, // SUB
+			{},                                                    // SBC
+			{ JIT::Operation::And, FlagOperation::And },           // AND
+			{ JIT::Operation::Xor, FlagOperation::Or },            // XOR
+			{ JIT::Operation::Or, FlagOperation::Or },             // OR
+			{ JIT::Operation::Subtract, FlagOperation::Subtract }, // CP
+		};
+
+		m_jit.load8(JIT::EAX, offset(&m_a));
+		m_jit.store8(offset(&m_flag_lhs), JIT::EAX);
+		m_jit.store8(offset(&m_flag_rhs), JIT::ECX);
+		m_jit.operation8(operations[family].operation);
+		m_jit.store8(offset(&m_flag_result), JIT::EAX);
+		if (family != 7) { // CP does not store the result
+			m_jit.store8(offset(&m_a), JIT::EAX);
+		}
+		m_jit.store8(offset(&m_flag_operation), static_cast<uint8_t>(operations[family].flag_operation));
+		m_jit.store8(offset(&m_flag_carry), static_cast<uint8_t>(0));
+	};
+
+	m_jit.begin();
+
+	size_t size = block.instructions.size();
+	for (size_t i = 0; i < size; ++i) {
+		uint16_t address = block.addresses[i];
+		uint8_t opcode = Emu::the().readMemory(address);
+
+		uint8_t destination = (opcode >> 3) & 0x7;
+		uint8_t source = opcode & 0x7;
+
+		// NOP
+		if (opcode == 0x00) {
+			pending_pc += 1;
+			pending_cycles += 4;
+			continue;
+		}
+
+		// LD r,r
+		if (opcode >= 0x40 && opcode <= 0x7f && destination != 6 && source != 6) {
+			if (destination != source) {
+				m_jit.load8(JIT::EAX, registers[source]);
+				m_jit.store8(registers[destination], JIT::EAX);
+			}
+			pending_pc += 1;
+			pending_cycles += 4;
+			continue;
+		}
+
+		// LD r,i8, the immediate can not change as long as the block is cached
+		if (opcode <= 0x3f && source == 6 && destination != 6) {
+			m_jit.store8(registers[destination], Emu::the().readMemory(address + 1));
+			pending_pc += 2;
+			pending_cycles += 8;
+			continue;
+		}
+
+		// ADD, SUB, AND, XOR, OR and CP with a register or immediate operand,
+		// ADC and SBC read the carry so are left to the interpreter
+		if ((opcode >= 0x80 && opcode <= 0xbf && source != 6) || (opcode >= 0xc6 && (opcode & 0x7) == 6)) {
+			bool immediate = opcode >= 0xc0;
+			if (destination != 1 && destination != 3) {
+				if (immediate) {
+					m_jit.move32(JIT::ECX, Emu::the().readMemory(address + 1));
+				}
+				else {
+					m_jit.load8(JIT::ECX, registers[source]);
+				}
+				arithmetic(destination);
+				pending_pc += immediate ? 2 : 1;
+				pending_cycles += immediate ? 8 : 4;
+				continue;
+			}
+		}
+
+		// Prefixed opcodes skip the second dispatch, only those on (HL) access memory
+		if (opcode == 0xcb) {
+			uint8_t prefix_opcode = Emu::the().readMemory(address + 1);
+			bool may_exit = i + 1 < size && (prefix_opcode & 0x7) == 6;
+
+			pending_pc += 2;
+			if (may_exit) {
+				flushPC();
+				flushCycles();
+			}
+			m_jit.call(functionAddress(decodePrefix(prefix_opcode)));
+
+			if (may_exit) {
+				m_jit.callOrExit(&CPU::jitContinue);
+			}
+			continue;
+		}
+
+		// Everything else runs the interpreter handler. Handlers only add to
+		// the cycles, but the program counter is used to read operands and
+		// by the jumps, which are always at the end of the block
+		bool last = i + 1 == size;
+		bool has_operands = !last && block.addresses[i + 1] - address > 1;
+		bool may_exit = !last && mayAccess(opcode);
+
+		pending_pc += 1;
+		if (last || has_operands || may_exit) {
+			flushPC();
+		}
+		if (may_exit) {
+			flushCycles();
+		}
+		m_jit.call(functionAddress(block.instructions[i]));
+
+		// Mirror the interpreter, which stops the block after writes with side
+		// effects and reads of registers
+		if (may_exit) {
+			m_jit.callOrExit(&CPU::jitContinue);
+		}
+	}
+
+	flushPC();
+	flushCycles();
+
+	block.code = m_jit.end();
+	return block.code != nullptr;
+}
+
+void CPU::runBlockDifferential(Block& block)
+{
+	auto registers = [this]() -> std::array<uint32_t, 11> {
+		return { af(), bc(), de(), hl(), sp(), pc(), m_ime, m_should_enable_ime, m_halted, m_stopped, m_wait_cycles };
+	};
+
+	m_differential_state.clear();
+	StateWriter writer(m_differential_state);
+	saveState(writer);
+	uint32_t wait_cycles = m_wait_cycles;
+
+	// Native code goes first, its writes are deferred so memory is left as is
+	m_deferred_writes.clear();
+	m_deferred_side_effects = false;
+	m_block_volatile_reads = m_volatile_reads;
+	m_defer_writes = true;
+	block.code(this);
+	m_defer_writes = false;
+	std::array<uint32_t, 11> native = registers();
+
+	// Then the interpreter, from the same state
+	StateReader reader(m_differential_state);
+	loadState(reader);
+	m_wait_cycles = wait_cycles;
+	m_recorded_writes.clear();
+	m_record_writes = true;
+	interpretBlock(block);
+	m_record_writes = false;
+
+	std::array<uint32_t, 11> interpreter = registers();
+	VERIFY(native == interpreter, "native code of the block at {:#06x} differs from the interpreter, PC {:#06x} vs {:#06x}, cycles {} vs {}",
+	       block.addresses[0], native[5], interpreter[5], native[10], interpreter[10]);
+
+	// Same stores, to the same addresses, in the same order
+	VERIFY(m_deferred_writes.size() == m_recorded_writes.size(), "native code of the block at {:#06x} writes {} times, the interpreter {} times",
+	       block.addresses[0], m_deferred_writes.size(), m_recorded_writes.size());
+	for (size_t i = 0; i < m_deferred_writes.size(); ++i) {
+		auto [native_address, native_value] = m_deferred_writes[i];
+		auto [address, value] = m_recorded_writes[i];
+		VERIFY(native_address == address && native_value == value, "native code of the block at {:#06x} writes {:#04x} to {:#06x}, the interpreter {:#04x} to {:#06x}",
+		       block.addresses[0], native_value, native_address, value, address);
+	}
+}
+
+bool CPU::jitContinue(void* context)
+{
+	CPU* cpu = static_cast<CPU*>(context);
+
+	if (cpu->m_volatile_reads != cpu->m_block_volatile_reads) {
+		return false;
+	}
+
+	// Deferred writes do not reach memory, stop where the interpreter would
+	if (cpu->m_defer_writes) {
+		return !cpu->m_deferred_side_effects;
+	}
+
+	return cpu->m_block_trapped_writes == Emu::the().trappedWrites();
+}
+
+#endif
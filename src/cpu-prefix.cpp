@@ -4,62 +4,78 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include <array>
+#include <cstddef> // size_t
 #include <cstdint> // uint8_t, uint32_t
+#include <utility> // std::index_sequence, std::make_index_sequence
 
 #include "cpu.h"
 #include "ruc/format/print.h"
 #include "ruc/meta/assert.h"
 
+template<size_t... opcodes>
+constexpr std::array<CPU::Instruction, 256> CPU::prefixTable(std::index_sequence<opcodes...>)
+{
+	return { &CPU::executePrefix<opcodes>... };
+}
+
+CPU::Instruction CPU::decodePrefix(uint8_t opcode)
+{
+	// Handlers for every prefixed opcode, generated at compile time
+	static constexpr std::array<Instruction, 256> instructions = prefixTable(std::make_index_sequence<256> {});
+
+	return instructions[opcode];
+}
+
 void CPU::prefix()
 {
 	// Note: All these opcodes are considered 2 bytes, as the prefix is included
 
-	// Skip 0xcb prefix opcode
-	m_pc = (m_pc + 1) & 0xffff;
-
 	// Read next opcode
-	uint8_t opcode = read(m_pc);
-	// print("running opcode: {:#04x} @ ({:#06x})\n", opcode, m_pc);
-	if (opcode <= 0x07) {
-		rlc();
-	}
-	else if (opcode >= 0x08 && opcode <= 0x0f) {
-		rrc();
+	uint8_t opcode = pcRead();
+	// print("running opcode: {:#04x} @ ({:#06x})\n", opcode, m_pc - 1);
+	(this->*decodePrefix(opcode))();
+}
+
+template<uint8_t opcode>
+void CPU::executePrefix()
+{
+	if constexpr (opcode <= 0x07) {
+		rlc<opcode>();
 	}
-	else if (opcode >= 0x10 && opcode <= 0x17) {
-		rl();
+	else if constexpr (opcode >= 0x08 && opcode <= 0x0f) {
+		rrc<opcode>();
 	}
-	else if (opcode >= 0x18 && opcode <= 0x1f) {
-		rr();
+	else if constexpr (opcode >= 0x10 && opcode <= 0x17) {
+		rl<opcode>();
 	}
-	else if (opcode >= 0x20 && opcode <= 0x27) {
-		sla();
+	else if constexpr (opcode >= 0x18 && opcode <= 0x1f) {
+		rr<opcode>();
 	}
-	else if (opcode >= 0x28 && opcode <= 0x2f) {
-		sra();
+	else if constexpr (opcode >= 0x20 && opcode <= 0x27) {
+		sla<opcode>();
 	}
-	else if (opcode >= 0x30 && opcode <= 0x37) {
-		swap();
+	else if constexpr (opcode >= 0x28 && opcode <= 0x2f) {
+		sra<opcode>();
 	}
-	else if (opcode >= 0x38 && opcode <= 0x3f) {
-		srl();
+	else if constexpr (opcode >= 0x30 && opcode <= 0x37) {
+		swap<opcode>();
 	}
-	else if (opcode >= 0x40 && opcode <= 0x7f) {
-		bit();
+	else if constexpr (opcode >= 0x38 && opcode <= 0x3f) {
+		srl<opcode>();
 	}
-	else if (opcode >= 0x80 && opcode <= 0xbf) {
-		res();
+	else if constexpr (opcode >= 0x40 && opcode <= 0x7f) {
+		bit<opcode>();
 	}
-	else if (opcode >= 0xc0) {
-		set();
+	else if constexpr (opcode >= 0x80 && opcode <= 0xbf) {
+		res<opcode>();
 	}
 	else {
-		print("opcode {:#04x} not implemented\n", opcode);
-		print("immediate: {:#04x}\n", pcRead());
-		VERIFY_NOT_REACHED();
+		set<opcode>();
 	}
 }
 
+template<uint8_t opcode>
 void CPU::bit()
 {
 	auto test_bit = [this](uint32_t bit, uint32_t byte) -> void {
@@ -68,9 +84,7 @@ void CPU::bit()
 
 		// Set flags
 		// Set zero flag if bit at position 'x' of register r8 is 0
-		m_zf = (byte & bit) == 0x0;
-		m_nf = 0;
-		m_hf = 1;
+		setFlags((byte & bit) == 0x0, 0, 1, cf());
 	};
 
 	auto test_bit_hl = [this](uint32_t bit) -> void {
@@ -79,12 +93,9 @@ void CPU::bit()
 
 		// Set flags
 		// Set zero flag if bit at position 'x' of byte pointed by HL is 0
-		m_zf = (read(hl()) & bit) == 0x0;
-		m_nf = 0;
-		m_hf = 1;
+		setFlags((read(hl()) & bit) == 0x0, 0, 1, cf());
 	};
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x40: /* BIT 0,B */ test_bit(0x01, m_b); break;
 	case 0x41: /* BIT 0,C */ test_bit(0x01, m_c); break;
@@ -162,9 +173,10 @@ void CPU::bit()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::res()
 {
-	auto reset_bit = [this](uint32_t bit, uint32_t& register_) -> void {
+	auto reset_bit = [this](uint32_t bit, uint8_t& register_) -> void {
 		// RES b,r8
 		m_wait_cycles += 8;
 
@@ -177,12 +189,11 @@ void CPU::res()
 		m_wait_cycles += 16;
 
 		// Set bit at postition 'x' in the byte pointed by HL to 0
-		uint32_t data = read(hl());
+		uint8_t data = read(hl());
 		data = data & (~bit);
 		write(hl(), data);
 	};
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x80: /* RES 0,B */ reset_bit(0x01, m_b); break;
 	case 0x81: /* RES 0,C */ reset_bit(0x01, m_c); break;
@@ -260,9 +271,10 @@ void CPU::res()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::set()
 {
-	auto set_bit = [this](uint32_t bit, uint32_t& register_) -> void {
+	auto set_bit = [this](uint32_t bit, uint8_t& register_) -> void {
 		// RES b,r8
 		m_wait_cycles += 8;
 
@@ -275,12 +287,11 @@ void CPU::set()
 		m_wait_cycles += 16;
 
 		// Set bit at postition 'x' in the byte pointed by HL to 0
-		uint32_t data = read(hl());
+		uint8_t data = read(hl());
 		data = data | bit;
 		write(hl(), data);
 	};
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0xc0: /* SET 0,B */ set_bit(0x01, m_b); break;
 	case 0xc1: /* SET 0,C */ set_bit(0x01, m_c); break;
@@ -358,9 +369,10 @@ void CPU::set()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::swap()
 {
-	auto swap_bits = [this](uint32_t& register_) -> void {
+	auto swap_bits = [this](uint8_t& register_) -> void {
 		// SWAP r8, flags: Z 0 0 0
 		m_wait_cycles += 8;
 
@@ -368,13 +380,9 @@ void CPU::swap()
 		register_ = ((register_ >> 4) | (register_ << 4)) & 0xff;
 
 		// Set flags
-		m_zf = (register_ == 0);
-		m_nf = 0;
-		m_hf = 0;
-		m_cf = 0;
+		setFlags(register_ == 0, 0, 0, 0);
 	};
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x30: /* SWAP B */ swap_bits(m_b); break;
 	case 0x31: /* SWAP C */ swap_bits(m_c); break;
@@ -386,7 +394,7 @@ void CPU::swap()
 		m_wait_cycles += 8; // + 8 = 16 total
 
 		// Swap upper 4 bits in the byte pointed by HL with lower 4 bits
-		uint32_t data = read(hl());
+		uint8_t data = read(hl());
 		swap_bits(data);
 		write(hl(), data);
 		break;
@@ -397,26 +405,24 @@ void CPU::swap()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::rl()
 {
-	auto rotate_left_carry = [this](uint32_t& register_) -> void {
+	auto rotate_left_carry = [this](uint8_t& register_) -> void {
 		// RL r8, flags: Z 0 0 C
 		m_wait_cycles += 8;
 
 		// Copy bit 7 into carry flag
-		uint32_t old_carry = m_cf != 0;
-		m_cf = (register_ & 0x80) == 0x80;
+		uint32_t old_carry = cf();
+		bool carry = (register_ & 0x80) == 0x80;
 
 		// Rotate register r8 left through carry
 		register_ = (old_carry | (register_ << 1)) & 0xff;
 
 		// Set other flags
-		m_zf = (register_ == 0);
-		m_nf = 0;
-		m_hf = 0;
+		setFlags(register_ == 0, 0, 0, carry);
 	};
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x10: /* RL B */ rotate_left_carry(m_b); break;
 	case 0x11: /* RL C */ rotate_left_carry(m_c); break;
@@ -427,7 +433,7 @@ void CPU::rl()
 	case 0x16: /* RL (HL) */ {
 		m_wait_cycles += 8; // + 8 = 16 total
 
-		uint32_t data = read(hl());
+		uint8_t data = read(hl());
 		rotate_left_carry(data);
 		write(hl(), data);
 		break;
@@ -438,25 +444,23 @@ void CPU::rl()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::rlc()
 {
-	auto rotate_left = [this](uint32_t& register_) -> void {
+	auto rotate_left = [this](uint8_t& register_) -> void {
 		// RLC r8, flags: Z 0 0 C
 		m_wait_cycles += 8;
 
 		// Copy bit 7 into carry flag
-		m_cf = (register_ & 0x80) == 0x80;
+		bool carry = (register_ & 0x80) == 0x80;
 
 		// Rotate register r8 left
 		register_ = ((register_ >> 7) | (register_ << 1)) & 0xff;
 
 		// Set other flags
-		m_zf = (register_ == 0);
-		m_nf = 0;
-		m_hf = 0;
+		setFlags(register_ == 0, 0, 0, carry);
 	};
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x00: /* RLC B */ rotate_left(m_b); break;
 	case 0x01: /* RLC C */ rotate_left(m_c); break;
@@ -468,7 +472,7 @@ void CPU::rlc()
 		m_wait_cycles += 8; // + 8 = 16 total
 
 		// Rotate the byte pointed to by HL left
-		uint32_t data = read(hl());
+		uint8_t data = read(hl());
 		rotate_left(data);
 		write(hl(), data);
 		break;
@@ -479,26 +483,24 @@ void CPU::rlc()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::rr()
 {
-	auto rotate_right_carry = [this](uint32_t& register_) -> void {
+	auto rotate_right_carry = [this](uint8_t& register_) -> void {
 		// RR r8, flags: Z 0 0 C
 		m_wait_cycles += 8;
 
 		// Copy bit 0 into carry flag
-		uint32_t old_carry = m_cf != 0;
-		m_cf = (register_ & 0x1) == 0x1;
+		uint32_t old_carry = cf();
+		bool carry = (register_ & 0x1) == 0x1;
 
 		// Rotate register r8 right through carry
 		register_ = ((register_ >> 1) | (old_carry << 7)) & 0xff;
 
 		// Set other flags
-		m_zf = (register_ == 0);
-		m_nf = 0;
-		m_hf = 0;
+		setFlags(register_ == 0, 0, 0, carry);
 	};
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x18: /* RR B */ rotate_right_carry(m_b); break;
 	case 0x19: /* RR C */ rotate_right_carry(m_c); break;
@@ -509,7 +511,7 @@ void CPU::rr()
 	case 0x1e: /* RR (HL) */ {
 		m_wait_cycles += 8; // + 8 = 16 total
 
-		uint32_t data = read(hl());
+		uint8_t data = read(hl());
 		rotate_right_carry(data);
 		write(hl(), data);
 		break;
@@ -520,25 +522,23 @@ void CPU::rr()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::rrc()
 {
-	auto rotate_right = [this](uint32_t& register_) -> void {
+	auto rotate_right = [this](uint8_t& register_) -> void {
 		// RRC r8, flags: Z 0 0 C
 		m_wait_cycles += 8;
 
 		// Copy bit 0 into carry flag
-		m_cf = (register_ & 0x1) == 0x1;
+		bool carry = (register_ & 0x1) == 0x1;
 
 		// Rotate register r8 right
 		register_ = ((register_ >> 1) | (register_ << 7)) & 0xff;
 
 		// Set other flags
-		m_zf = (register_ == 0);
-		m_nf = 0;
-		m_hf = 0;
+		setFlags(register_ == 0, 0, 0, carry);
 	};
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x08: /* RRC B */ rotate_right(m_b); break;
 	case 0x09: /* RRC C */ rotate_right(m_c); break;
@@ -550,7 +550,7 @@ void CPU::rrc()
 		m_wait_cycles += 8; // + 8 = 16 total
 
 		// Rotate the byte pointed to by HL right
-		uint32_t data = read(hl());
+		uint8_t data = read(hl());
 		rotate_right(data);
 		write(hl(), data);
 		break;
@@ -561,9 +561,10 @@ void CPU::rrc()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::sla()
 {
-	auto shift_left_arithmatically = [this](uint32_t& register_) -> void {
+	auto shift_left_arithmatically = [this](uint8_t& register_) -> void {
 		// SLA r8, flags: Z 0 0 C
 		m_wait_cycles += 8;
 
@@ -574,18 +575,15 @@ void CPU::sla()
 		//         r8
 
 		// Copy bit 7 into carry flag
-		m_cf = (register_ & 0x80) == 0x80;
+		bool carry = (register_ & 0x80) == 0x80;
 
 		// Shift Left Arithmetically register r8
 		register_ = (register_ << 1) & 0xff;
 
 		// Set other flags
-		m_zf = (register_ == 0);
-		m_nf = 0;
-		m_hf = 0;
+		setFlags(register_ == 0, 0, 0, carry);
 	};
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x20: /* SLA B */ shift_left_arithmatically(m_b); break;
 	case 0x21: /* SLA C */ shift_left_arithmatically(m_c); break;
@@ -597,7 +595,7 @@ void CPU::sla()
 		m_wait_cycles += 8; // + 8 = 16 total
 
 		// Rotate the byte pointed to by HL right
-		uint32_t data = read(hl());
+		uint8_t data = read(hl());
 		shift_left_arithmatically(data);
 		write(hl(), data);
 		break;
@@ -608,9 +606,10 @@ void CPU::sla()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::sra()
 {
-	auto shift_right_arithmatically = [this](uint32_t& register_) -> void {
+	auto shift_right_arithmatically = [this](uint8_t& register_) -> void {
 		// SRL r8, flags: Z 0 0 C
 		m_wait_cycles += 8;
 
@@ -622,18 +621,15 @@ void CPU::sra()
 		//  └──┘
 
 		// Copy bit 0 into carry flag
-		m_cf = (register_ & 0x1) == 0x1;
+		bool carry = (register_ & 0x1) == 0x1;
 
 		// Shift Right Arithmatically register r8
 		register_ = (register_ >> 1) | (register_ & 0x80); // Note: bit 7 remains
 
 		// Set other flags
-		m_zf = (register_ == 0);
-		m_nf = 0;
-		m_hf = 0;
+		setFlags(register_ == 0, 0, 0, carry);
 	};
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x28: /* SRA B */ shift_right_arithmatically(m_b); break;
 	case 0x29: /* SRA C */ shift_right_arithmatically(m_c); break;
@@ -645,7 +641,7 @@ void CPU::sra()
 		m_wait_cycles += 8; // + 8 = 16 total
 
 		// Rotate the byte pointed to by HL right
-		uint32_t data = read(hl());
+		uint8_t data = read(hl());
 		shift_right_arithmatically(data);
 		write(hl(), data);
 		break;
@@ -656,9 +652,10 @@ void CPU::sra()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::srl()
 {
-	auto shift_right_logically = [this](uint32_t& register_) -> void {
+	auto shift_right_logically = [this](uint8_t& register_) -> void {
 		// SRL r8, flags: Z 0 0 C
 		m_wait_cycles += 8;
 
@@ -669,18 +666,15 @@ void CPU::srl()
 		//         r8
 
 		// Copy bit 0 into carry flag
-		m_cf = (register_ & 0x1) == 0x1;
+		bool carry = (register_ & 0x1) == 0x1;
 
 		// Shift Right Locically register r8
 		register_ = (register_ >> 1) & 0x7f; // Note: bit 7 is set to 0
 
 		// Set other flags
-		m_zf = (register_ == 0);
-		m_nf = 0;
-		m_hf = 0;
+		setFlags(register_ == 0, 0, 0, carry);
 	};
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x38: /* SRL B */ shift_right_logically(m_b); break;
 	case 0x39: /* SRL C */ shift_right_logically(m_c); break;
@@ -692,7 +686,7 @@ void CPU::srl()
 		m_wait_cycles += 8; // + 8 = 16 total
 
 		// Shift right logically the byte pointed to by HL
-		uint32_t data = read(hl());
+		uint8_t data = read(hl());
 		shift_right_logically(data);
 		write(hl(), data);
 		break;
@@ -5,14 +5,20 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include <algorithm> // std::max
+#include <array>
+#include <bit>     // std::countr_zero
+#include <cstddef> // size_t
 #include <cstdint> // uint8_t, uint32_t
 
 #include "cpu.h"
 #include "emu.h"
+#include "interrupt-controller.h"
 #include "ruc/format/color.h"
 #include "ruc/format/print.h"
 #include "ruc/meta/assert.h"
 #include "ruc/meta/core.h"
+#include "save-state.h"
 
 CPU::CPU(uint32_t frequency)
 	: ProcessingUnit(frequency)
@@ -27,27 +33,8 @@ CPU::CPU(uint32_t frequency)
 	, m_l(0x0d)
 	, m_pc(0x0)
 	, m_sp(0xfffe)
-	// Flags
-	, m_zf(0x1)
-	, m_nf(0x0)
-	, m_hf(0x0)
-	, m_cf(0x0)
+	, m_f(Flag::Zero)
 {
-	// FIXME: Figure out if other ProcessingUnits require access to these registers,
-	//        delete this functionality if they dont
-	m_shared_registers.emplace("a", &m_a);
-	m_shared_registers.emplace("b", &m_b);
-	m_shared_registers.emplace("c", &m_c);
-	m_shared_registers.emplace("d", &m_d);
-	m_shared_registers.emplace("e", &m_e);
-	m_shared_registers.emplace("h", &m_h);
-	m_shared_registers.emplace("l", &m_l);
-	m_shared_registers.emplace("sp", &m_sp);
-	m_shared_registers.emplace("pc", &m_pc);
-	m_shared_registers.emplace("zf", &m_zf);
-	m_shared_registers.emplace("nf", &m_nf);
-	m_shared_registers.emplace("hf", &m_hf);
-	m_shared_registers.emplace("cf", &m_cf);
 }
 
 CPU::~CPU()
@@ -56,11 +43,11 @@ CPU::~CPU()
 
 // -----------------------------------------
 
-void CPU::handleInterrupt(uint32_t interrupt_flag, uint8_t interrupt_source, uint8_t address)
+void CPU::handleInterrupt(InterruptController::Interrupt interrupt)
 {
 	// Clear interrupt
 	m_ime = 0;
-	Emu::the().writeMemory(0xff0f, interrupt_flag & (~interrupt_source));
+	Emu::the().interrupts().acknowledge(interrupt);
 
 	// Call
 
@@ -72,507 +59,675 @@ void CPU::handleInterrupt(uint32_t interrupt_flag, uint8_t interrupt_source, uin
 	m_sp = (m_sp - 1) & 0xffff;
 	write(m_sp, m_pc & 0xff); // lsb(PC)
 
-	// Jump to address
-	m_pc = address;
+	// Jump to the interrupt vector, 0x40 + 8 * bit
+	m_pc = 0x40 + std::countr_zero(static_cast<uint32_t>(interrupt)) * 8;
 }
 
-void CPU::update()
+constexpr CPU::Instruction CPU::decode(uint8_t opcode)
 {
+	switch (opcode) {
+	case 0x00: return &CPU::nop<0x00>;
+	case 0x01: return &CPU::ldi16<0x01>;
+	case 0x02: return &CPU::ldr8<0x02>;
+	case 0x03: return &CPU::inc16<0x03>;
+	case 0x04: return &CPU::inc8<0x04>;
+	case 0x05: return &CPU::dec8<0x05>;
+	case 0x06: return &CPU::ldi8<0x06>;
+	case 0x07: return &CPU::ra<0x07>;
+	case 0x08: return &CPU::ldr16<0x08>;
+	case 0x09: return &CPU::addr16<0x09>;
+	case 0x0a: return &CPU::ldr8<0x0a>;
+	case 0x0b: return &CPU::dec16<0x0b>;
+	case 0x0c: return &CPU::inc8<0x0c>;
+	case 0x0d: return &CPU::dec8<0x0d>;
+	case 0x0e: return &CPU::ldi8<0x0e>;
+	case 0x0f: return &CPU::ra<0x0f>;
+	case 0x10: return &CPU::misc<0x10>;
+	case 0x11: return &CPU::ldi16<0x11>;
+	case 0x12: return &CPU::ldr8<0x12>;
+	case 0x13: return &CPU::inc16<0x13>;
+	case 0x14: return &CPU::inc8<0x14>;
+	case 0x15: return &CPU::dec8<0x15>;
+	case 0x16: return &CPU::ldi8<0x16>;
+	case 0x17: return &CPU::ra<0x17>;
+	case 0x18: return &CPU::jrs8<0x18>;
+	case 0x19: return &CPU::addr16<0x19>;
+	case 0x1a: return &CPU::ldr8<0x1a>;
+	case 0x1b: return &CPU::dec16<0x1b>;
+	case 0x1c: return &CPU::inc8<0x1c>;
+	case 0x1d: return &CPU::dec8<0x1d>;
+	case 0x1e: return &CPU::ldi8<0x1e>;
+	case 0x1f: return &CPU::ra<0x1f>;
+	case 0x20: return &CPU::jrs8<0x20>;
+	case 0x21: return &CPU::ldi16<0x21>;
+	case 0x22: return &CPU::ldr8<0x22>;
+	case 0x23: return &CPU::inc16<0x23>;
+	case 0x24: return &CPU::inc8<0x24>;
+	case 0x25: return &CPU::dec8<0x25>;
+	case 0x26: return &CPU::ldi8<0x26>;
+	case 0x27: return &CPU::daa<0x27>;
+	case 0x28: return &CPU::jrs8<0x28>;
+	case 0x29: return &CPU::addr16<0x29>;
+	case 0x2a: return &CPU::lda8<0x2a>;
+	case 0x2b: return &CPU::dec16<0x2b>;
+	case 0x2c: return &CPU::inc8<0x2c>;
+	case 0x2d: return &CPU::dec8<0x2d>;
+	case 0x2e: return &CPU::ldi8<0x2e>;
+	case 0x2f: return &CPU::misc<0x2f>;
+	case 0x30: return &CPU::jrs8<0x30>;
+	case 0x31: return &CPU::ldi16<0x31>;
+	case 0x32: return &CPU::ldr8<0x32>;
+	case 0x33: return &CPU::inc16<0x33>;
+	case 0x34: return &CPU::inc8<0x34>;
+	case 0x35: return &CPU::dec8<0x35>;
+	case 0x36: return &CPU::ldi8<0x36>;
+	case 0x37: return &CPU::misc<0x37>;
+	case 0x38: return &CPU::jrs8<0x38>;
+	case 0x39: return &CPU::addr16<0x39>;
+	case 0x3a: return &CPU::lda8<0x3a>;
+	case 0x3b: return &CPU::dec16<0x3b>;
+	case 0x3c: return &CPU::inc8<0x3c>;
+	case 0x3d: return &CPU::dec8<0x3d>;
+	case 0x3e: return &CPU::ldi8<0x3e>;
+	case 0x3f: return &CPU::misc<0x3f>;
+	case 0x40: return &CPU::ldr8<0x40>;
+	case 0x41: return &CPU::ldr8<0x41>;
+	case 0x42: return &CPU::ldr8<0x42>;
+	case 0x43: return &CPU::ldr8<0x43>;
+	case 0x44: return &CPU::ldr8<0x44>;
+	case 0x45: return &CPU::ldr8<0x45>;
+	case 0x46: return &CPU::ldr8<0x46>;
+	case 0x47: return &CPU::ldr8<0x47>;
+	case 0x48: return &CPU::ldr8<0x48>;
+	case 0x49: return &CPU::ldr8<0x49>;
+	case 0x4a: return &CPU::ldr8<0x4a>;
+	case 0x4b: return &CPU::ldr8<0x4b>;
+	case 0x4c: return &CPU::ldr8<0x4c>;
+	case 0x4d: return &CPU::ldr8<0x4d>;
+	case 0x4e: return &CPU::ldr8<0x4e>;
+	case 0x4f: return &CPU::ldr8<0x4f>;
+	case 0x50: return &CPU::ldr8<0x50>;
+	case 0x51: return &CPU::ldr8<0x51>;
+	case 0x52: return &CPU::ldr8<0x52>;
+	case 0x53: return &CPU::ldr8<0x53>;
+	case 0x54: return &CPU::ldr8<0x54>;
+	case 0x55: return &CPU::ldr8<0x55>;
+	case 0x56: return &CPU::ldr8<0x56>;
+	case 0x57: return &CPU::ldr8<0x57>;
+	case 0x58: return &CPU::ldr8<0x58>;
+	case 0x59: return &CPU::ldr8<0x59>;
+	case 0x5a: return &CPU::ldr8<0x5a>;
+	case 0x5b: return &CPU::ldr8<0x5b>;
+	case 0x5c: return &CPU::ldr8<0x5c>;
+	case 0x5d: return &CPU::ldr8<0x5d>;
+	case 0x5e: return &CPU::ldr8<0x5e>;
+	case 0x5f: return &CPU::ldr8<0x5f>;
+	case 0x60: return &CPU::ldr8<0x60>;
+	case 0x61: return &CPU::ldr8<0x61>;
+	case 0x62: return &CPU::ldr8<0x62>;
+	case 0x63: return &CPU::ldr8<0x63>;
+	case 0x64: return &CPU::ldr8<0x64>;
+	case 0x65: return &CPU::ldr8<0x65>;
+	case 0x66: return &CPU::ldr8<0x66>;
+	case 0x67: return &CPU::ldr8<0x67>;
+	case 0x68: return &CPU::ldr8<0x68>;
+	case 0x69: return &CPU::ldr8<0x69>;
+	case 0x6a: return &CPU::ldr8<0x6a>;
+	case 0x6b: return &CPU::ldr8<0x6b>;
+	case 0x6c: return &CPU::ldr8<0x6c>;
+	case 0x6d: return &CPU::ldr8<0x6d>;
+	case 0x6e: return &CPU::ldr8<0x6e>;
+	case 0x6f: return &CPU::ldr8<0x6f>;
+	case 0x70: return &CPU::ldr8<0x70>;
+	case 0x71: return &CPU::ldr8<0x71>;
+	case 0x72: return &CPU::ldr8<0x72>;
+	case 0x73: return &CPU::ldr8<0x73>;
+	case 0x74: return &CPU::ldr8<0x74>;
+	case 0x75: return &CPU::ldr8<0x75>;
+	case 0x76: return &CPU::misc<0x76>;
+	case 0x77: return &CPU::ldr8<0x77>;
+	case 0x78: return &CPU::ldr8<0x78>;
+	case 0x79: return &CPU::ldr8<0x79>;
+	case 0x7a: return &CPU::ldr8<0x7a>;
+	case 0x7b: return &CPU::ldr8<0x7b>;
+	case 0x7c: return &CPU::ldr8<0x7c>;
+	case 0x7d: return &CPU::ldr8<0x7d>;
+	case 0x7e: return &CPU::ldr8<0x7e>;
+	case 0x7f: return &CPU::ldr8<0x7f>;
+	case 0x80: return &CPU::add8<0x80>;
+	case 0x81: return &CPU::add8<0x81>;
+	case 0x82: return &CPU::add8<0x82>;
+	case 0x83: return &CPU::add8<0x83>;
+	case 0x84: return &CPU::add8<0x84>;
+	case 0x85: return &CPU::add8<0x85>;
+	case 0x86: return &CPU::add8<0x86>;
+	case 0x87: return &CPU::add8<0x87>;
+	case 0x88: return &CPU::adc8<0x88>;
+	case 0x89: return &CPU::adc8<0x89>;
+	case 0x8a: return &CPU::adc8<0x8a>;
+	case 0x8b: return &CPU::adc8<0x8b>;
+	case 0x8c: return &CPU::adc8<0x8c>;
+	case 0x8d: return &CPU::adc8<0x8d>;
+	case 0x8e: return &CPU::adc8<0x8e>;
+	case 0x8f: return &CPU::adc8<0x8f>;
+	case 0x90: return &CPU::sub8<0x90>;
+	case 0x91: return &CPU::sub8<0x91>;
+	case 0x92: return &CPU::sub8<0x92>;
+	case 0x93: return &CPU::sub8<0x93>;
+	case 0x94: return &CPU::sub8<0x94>;
+	case 0x95: return &CPU::sub8<0x95>;
+	case 0x96: return &CPU::sub8<0x96>;
+	case 0x97: return &CPU::sub8<0x97>;
+	case 0x98: return &CPU::sbc8<0x98>;
+	case 0x99: return &CPU::sbc8<0x99>;
+	case 0x9a: return &CPU::sbc8<0x9a>;
+	case 0x9b: return &CPU::sbc8<0x9b>;
+	case 0x9c: return &CPU::sbc8<0x9c>;
+	case 0x9d: return &CPU::sbc8<0x9d>;
+	case 0x9e: return &CPU::sbc8<0x9e>;
+	case 0x9f: return &CPU::sbc8<0x9f>;
+	case 0xa0: return &CPU::and8<0xa0>;
+	case 0xa1: return &CPU::and8<0xa1>;
+	case 0xa2: return &CPU::and8<0xa2>;
+	case 0xa3: return &CPU::and8<0xa3>;
+	case 0xa4: return &CPU::and8<0xa4>;
+	case 0xa5: return &CPU::and8<0xa5>;
+	case 0xa6: return &CPU::and8<0xa6>;
+	case 0xa7: return &CPU::and8<0xa7>;
+	case 0xa8: return &CPU::xor8<0xa8>;
+	case 0xa9: return &CPU::xor8<0xa9>;
+	case 0xaa: return &CPU::xor8<0xaa>;
+	case 0xab: return &CPU::xor8<0xab>;
+	case 0xac: return &CPU::xor8<0xac>;
+	case 0xad: return &CPU::xor8<0xad>;
+	case 0xae: return &CPU::xor8<0xae>;
+	case 0xaf: return &CPU::xor8<0xaf>;
+	case 0xb0: return &CPU::or8<0xb0>;
+	case 0xb1: return &CPU::or8<0xb1>;
+	case 0xb2: return &CPU::or8<0xb2>;
+	case 0xb3: return &CPU::or8<0xb3>;
+	case 0xb4: return &CPU::or8<0xb4>;
+	case 0xb5: return &CPU::or8<0xb5>;
+	case 0xb6: return &CPU::or8<0xb6>;
+	case 0xb7: return &CPU::or8<0xb7>;
+	case 0xb8: return &CPU::cp<0xb8>;
+	case 0xb9: return &CPU::cp<0xb9>;
+	case 0xba: return &CPU::cp<0xba>;
+	case 0xbb: return &CPU::cp<0xbb>;
+	case 0xbc: return &CPU::cp<0xbc>;
+	case 0xbd: return &CPU::cp<0xbd>;
+	case 0xbe: return &CPU::cp<0xbe>;
+	case 0xbf: return &CPU::cp<0xbf>;
+	case 0xc0: return &CPU::ret<0xc0>;
+	case 0xc1: return &CPU::pop<0xc1>;
+	case 0xc2: return &CPU::jp16<0xc2>;
+	case 0xc3: return &CPU::jp16<0xc3>;
+	case 0xc4: return &CPU::call<0xc4>;
+	case 0xc5: return &CPU::push<0xc5>;
+	case 0xc6: return &CPU::add8<0xc6>;
+	case 0xc7: return &CPU::rst<0xc7>;
+	case 0xc8: return &CPU::ret<0xc8>;
+	case 0xc9: return &CPU::ret<0xc9>;
+	case 0xca: return &CPU::jp16<0xca>;
+	case 0xcb: return &CPU::prefix;
+	case 0xcc: return &CPU::call<0xcc>;
+	case 0xcd: return &CPU::call<0xcd>;
+	case 0xce: return &CPU::adc8<0xce>;
+	case 0xcf: return &CPU::rst<0xcf>;
+	case 0xd0: return &CPU::ret<0xd0>;
+	case 0xd1: return &CPU::pop<0xd1>;
+	case 0xd2: return &CPU::jp16<0xd2>;
+	case 0xd3: return &CPU::illegal;
+	case 0xd4: return &CPU::call<0xd4>;
+	case 0xd5: return &CPU::push<0xd5>;
+	case 0xd6: return &CPU::sub8<0xd6>;
+	case 0xd7: return &CPU::rst<0xd7>;
+	case 0xd8: return &CPU::ret<0xd8>;
+	case 0xd9: return &CPU::ret<0xd9>;
+	case 0xda: return &CPU::jp16<0xda>;
+	case 0xdb: return &CPU::illegal;
+	case 0xdc: return &CPU::call<0xdc>;
+	case 0xdd: return &CPU::illegal;
+	case 0xde: return &CPU::sbc8<0xde>;
+	case 0xdf: return &CPU::rst<0xdf>;
+	case 0xe0: return &CPU::ldff8<0xe0>;
+	case 0xe1: return &CPU::pop<0xe1>;
+	case 0xe2: return &CPU::ldff8<0xe2>;
+	case 0xe3: return &CPU::illegal;
+	case 0xe4: return &CPU::illegal;
+	case 0xe5: return &CPU::push<0xe5>;
+	case 0xe6: return &CPU::and8<0xe6>;
+	case 0xe7: return &CPU::rst<0xe7>;
+	case 0xe8: return &CPU::adds8<0xe8>;
+	case 0xe9: return &CPU::jp16<0xe9>;
+	case 0xea: return &CPU::ldr8<0xea>;
+	case 0xeb: return &CPU::illegal;
+	case 0xec: return &CPU::illegal;
+	case 0xed: return &CPU::illegal;
+	case 0xee: return &CPU::xor8<0xee>;
+	case 0xef: return &CPU::rst<0xef>;
+	case 0xf0: return &CPU::ldff8<0xf0>;
+	case 0xf1: return &CPU::pop<0xf1>;
+	case 0xf2: return &CPU::ldff8<0xf2>;
+	case 0xf3: return &CPU::misc<0xf3>;
+	case 0xf4: return &CPU::illegal;
+	case 0xf5: return &CPU::push<0xf5>;
+	case 0xf6: return &CPU::or8<0xf6>;
+	case 0xf7: return &CPU::rst<0xf7>;
+	case 0xf8: return &CPU::ldr16<0xf8>;
+	case 0xf9: return &CPU::ldr16<0xf9>;
+	case 0xfa: return &CPU::lda8<0xfa>;
+	case 0xfb: return &CPU::misc<0xfb>;
+	case 0xfc: return &CPU::illegal;
+	case 0xfd: return &CPU::illegal;
+	case 0xfe: return &CPU::cp<0xfe>;
+	case 0xff: return &CPU::rst<0xff>;
+	default:
+		return nullptr;
+	}
+}
+
+uint32_t CPU::update()
+{
+	m_wait_cycles = 0;
+
+	// -------------------------------------
+	// Low power modes
+
+	if (m_halted || m_stopped) {
+		// Nothing to do until an interrupt is pending, the other units keep running.
+		// STOP waits for a button press, but the joypad is not emulated, so any
+		// interrupt ends it, the same as HALT
+		if (!Emu::the().interrupts().pending()) {
+			return ProcessingUnit::idle;
+		}
+
+		m_halted = false;
+		m_stopped = false;
+	}
+
 	// -------------------------------------
 	// Interrupt Service Routine
 
 	bool effective_ime = m_ime;
 
-	// IME only becomes active after the instruction following EI
+	// IME only becomes active after the instruction following EI, so that
+	// instruction runs on its own before interrupts are checked again
+	bool single_step = m_should_enable_ime;
 	if (m_should_enable_ime) {
 		m_ime = 1;
 		m_should_enable_ime = 0;
 	}
 
-	if (effective_ime) {
-		// Get the 5 lower bits of the IE (interrupt enable) address
-		uint32_t interrupt_enabled = Emu::the().readMemory(0xffff) & 0x1f;
-		// Get the 5 lower bits of the IF (interrupt flag) address
-		uint32_t interrupt_flag = Emu::the().readMemory(0xff0f) & 0x1f;
-
-		uint32_t interrupt = interrupt_enabled & interrupt_flag;
-		for (uint8_t i = 0; i < 5; ++i) {
-			if (interrupt & BIT(i)) {
-				handleInterrupt(interrupt_flag, BIT(i), i * 8 + 0x40);
-				break;
-			}
-		}
+	if (effective_ime && Emu::the().interrupts().pending()) {
+		handleInterrupt(Emu::the().interrupts().next());
+		return m_wait_cycles;
 	}
 
 	// -------------------------------------
 	// Run opcodes
 
-	m_wait_cycles--;
-	// TODO: convert to early-return
-	if (m_wait_cycles <= 0) {
-
-		// print(ruc::format::Emphasis::Underline | ruc::format::Emphasis::Bold | fg(ruc::format::TerminalColor::Blue), "{:#06x}\n", *this);
-
-		// Read next opcode
-		uint8_t opcode = read(m_pc);
-		// print("running opcode: {:#04x} @ ({:#06x})\n", opcode, m_pc);
-		switch (opcode) {
-
-		case 0x10: /* TODO */ m_pc += 2; break;
-
-		case 0x00: nop(); break;
-		case 0x01: ldi16(); break;
-		case 0x02: ldr8(); break;
-		case 0x03: inc16(); break;
-		case 0x04: inc8(); break;
-		case 0x05: dec8(); break;
-		case 0x06: ldi8(); break;
-		case 0x07: ra(); break;
-		case 0x08: ldr16(); break;
-		case 0x09: addr16(); break;
-		case 0x0a: ldr8(); break;
-		case 0x0b: dec16(); break;
-		case 0x0c: inc8(); break;
-		case 0x0d: dec8(); break;
-		case 0x0e: ldi8(); break;
-		case 0x0f: ra(); break;
-		case 0x11: ldi16(); break;
-		case 0x12: ldr8(); break;
-		case 0x13: inc16(); break;
-		case 0x14: inc8(); break;
-		case 0x15: dec8(); break;
-		case 0x16: ldi8(); break;
-		case 0x17: ra(); break;
-		case 0x18: jrs8(); break;
-		case 0x19: addr16(); break;
-		case 0x1a: ldr8(); break;
-		case 0x1b: dec16(); break;
-		case 0x1c: inc8(); break;
-		case 0x1d: dec8(); break;
-		case 0x1e: ldi8(); break;
-		case 0x1f: ra(); break;
-		case 0x20: jrs8(); break;
-		case 0x21: ldi16(); break;
-		case 0x22: ldr8(); break;
-		case 0x23: inc16(); break;
-		case 0x24: inc8(); break;
-		case 0x25: dec8(); break;
-		case 0x26: ldi8(); break;
-		case 0x27: daa(); break;
-		case 0x28: jrs8(); break;
-		case 0x29: addr16(); break;
-		case 0x2a: lda8(); break;
-		case 0x2b: dec16(); break;
-		case 0x2c: inc8(); break;
-		case 0x2d: dec8(); break;
-		case 0x2e: ldi8(); break;
-		case 0x2f: misc(); break;
-		case 0x30: jrs8(); break;
-		case 0x31: ldi16(); break;
-		case 0x32: ldr8(); break;
-		case 0x33: inc16(); break;
-		case 0x34: inc8(); break;
-		case 0x35: dec8(); break;
-		case 0x36: ldi8(); break;
-		case 0x37: misc(); break;
-		case 0x38: jrs8(); break;
-		case 0x39: addr16(); break;
-		case 0x3a: lda8(); break;
-		case 0x3b: dec16(); break;
-		case 0x3c: inc8(); break;
-		case 0x3d: dec8(); break;
-		case 0x3e: ldi8(); break;
-		case 0x3f: misc(); break;
-		case 0x40: ldr8(); break;
-		case 0x41: ldr8(); break;
-		case 0x42: ldr8(); break;
-		case 0x43: ldr8(); break;
-		case 0x44: ldr8(); break;
-		case 0x45: ldr8(); break;
-		case 0x46: ldr8(); break;
-		case 0x47: ldr8(); break;
-		case 0x48: ldr8(); break;
-		case 0x49: ldr8(); break;
-		case 0x4a: ldr8(); break;
-		case 0x4b: ldr8(); break;
-		case 0x4c: ldr8(); break;
-		case 0x4d: ldr8(); break;
-		case 0x4e: ldr8(); break;
-		case 0x4f: ldr8(); break;
-		case 0x50: ldr8(); break;
-		case 0x51: ldr8(); break;
-		case 0x52: ldr8(); break;
-		case 0x53: ldr8(); break;
-		case 0x54: ldr8(); break;
-		case 0x55: ldr8(); break;
-		case 0x56: ldr8(); break;
-		case 0x57: ldr8(); break;
-		case 0x58: ldr8(); break;
-		case 0x59: ldr8(); break;
-		case 0x5a: ldr8(); break;
-		case 0x5b: ldr8(); break;
-		case 0x5c: ldr8(); break;
-		case 0x5d: ldr8(); break;
-		case 0x5e: ldr8(); break;
-		case 0x5f: ldr8(); break;
-		case 0x60: ldr8(); break;
-		case 0x61: ldr8(); break;
-		case 0x62: ldr8(); break;
-		case 0x63: ldr8(); break;
-		case 0x64: ldr8(); break;
-		case 0x65: ldr8(); break;
-		case 0x66: ldr8(); break;
-		case 0x67: ldr8(); break;
-		case 0x68: ldr8(); break;
-		case 0x69: ldr8(); break;
-		case 0x6a: ldr8(); break;
-		case 0x6b: ldr8(); break;
-		case 0x6c: ldr8(); break;
-		case 0x6d: ldr8(); break;
-		case 0x6e: ldr8(); break;
-		case 0x6f: ldr8(); break;
-		case 0x70: ldr8(); break;
-		case 0x71: ldr8(); break;
-		case 0x72: ldr8(); break;
-		case 0x73: ldr8(); break;
-		case 0x74: ldr8(); break;
-		case 0x75: ldr8(); break;
-		case 0x77: ldr8(); break;
-		case 0x78: ldr8(); break;
-		case 0x79: ldr8(); break;
-		case 0x7a: ldr8(); break;
-		case 0x7b: ldr8(); break;
-		case 0x7c: ldr8(); break;
-		case 0x7d: ldr8(); break;
-		case 0x7e: ldr8(); break;
-		case 0x7f: ldr8(); break;
-		case 0x80: add8(); break;
-		case 0x81: add8(); break;
-		case 0x82: add8(); break;
-		case 0x83: add8(); break;
-		case 0x84: add8(); break;
-		case 0x85: add8(); break;
-		case 0x86: add8(); break;
-		case 0x87: add8(); break;
-		case 0x88: adc8(); break;
-		case 0x89: adc8(); break;
-		case 0x8a: adc8(); break;
-		case 0x8b: adc8(); break;
-		case 0x8c: adc8(); break;
-		case 0x8d: adc8(); break;
-		case 0x8e: adc8(); break;
-		case 0x8f: adc8(); break;
-		case 0x90: sub8(); break;
-		case 0x91: sub8(); break;
-		case 0x92: sub8(); break;
-		case 0x93: sub8(); break;
-		case 0x94: sub8(); break;
-		case 0x95: sub8(); break;
-		case 0x96: sub8(); break;
-		case 0x97: sub8(); break;
-		case 0x98: sbc8(); break;
-		case 0x99: sbc8(); break;
-		case 0x9a: sbc8(); break;
-		case 0x9b: sbc8(); break;
-		case 0x9c: sbc8(); break;
-		case 0x9d: sbc8(); break;
-		case 0x9e: sbc8(); break;
-		case 0x9f: sbc8(); break;
-		case 0xa0: and8(); break;
-		case 0xa1: and8(); break;
-		case 0xa2: and8(); break;
-		case 0xa3: and8(); break;
-		case 0xa4: and8(); break;
-		case 0xa5: and8(); break;
-		case 0xa6: and8(); break;
-		case 0xa7: and8(); break;
-		case 0xa8: xor8(); break;
-		case 0xa9: xor8(); break;
-		case 0xaa: xor8(); break;
-		case 0xab: xor8(); break;
-		case 0xac: xor8(); break;
-		case 0xad: xor8(); break;
-		case 0xae: xor8(); break;
-		case 0xaf: xor8(); break;
-		case 0xb0: or8(); break;
-		case 0xb1: or8(); break;
-		case 0xb2: or8(); break;
-		case 0xb3: or8(); break;
-		case 0xb4: or8(); break;
-		case 0xb5: or8(); break;
-		case 0xb6: or8(); break;
-		case 0xb7: or8(); break;
-		case 0xb8: cp(); break;
-		case 0xb9: cp(); break;
-		case 0xba: cp(); break;
-		case 0xbb: cp(); break;
-		case 0xbc: cp(); break;
-		case 0xbd: cp(); break;
-		case 0xbe: cp(); break;
-		case 0xbf: cp(); break;
-		case 0xc0: ret(); break;
-		case 0xc1: pop(); break;
-		case 0xc2: jp16(); break;
-		case 0xc3: jp16(); break;
-		case 0xc4: call(); break;
-		case 0xc5: push(); break;
-		case 0xc6: add8(); break;
-		case 0xc7: rst(); break;
-		case 0xc8: ret(); break;
-		case 0xc9: ret(); break;
-		case 0xca: jp16(); break;
-		case 0xcb: prefix(); break;
-		case 0xcc: call(); break;
-		case 0xcd: call(); break;
-		case 0xce: adc8(); break;
-		case 0xcf: rst(); break;
-		case 0xd0: ret(); break;
-		case 0xd1: pop(); break;
-		case 0xd2: jp16(); break;
-		case 0xd4: call(); break;
-		case 0xd5: push(); break;
-		case 0xd6: sub8(); break;
-		case 0xd7: rst(); break;
-		case 0xd8: ret(); break;
-		case 0xd9: ret(); break;
-		case 0xda: jp16(); break;
-		case 0xdc: call(); break;
-		case 0xde: sbc8(); break;
-		case 0xdf: rst(); break;
-		case 0xe0: ldff8(); break;
-		case 0xe1: pop(); break;
-		case 0xe2: ldff8(); break;
-		case 0xe5: push(); break;
-		case 0xe6: and8(); break;
-		case 0xe7: rst(); break;
-		case 0xe8: adds8(); break;
-		case 0xe9: jp16(); break;
-		case 0xea: ldr8(); break;
-		case 0xee: xor8(); break;
-		case 0xef: rst(); break;
-		case 0xf0: ldff8(); break;
-		case 0xf1: pop(); break;
-		case 0xf2: ldff8(); break;
-		case 0xf3: misc(); break;
-		case 0xf5: push(); break;
-		case 0xf6: or8(); break;
-		case 0xf7: rst(); break;
-		case 0xf8: ldr16(); break;
-		case 0xf9: ldr16(); break;
-		case 0xfa: lda8(); break;
-		case 0xfb: misc(); break;
-		case 0xfe: cp(); break;
-		case 0xff: rst(); break;
-
-		case 0xd3:
-		case 0xdb:
-		case 0xdd:
-		case 0xe3:
-		case 0xe4:
-		case 0xeb:
-		case 0xec:
-		case 0xed:
-		case 0xf4:
-		case 0xfc:
-		case 0xfd:
-			print("illegal opcode\n");
-			VERIFY_NOT_REACHED();
-		default:
-			print("opcode {:#04x} not implemented\n", opcode);
-			print("immediate: {:#04x}\n", pcRead());
-			VERIFY_NOT_REACHED();
+	// Code in ROM is decoded once and then run a block at a time
+	if (m_pc < 0x8000 && !single_step) {
+		if (Block* block = findBlock()) {
+			runBlock(*block);
+			return m_wait_cycles;
 		}
 	}
-}
 
-// -------------------------------------
+	// print(ruc::format::Emphasis::Underline | ruc::format::Emphasis::Bold | fg(ruc::format::TerminalColor::Blue), "{:#06x}\n", *this);
 
-void CPU::adc8()
-{
-	auto adc = [this](uint8_t register_) -> void {
-		// ADC A,r8, flags: Z 0 H C
-		m_wait_cycles += 4;
+	// Handlers for every opcode, generated at compile time
+	static constexpr std::array<Instruction, 256> instructions = []() {
+		std::array<Instruction, 256> table {};
+		for (uint32_t opcode = 0; opcode < table.size(); ++opcode) {
+			table[opcode] = decode(opcode);
+		}
+		return table;
+	}();
 
-		uint32_t old_carry = m_cf != 0;
+	// Read next opcode
+	uint8_t opcode = pcRead();
+	// print("running opcode: {:#04x} @ ({:#06x})\n", opcode, m_pc - 1);
+	(this->*instructions[opcode])();
 
-		// Set flags
-		m_nf = 0;
-		m_hf = isCarry(0xf, m_a, register_, old_carry);
-		m_cf = isCarry(0xff, m_a, register_, old_carry);
+	return m_wait_cycles;
+}
 
-		// Add the value in r8 plus the carry flag to A
-		m_a = (m_a + register_ + old_carry) & 0xff;
+void CPU::saveState(StateWriter& state) const
+{
+	state.write(m_a);
+	state.write(m_b);
+	state.write(m_c);
+	state.write(m_d);
+	state.write(m_e);
+	state.write(m_h);
+	state.write(m_l);
+	state.write(m_pc);
+	state.write(m_sp);
+
+	state.write(m_f);
+	state.write(m_ime);
+	state.write(m_flag_operation);
+	state.write(m_flag_lhs);
+	state.write(m_flag_rhs);
+	state.write(m_flag_result);
+	state.write(m_flag_carry);
+
+	state.write(m_should_enable_ime);
+	state.write(m_halted);
+	state.write(m_stopped);
+}
 
-		// Zero flag
-		m_zf = (m_a == 0);
-	};
+void CPU::loadState(StateReader& state)
+{
+	state.read(m_a);
+	state.read(m_b);
+	state.read(m_c);
+	state.read(m_d);
+	state.read(m_e);
+	state.read(m_h);
+	state.read(m_l);
+	state.read(m_pc);
+	state.read(m_sp);
+
+	state.read(m_f);
+	state.read(m_ime);
+	state.read(m_flag_operation);
+	state.read(m_flag_lhs);
+	state.read(m_flag_rhs);
+	state.read(m_flag_result);
+	state.read(m_flag_carry);
+
+	state.read(m_should_enable_ime);
+	state.read(m_halted);
+	state.read(m_stopped);
+
+	// Decoded blocks are dropped by the Emu, as the memory they were decoded from changed
+}
 
-	uint8_t opcode = pcRead();
-	switch (opcode) {
-	case 0x88: /* ADC A,B */ adc(m_b); break;
-	case 0x89: /* ADC A,C */ adc(m_c); break;
-	case 0x8a: /* ADC A,D */ adc(m_d); break;
-	case 0x8b: /* ADC A,E */ adc(m_e); break;
-	case 0x8c: /* ADC A,H */ adc(m_h); break;
-	case 0x8d: /* ADC A,L */ adc(m_l); break;
-	case 0x8e: /* ADC A,(HL) */ {
-		m_wait_cycles += 4; // + 4 = 8 total
+// -----------------------------------------
 
-		adc(read(hl()));
-		break;
+constexpr uint32_t CPU::instructionLength(uint8_t opcode)
+{
+	switch (opcode) {
+	case 0x01: // LD BC,i16
+	case 0x08: // LD (a16),SP
+	case 0x11: // LD DE,i16
+	case 0x21: // LD HL,i16
+	case 0x31: // LD SP,i16
+	case 0xc2: // JP NZ,a16
+	case 0xc3: // JP a16
+	case 0xc4: // CALL NZ,a16
+	case 0xca: // JP Z,a16
+	case 0xcc: // CALL Z,a16
+	case 0xcd: // CALL a16
+	case 0xd2: // JP NC,a16
+	case 0xd4: // CALL NC,a16
+	case 0xda: // JP C,a16
+	case 0xdc: // CALL C,a16
+	case 0xea: // LD (a16),A
+	case 0xfa: // LD A,(a16)
+		return 3;
+	case 0x06: // LD B,i8
+	case 0x0e: // LD C,i8
+	case 0x10: // STOP
+	case 0x16: // LD D,i8
+	case 0x18: // JR s8
+	case 0x1e: // LD E,i8
+	case 0x20: // JR NZ,s8
+	case 0x26: // LD H,i8
+	case 0x28: // JR Z,s8
+	case 0x2e: // LD L,i8
+	case 0x30: // JR NC,s8
+	case 0x36: // LD (HL),i8
+	case 0x38: // JR C,s8
+	case 0x3e: // LD A,i8
+	case 0xc6: // ADD A,i8
+	case 0xcb: // PREFIX
+	case 0xce: // ADC A,i8
+	case 0xd6: // SUB A,i8
+	case 0xde: // SBC A,i8
+	case 0xe0: // LDH (a8),A
+	case 0xe6: // AND i8
+	case 0xe8: // ADD SP,s8
+	case 0xee: // XOR i8
+	case 0xf0: // LDH A,(a8)
+	case 0xf6: // OR i8
+	case 0xf8: // LD HL,SP+s8
+	case 0xfe: // CP i8
+		return 2;
+	default:
+		return 1;
 	}
-	case 0x8f: /* ADC A,A */ adc(m_a); break;
-	case 0xce: /* ADC A,i8 */ {
-		m_wait_cycles += 4; // + 4 = 8 total
+}
 
-		adc(pcRead());
-		break;
-	}
+constexpr bool CPU::endsBlock(uint8_t opcode)
+{
+	switch (opcode) {
+	// Jumps and subroutines
+	case 0x18: // JR s8
+	case 0x20: // JR NZ,s8
+	case 0x28: // JR Z,s8
+	case 0x30: // JR NC,s8
+	case 0x38: // JR C,s8
+	case 0xc0: // RET NZ
+	case 0xc2: // JP NZ,a16
+	case 0xc3: // JP a16
+	case 0xc4: // CALL NZ,a16
+	case 0xc7: // RST 0x00
+	case 0xc8: // RET Z
+	case 0xc9: // RET
+	case 0xca: // JP Z,a16
+	case 0xcc: // CALL Z,a16
+	case 0xcd: // CALL a16
+	case 0xcf: // RST 0x08
+	case 0xd0: // RET NC
+	case 0xd2: // JP NC,a16
+	case 0xd4: // CALL NC,a16
+	case 0xd7: // RST 0x10
+	case 0xd8: // RET C
+	case 0xd9: // RETI
+	case 0xda: // JP C,a16
+	case 0xdc: // CALL C,a16
+	case 0xdf: // RST 0x18
+	case 0xe7: // RST 0x20
+	case 0xe9: // JP HL
+	case 0xef: // RST 0x28
+	case 0xf7: // RST 0x30
+	case 0xff: // RST 0x38
+	// Accesses to I/O registers, or writes to ROM that switch banks
+	case 0xe0: // LDH (a8),A
+	case 0xe2: // LD (C),A
+	case 0xea: // LD (a16),A
+	case 0xf0: // LDH A,(a8)
+	case 0xf2: // LD A,(C)
+	case 0xfa: // LD A,(a16)
+	// Interrupts and low power modes
+	case 0x10: // STOP
+	case 0x76: // HALT
+	case 0xf3: // DI
+	case 0xfb: // EI
+		return true;
 	default:
-		VERIFY_NOT_REACHED();
+		return false;
 	}
 }
 
-void CPU::add8()
+CPU::Block* CPU::findBlock()
 {
-	auto add = [this](uint8_t register_) -> void {
-		// ADD A,r8, flags: Z 0 H C
-		m_wait_cycles += 4;
+	const uint8_t* code = Emu::the().readPointer(m_pc);
+	if (!code) {
+		return nullptr;
+	}
 
-		// Set flags
-		m_nf = 0;
-		m_hf = isCarry(0xf, m_a, register_);
-		m_cf = isCarry(0xff, m_a, register_);
+	// Memory was remapped or ROM was written to, the decoded code might be stale
+	if (m_blocks_generation != Emu::the().romGeneration()) {
+		m_blocks.clear();
+		m_blocks_generation = Emu::the().romGeneration();
+#ifdef GARBAGE_JIT
+		m_jit.reset();
+#endif
+	}
 
-		// Add the value in r8 to A
-		m_a = (m_a + register_) & 0xff;
+	auto it = m_blocks.find(code);
+	if (it == m_blocks.end()) {
+		it = m_blocks.emplace(code, buildBlock()).first;
+	}
 
-		// Zero flag
-		m_zf = m_a == 0;
-	};
+	return &it->second;
+}
 
-	uint8_t opcode = pcRead();
-	switch (opcode) {
-	case 0x80: /* ADD A,B */ add(m_b); break;
-	case 0x81: /* ADD A,C */ add(m_c); break;
-	case 0x82: /* ADD A,D */ add(m_d); break;
-	case 0x83: /* ADD A,E */ add(m_e); break;
-	case 0x84: /* ADD A,H */ add(m_h); break;
-	case 0x85: /* ADD A,L */ add(m_l); break;
-	case 0x86: /* ADD A,(HL) */ {
-		m_wait_cycles += 4; // + 4 = 8 total
+CPU::Block CPU::buildBlock() const
+{
+	// Bounds how far the CPU runs ahead of the other processing units
+	constexpr size_t max_instructions = 32;
+
+	Block block;
+
+	uint32_t pc = m_pc;
+	while (block.instructions.size() < max_instructions) {
+		uint8_t opcode = Emu::the().readMemory(pc);
+		block.instructions.push_back(decode(opcode));
+#ifdef GARBAGE_JIT
+		block.addresses.push_back(pc);
+#endif
+		if (endsBlock(opcode)) {
+			break;
+		}
 
-		add(read(hl()));
-		break;
+		// Stop at the end of the 16KiB ROM bank, or when running into a trapped page
+		pc += instructionLength(opcode);
+		if (((pc ^ m_pc) & 0xc000) || !Emu::the().readPointer(pc)) {
+			break;
+		}
 	}
-	case 0x87: /* ADD A,A */ add(m_a); break;
-	case 0xc6: /* ADD A,i8 */ {
-		m_wait_cycles += 4; // + 4 = 8 total
 
-		add(pcRead());
-		break;
+	return block;
+}
+
+void CPU::runBlock(Block& block)
+{
+#ifdef GARBAGE_JIT
+	if (m_jit_enabled && !block.code && ++block.executions == jit_threshold) {
+		compileBlock(block);
 	}
-	default:
-		VERIFY_NOT_REACHED();
+
+	if (m_jit_enabled && block.code) {
+		if (m_jit_differential) {
+			runBlockDifferential(block);
+			return;
+		}
+
+		m_block_trapped_writes = Emu::the().trappedWrites();
+		m_block_volatile_reads = m_volatile_reads;
+		block.code(this);
+
+		// The interpreter splits the block at the read, see interpretBlock()
+		if (m_volatile_reads != m_block_volatile_reads) {
+			block.code = nullptr;
+			block.executions = 0;
+		}
+		return;
 	}
+#endif
+
+	interpretBlock(block);
 }
 
-void CPU::and8()
+void CPU::interpretBlock(Block& block)
 {
-	auto bitwise_and = [this](uint32_t byte) {
-		// AND r8, flags: Z 0 1 0
-		m_wait_cycles += 4;
+	uint32_t trapped_writes = Emu::the().trappedWrites();
+	uint32_t volatile_reads = m_volatile_reads;
+	size_t size = block.instructions.size();
+	for (size_t i = 0; i < size; ++i) {
+		// Skip the opcode, it has already been decoded
+		m_pc++;
+		(this->*block.instructions[i])();
+
+		// A register was read through a pointer, while the block ran ahead of
+		// the other units. From now on the block ends before that instruction,
+		// so it starts a block of its own, which runs on time and ends after it
+		if (m_volatile_reads != volatile_reads) {
+			size = std::max<size_t>(i, 1);
+			block.instructions.resize(size);
+#ifdef GARBAGE_JIT
+			block.addresses.resize(size);
+			block.code = nullptr;
+			block.executions = 0;
+#endif
+			break;
+		}
 
-		// Set flags
-		m_nf = 0;
-		m_hf = 1;
-		m_cf = 0;
+		// A bank was switched or a register was written to, the rest of the
+		// block might be stale, or has to see the effect of the write first
+		if (Emu::the().trappedWrites() != trapped_writes) {
+			break;
+		}
+	}
+}
 
-		// Bitwise AND between the value in r8 and A
-		m_a = m_a & byte;
+// -------------------------------------
 
-		// Zero flag
-		m_zf = m_a == 0;
-	};
+template<uint8_t opcode>
+void CPU::adc8()
+{
+	// ADC A,r8 0x88-0x8f, ADC A,i8 0xce, flags: Z 0 H C
+	m_wait_cycles += 4;
 
-	uint8_t opcode = pcRead();
-	switch (opcode) {
-	case 0xa0: /* AND B */ bitwise_and(m_b); break;
-	case 0xa1: /* AND C */ bitwise_and(m_c); break;
-	case 0xa2: /* AND D */ bitwise_and(m_d); break;
-	case 0xa3: /* AND E */ bitwise_and(m_e); break;
-	case 0xa4: /* AND H */ bitwise_and(m_h); break;
-	case 0xa5: /* AND L */ bitwise_and(m_l); break;
-	case 0xa6: /* AND (HL) */ {
-		m_wait_cycles += 4; // + 4 = 8 total
+	uint8_t value = operand8<sourceOperand(opcode)>();
+	uint8_t old_carry = cf();
 
-		// Bitwise AND between the byte pointed to by HL and A
-		bitwise_and(read(hl()));
-		break;
-	}
-	case 0xa7: /* AND A */ bitwise_and(m_a); break;
-	case 0xe6: /* AND i8 */ {
-		m_wait_cycles += 4; // + 4 = 8 total
+	// Add the value plus the carry flag to A
+	uint8_t result = m_a + value + old_carry;
+	deferFlags(FlagOperation::Add, m_a, value, result, old_carry);
+	m_a = result;
+}
 
-		// Bitwise AND between the value in i8 and A
-		bitwise_and(pcRead());
-		break;
-	}
-	default:
-		VERIFY_NOT_REACHED();
-	}
+template<uint8_t opcode>
+void CPU::add8()
+{
+	// ADD A,r8 0x80-0x87, ADD A,i8 0xc6, flags: Z 0 H C
+	m_wait_cycles += 4;
+
+	uint8_t value = operand8<sourceOperand(opcode)>();
+
+	// Add the value to A
+	uint8_t result = m_a + value;
+	deferFlags(FlagOperation::Add, m_a, value, result);
+	m_a = result;
 }
 
-void CPU::cp()
+template<uint8_t opcode>
+void CPU::and8()
 {
-	auto compare = [this](uint32_t register_) -> void {
-		// CP A,r8, flags: Z 1 H C
-		m_wait_cycles += 4;
+	// AND r8 0xa0-0xa7, AND i8 0xe6, flags: Z 0 1 0
+	m_wait_cycles += 4;
 
-		// Subtract the value in r8 from A and set flags accordingly,
-		// but don't store the result
+	uint8_t value = operand8<sourceOperand(opcode)>();
 
-		// Set flags
-		// Zero flag
-		m_zf = ((m_a - register_) & 0xff) == 0;
-		m_nf = 1;
-		m_hf = isCarrySubtraction(0xf, m_a, register_);
-		m_cf = isCarrySubtraction(0xff, m_a, register_);
-	};
+	// Bitwise AND between the value and A
+	uint8_t result = m_a & value;
+	deferFlags(FlagOperation::And, m_a, value, result);
+	m_a = result;
+}
 
-	uint8_t opcode = pcRead();
-	switch (opcode) {
-	case 0xb8: /* CP A,B */ compare(m_b); break;
-	case 0xb9: /* CP A,C */ compare(m_c); break;
-	case 0xba: /* CP A,D */ compare(m_d); break;
-	case 0xbb: /* CP A,E */ compare(m_e); break;
-	case 0xbc: /* CP A,H */ compare(m_h); break;
-	case 0xbd: /* CP A,L */ compare(m_l); break;
-	case 0xbe: /* CP A,(HL) */ {
-		m_wait_cycles += 4; // + 4 = 8 total
+template<uint8_t opcode>
+void CPU::cp()
+{
+	// CP A,r8 0xb8-0xbf, CP A,i8 0xfe, flags: Z 1 H C
+	m_wait_cycles += 4;
 
-		// Subtract the byte pointed to by HL from A and set flags accordingly,
-		// but don't store the result
-		compare(read(hl()));
-		break;
-	}
-	case 0xbf: /* CP A,A */ compare(m_a); break;
-	case 0xfe: /* CP A,i8 */ {
-		m_wait_cycles += 4; // + 4 = 8 total
+	uint8_t value = operand8<sourceOperand(opcode)>();
 
-		// Subtract the value i8 from A and set flags accordingly,
-		// but don't store the result
-		compare(pcRead());
-		break;
-	}
-	default:
-		VERIFY_NOT_REACHED();
-	}
+	// Subtract the value from A and set flags accordingly,
+	// but don't store the result
+	deferFlags(FlagOperation::Subtract, m_a, value, m_a - value);
 }
 
+template<uint8_t opcode>
 void CPU::daa()
 {
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x27: { // DAA, flags: Z - 0 C
 		m_wait_cycles += 4;
@@ -595,32 +750,33 @@ void CPU::daa()
 		//         (meaning that the lower nibble value is > 15),
 		//         add decimal 6 to the lower nibble to make it wrap around
 
-		if (!m_nf) {
-			if (m_cf || m_a > 0x99) {
+		bool subtraction = nf();
+		bool half_carry = hf();
+		bool carry = cf();
+
+		if (!subtraction) {
+			if (carry || m_a > 0x99) {
 				m_a += 0x60;
 				// Carry flag
-				m_cf = 1;
+				carry = true;
 			}
 
-			if (m_hf || (m_a & 0xf) > 0x9) {
+			if (half_carry || (m_a & 0xf) > 0x9) {
 				m_a += 0x6;
 			}
 		}
 		else {
-			if (m_cf) {
+			if (carry) {
 				m_a -= 0x60;
 			}
 
-			if (m_hf) {
+			if (half_carry) {
 				m_a -= 0x6;
 			}
 		}
 
-		m_a = m_a & 0xff;
-
 		// Set flags
-		m_zf = (m_a == 0);
-		m_hf = 0;
+		setFlags(m_a == 0, subtraction, 0, carry);
 		break;
 	}
 	default:
@@ -628,271 +784,96 @@ void CPU::daa()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::dec8()
 {
-	auto decrement = [this](uint32_t& register_) -> void {
-		// DEC r8, flags: Z 1 H -
-		m_wait_cycles += 4;
-
-		// Set flags
-		m_nf = 1;
-		m_hf = isCarrySubtraction(0xf, register_, 1);
+	// DEC r8 0x05-0x3d, flags: Z 1 H -
+	m_wait_cycles += 4;
 
-		// Decrement value in register r8 by 1
-		register_ = (register_ - 1) & 0xff;
+	constexpr Operand operand = destinationOperand(opcode);
+	uint8_t value = operand8<operand>();
 
-		// Zero flag
-		m_zf = (register_ == 0);
-	};
-
-	uint8_t opcode = pcRead();
-	switch (opcode) {
-	case 0x05: /* DEC B */ decrement(m_b); break;
-	case 0x0d: /* DEC C */ decrement(m_c); break;
-	case 0x15: /* DEC D */ decrement(m_d); break;
-	case 0x1d: /* DEC E */ decrement(m_e); break;
-	case 0x25: /* DEC H */ decrement(m_h); break;
-	case 0x2d: /* DEC L */ decrement(m_l); break;
-	case 0x35: /* DEC (HL) */ {
-		m_wait_cycles += 8; // + 4 = 12 total
-
-		// Decrement the byte pointed to by HL by 1
-		uint32_t data = read(hl());
-		decrement(data);
-		write(hl(), data);
-		break;
-	}
-	case 0x3d: /* DEC A */ decrement(m_a); break;
-	default:
-		VERIFY_NOT_REACHED();
-	}
+	// Decrement value by 1
+	uint8_t result = value - 1;
+	deferFlags(FlagOperation::Decrement, value, 1, result, cf());
+	setOperand8<operand>(result);
 }
 
+template<uint8_t opcode>
 void CPU::inc8()
 {
-	auto increment = [this](uint32_t& register_) -> void {
-		// INC r8, flags: Z 0 H -
-		m_wait_cycles += 4;
-
-		// Set flags
-		m_nf = 0;
-		m_hf = isCarry(0xf, register_, 1);
-
-		// Increment value in register r8 by 1
-		register_ = (register_ + 1) & 0xff;
+	// INC r8 0x04-0x3c, flags: Z 0 H -
+	m_wait_cycles += 4;
 
-		// Zero flag
-		m_zf = register_ == 0;
-	};
+	constexpr Operand operand = destinationOperand(opcode);
+	uint8_t value = operand8<operand>();
 
-	uint8_t opcode = pcRead();
-	switch (opcode) {
-	case 0x04: /* INC B */ increment(m_b); break;
-	case 0x0c: /* INC C */ increment(m_c); break;
-	case 0x14: /* INC D */ increment(m_d); break;
-	case 0x1c: /* INC E */ increment(m_e); break;
-	case 0x24: /* INC H */ increment(m_h); break;
-	case 0x2c: /* INC L */ increment(m_l); break;
-	case 0x34: /* INC (HL) */ {
-		m_wait_cycles += 8; // + 4 = 12 total
-
-		// Increment the byte pointed to by HL by 1
-		uint32_t data = read(hl());
-		increment(data);
-		write(hl(), data);
-		break;
-	}
-	case 0x3c: /* INC A */ increment(m_a); break;
-	default:
-		VERIFY_NOT_REACHED();
-	}
+	// Increment value by 1
+	uint8_t result = value + 1;
+	deferFlags(FlagOperation::Increment, value, 1, result, cf());
+	setOperand8<operand>(result);
 }
 
+template<uint8_t opcode>
 void CPU::or8()
 {
-	auto bitwise_or = [this](uint32_t register_) {
-		// OR r8, flags: Z 0 0 0
-		m_wait_cycles += 4;
-
-		// Set flags
-		m_nf = m_hf = m_cf = 0;
-
-		// Store into A the bitwise OR of the value in r8 and A
-		m_a = m_a | register_;
-
-		// Zero flag
-		m_zf = m_a == 0;
-	};
+	// OR A,r8 0xb0-0xb7, OR A,i8 0xf6, flags: Z 0 0 0
+	m_wait_cycles += 4;
 
-	uint8_t opcode = pcRead();
-	switch (opcode) {
-	case 0xb0: /* OR A,B */ bitwise_or(m_b); break;
-	case 0xb1: /* OR A,C */ bitwise_or(m_c); break;
-	case 0xb2: /* OR A,D */ bitwise_or(m_d); break;
-	case 0xb3: /* OR A,E */ bitwise_or(m_e); break;
-	case 0xb4: /* OR A,H */ bitwise_or(m_h); break;
-	case 0xb5: /* OR A,L */ bitwise_or(m_l); break;
-	case 0xb6: /* OR A,(HL) */ {
-		m_wait_cycles += 4; // + 4 = 8 total
+	uint8_t value = operand8<sourceOperand(opcode)>();
 
-		// Store into A the bitwise OR of the byte pointed to by HL and A
-		bitwise_or(read(hl()));
-		break;
-	}
-	case 0xb7: /* OR A,A */ bitwise_or(m_a); break;
-	case 0xf6: /* OR A,i8 */ {
-		m_wait_cycles += 4; // + 4 = 8 total
-
-		// Store into A the bitwise OR of i8 and A
-		bitwise_or(pcRead());
-		break;
-	}
-	default:
-		VERIFY_NOT_REACHED();
-	}
+	// Store into A the bitwise OR of the value and A
+	uint8_t result = m_a | value;
+	deferFlags(FlagOperation::Or, m_a, value, result);
+	m_a = result;
 }
 
+template<uint8_t opcode>
 void CPU::sbc8()
 {
-	auto subtract_carry = [this](uint32_t register_) -> void {
-		// SBC A,r8, flags: Z 1 H C
-		m_wait_cycles += 4;
-
-		uint32_t old_carry = m_cf != 0;
-
-		// Set flags
-		m_nf = 1;
-		m_hf = isCarrySubtraction(0xf, m_a, register_, old_carry);
-		m_cf = isCarrySubtraction(0xff, m_a, register_, old_carry);
-
-		// Subtract the value in r8 and the carry flag from A
-		m_a = (m_a - register_ - old_carry) & 0xff;
-
-		// Zero flag
-		m_zf = (m_a == 0);
-	};
-
-	uint8_t opcode = pcRead();
-	switch (opcode) {
-	case 0x98: /* SBC A,B */ subtract_carry(m_b); break;
-	case 0x99: /* SBC A,C */ subtract_carry(m_c); break;
-	case 0x9a: /* SBC A,D */ subtract_carry(m_d); break;
-	case 0x9b: /* SBC A,E */ subtract_carry(m_e); break;
-	case 0x9c: /* SBC A,H */ subtract_carry(m_h); break;
-	case 0x9d: /* SBC A,L */ subtract_carry(m_l); break;
-	case 0x9e: /* SBC A,(HL) */ {
-		m_wait_cycles += 4; // + 4 = 8 total
+	// SBC A,r8 0x98-0x9f, SBC A,i8 0xde, flags: Z 1 H C
+	m_wait_cycles += 4;
 
-		// Subtract the byte pointed to by HL and the carry flag from A
-		subtract_carry(read(hl()));
-		break;
-	}
-	case 0x9f: /* SBC A,A */ subtract_carry(m_a); break;
-	case 0xde: /* SBC A,i8 */ {
-		m_wait_cycles += 4; // + 4 = 8 total
+	uint8_t value = operand8<sourceOperand(opcode)>();
+	uint8_t old_carry = cf();
 
-		// Subtract the value i8 and the carry flag from A
-		subtract_carry(pcRead());
-		break;
-	}
-	default:
-		VERIFY_NOT_REACHED();
-	}
+	// Subtract the value and the carry flag from A
+	uint8_t result = m_a - value - old_carry;
+	deferFlags(FlagOperation::Subtract, m_a, value, result, old_carry);
+	m_a = result;
 }
 
+template<uint8_t opcode>
 void CPU::sub8()
 {
-	auto subtract = [this](uint32_t register_) -> void {
-		// SUB A,r8, flags: Z 1 H C
-		m_wait_cycles += 4;
-
-		// Set flags
-		m_nf = 1;
-		m_hf = isCarrySubtraction(0xf, m_a, register_);
-		m_cf = isCarrySubtraction(0xff, m_a, register_);
-
-		// Subtract the value in r8 from A
-		m_a = (m_a - register_) & 0xff;
-
-		// Zero flag
-		m_zf = m_a == 0;
-	};
-
-	uint8_t opcode = pcRead();
-	switch (opcode) {
-	case 0x90: /* SUB A,B */ subtract(m_b); break;
-	case 0x91: /* SUB A,C */ subtract(m_c); break;
-	case 0x92: /* SUB A,D */ subtract(m_d); break;
-	case 0x93: /* SUB A,E */ subtract(m_e); break;
-	case 0x94: /* SUB A,H */ subtract(m_h); break;
-	case 0x95: /* SUB A,L */ subtract(m_l); break;
-	case 0x96: /* SUB A,(HL) */ {
-		m_wait_cycles += 4; // + 4 = 8 total
+	// SUB A,r8 0x90-0x97, SUB A,i8 0xd6, flags: Z 1 H C
+	m_wait_cycles += 4;
 
-		// Subtract the byte pointed to by HL from A
-		subtract(read(hl()));
-		break;
-	}
-	case 0x97: /* SUB A,A */ subtract(m_a); break;
-	case 0xd6: /* SUB A,i8 */ {
-		m_wait_cycles += 4; // + 4 = 8 total
+	uint8_t value = operand8<sourceOperand(opcode)>();
 
-		// Subtract the value i8 from A
-		subtract(pcRead());
-		break;
-	}
-	default:
-		VERIFY_NOT_REACHED();
-	}
+	// Subtract the value from A
+	uint8_t result = m_a - value;
+	deferFlags(FlagOperation::Subtract, m_a, value, result);
+	m_a = result;
 }
 
+template<uint8_t opcode>
 void CPU::xor8()
 {
-	auto bitwise_xor = [this](uint32_t register_) {
-		// XOR r8, flags: Z 0 0 0
-		m_wait_cycles += 4;
-
-		// Set flags
-		m_nf = m_hf = m_cf = 0;
-
-		// Bitwise XOR between the value in r8 and A
-		m_a = m_a ^ register_;
-
-		// Zero flag
-		m_zf = m_a == 0;
-	};
-
-	uint8_t opcode = pcRead();
-	switch (opcode) {
-	case 0xa8: /* XOR A,B */ bitwise_xor(m_b); break;
-	case 0xa9: /* XOR A,C */ bitwise_xor(m_c); break;
-	case 0xaa: /* XOR A,D */ bitwise_xor(m_d); break;
-	case 0xab: /* XOR A,E */ bitwise_xor(m_e); break;
-	case 0xac: /* XOR A,H */ bitwise_xor(m_h); break;
-	case 0xad: /* XOR A,L */ bitwise_xor(m_l); break;
-	case 0xae: /* XOR A,(HL) */ {
-		m_wait_cycles += 4; // + 4 = 8 total
+	// XOR A,r8 0xa8-0xaf, XOR A,i8 0xee, flags: Z 0 0 0
+	m_wait_cycles += 4;
 
-		// Bitwise XOR between the byte pointed to by HL and A
-		bitwise_xor(read(hl()));
-		break;
-	}
-	case 0xaf: /* XOR A,A */ bitwise_xor(m_a); break;
-	case 0xee: /* XOR A,i8 */ {
-		m_wait_cycles += 4; // + 4 = 8 total
+	uint8_t value = operand8<sourceOperand(opcode)>();
 
-		// Bitwise XOR between the value in i8 and A
-		bitwise_xor(pcRead());
-		break;
-	}
-	default:
-		VERIFY_NOT_REACHED();
-	}
+	// Bitwise XOR between the value and A
+	uint8_t result = m_a ^ value;
+	deferFlags(FlagOperation::Or, m_a, value, result);
+	m_a = result;
 }
 
+template<uint8_t opcode>
 void CPU::lda8()
 {
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x2a: { // LD A,(HL+) == LD A,(HLI) == LDI A,(HL)
 		m_wait_cycles += 8;
@@ -931,6 +912,7 @@ void CPU::lda8()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::addr16()
 {
 	auto add = [this](uint32_t register_) -> void {
@@ -938,9 +920,7 @@ void CPU::addr16()
 		m_wait_cycles += 8;
 
 		// Set flags
-		m_nf = 0;
-		m_hf = isCarry(0xfff, hl(), register_);
-		m_cf = isCarry(0xffff, hl(), register_);
+		setFlags(zf(), 0, isCarry(0xfff, hl(), register_), isCarry(0xffff, hl(), register_));
 
 		// Add the value in r16 to HL
 		uint32_t data = (hl() + register_) & 0xffff;
@@ -948,7 +928,6 @@ void CPU::addr16()
 		m_h = data >> 8;
 	};
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x09: /* ADD HL,BC */ add(bc()); break;
 	case 0x19: /* ADD HL,DE */ add(de()); break;
@@ -959,9 +938,9 @@ void CPU::addr16()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::adds8()
 {
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0xe8: { // ADD SP,s8, flags: 0 0 H C
 		m_wait_cycles += 16;
@@ -969,10 +948,7 @@ void CPU::adds8()
 		uint32_t signed_data = (pcRead() ^ 0x80) - 0x80;
 
 		// Set flags
-		m_zf = 0;
-		m_nf = 0;
-		m_hf = isCarry(0xf, m_sp, signed_data);
-		m_cf = isCarry(0xff, m_sp, signed_data);
+		setFlags(0, 0, isCarry(0xf, m_sp, signed_data), isCarry(0xff, m_sp, signed_data));
 
 		// Add the signed value s8 to SP
 		m_sp = m_sp + signed_data;
@@ -983,9 +959,9 @@ void CPU::adds8()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::dec16()
 {
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x0b: /* DEC BC */ setBC(bc() - 1); break;
 	case 0x1b: /* DEC DE */ setDE(de() - 1); break;
@@ -998,9 +974,9 @@ void CPU::dec16()
 	m_wait_cycles += 8;
 }
 
+template<uint8_t opcode>
 void CPU::inc16()
 {
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x03: /* INC BC */ setBC(bc() + 1); break;
 	case 0x13: /* INC DE */ setDE(de() + 1); break;
@@ -1015,9 +991,9 @@ void CPU::inc16()
 
 // -------------------------------------
 
+template<uint8_t opcode>
 void CPU::ldi8()
 {
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x06: /* LD B,i8 */ m_b = pcRead(); break;
 	case 0x0e: /* LD C,i8 */ m_c = pcRead(); break;
@@ -1037,9 +1013,9 @@ void CPU::ldi8()
 	m_wait_cycles += 8;
 }
 
+template<uint8_t opcode>
 void CPU::ldr8()
 {
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x02: /* LD (BC),A */ {
 		m_wait_cycles += 4; // + 4 = 8 total
@@ -1221,12 +1197,11 @@ void CPU::ldr8()
 }
 
 // Rotate accumulator
+template<uint8_t opcode>
 void CPU::ra()
 {
-	// Make sure we only look at the bottom 8 bits
-	m_a = m_a & 0xff;
+	bool carry = false;
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x07: // RLCA
 
@@ -1238,7 +1213,7 @@ void CPU::ra()
 		//            A
 
 		// Copy bit 7 into carry flag
-		m_cf = (m_a & 0x80) == 0x80;
+		carry = (m_a & 0x80) == 0x80;
 
 		// Rotate register A left
 		m_a = ((m_a >> 7) | (m_a << 1)) & 0xff;
@@ -1253,7 +1228,7 @@ void CPU::ra()
 		//         A
 
 		// Copy bit 0 into carry flag
-		m_cf = (m_a & 0x1) == 0x1;
+		carry = (m_a & 0x1) == 0x1;
 
 		// Rotate register A right
 		m_a = ((m_a >> 1) | (m_a << 7)) & 0xff;
@@ -1268,8 +1243,8 @@ void CPU::ra()
 		//              A
 
 		// Copy bit 7 into carry flag
-		uint32_t old_carry = m_cf != 0;
-		m_cf = (m_a & 0x80) == 0x80;
+		uint32_t old_carry = cf();
+		carry = (m_a & 0x80) == 0x80;
 
 		// Rotate register A left through carry
 		m_a = (old_carry | (m_a << 1)) & 0xff;
@@ -1285,8 +1260,8 @@ void CPU::ra()
 		//         A
 
 		// Copy bit 0 into carry flag
-		uint32_t old_carry = m_cf != 0;
-		m_cf = (m_a & 0x1) == 0x1;
+		uint32_t old_carry = cf();
+		carry = (m_a & 0x1) == 0x1;
 
 		// Rotate register A right through carry
 		m_a = ((m_a >> 1) | (old_carry << 7)) & 0xff;
@@ -1300,14 +1275,12 @@ void CPU::ra()
 	m_wait_cycles += 4;
 
 	// Set flags
-	m_zf = 0;
-	m_nf = 0;
-	m_hf = 0;
+	setFlags(0, 0, 0, carry);
 }
 
+template<uint8_t opcode>
 void CPU::ldff8()
 {
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0xe0: // LD (0xff00 + s8),A == LDH (io8),A
 		m_wait_cycles += 12;
@@ -1338,9 +1311,9 @@ void CPU::ldff8()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::ldi16()
 {
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x01: /* LD BC,i16 */
 		m_c = pcRead();
@@ -1364,9 +1337,9 @@ void CPU::ldi16()
 	m_wait_cycles += 12;
 }
 
+template<uint8_t opcode>
 void CPU::ldr16()
 {
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x08: { // LD a16,SP
 		m_wait_cycles += 20;
@@ -1387,10 +1360,7 @@ void CPU::ldr16()
 		m_h = sum >> 8;
 
 		// Set flags
-		m_zf = 0;
-		m_nf = 0;
-		m_hf = isCarry(0xf, m_sp, signed_data);
-		m_cf = isCarry(0xff, m_sp, signed_data);
+		setFlags(0, 0, isCarry(0xf, m_sp, signed_data), isCarry(0xff, m_sp, signed_data));
 		break;
 	}
 	case 0xf9: { // LD SP,HL
@@ -1405,9 +1375,10 @@ void CPU::ldr16()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::pop()
 {
-	auto pop_stack = [this](uint32_t& register_high, uint32_t& register_low) -> void {
+	auto pop_stack = [this](uint8_t& register_high, uint8_t& register_low) -> void {
 		// POP r16
 		m_wait_cycles += 12;
 
@@ -1418,20 +1389,16 @@ void CPU::pop()
 		m_sp = (m_sp + 1) & 0xffff;
 	};
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0xc1: /* POP BC */ pop_stack(m_b, m_c); break;
 	case 0xd1: /* POP DE */ pop_stack(m_d, m_e); break;
 	case 0xe1: /* POP HL */ pop_stack(m_h, m_l); break;
 	case 0xf1: /* POP AF, flags: Z N H C */ {
-		uint32_t data;
+		uint8_t data;
 		pop_stack(m_a, data);
 
-		// Set flags
-		m_zf = (data & 0x80) == 0x80; // bit 7 of the popped low byte
-		m_nf = (data & 0x40) == 0x40; // bit 6 ,,
-		m_hf = (data & 0x20) == 0x20; // bit 5 ,,
-		m_cf = (data & 0x10) == 0x10; // bit 4 ,,
+		// Set flags from bits 7-4 of the popped low byte
+		setFlags(data & 0x80, data & 0x40, data & 0x20, data & 0x10);
 		break;
 	}
 	default:
@@ -1439,6 +1406,7 @@ void CPU::pop()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::push()
 {
 	auto push_into_stack = [this](uint32_t register_) -> void {
@@ -1452,7 +1420,6 @@ void CPU::push()
 		write(m_sp, register_ & 0xff); // lsb(r16)
 	};
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0xc5: /* PUSH BC */ push_into_stack(bc()); break;
 	case 0xd5: /* PUSH DE */ push_into_stack(de()); break;
@@ -1463,6 +1430,7 @@ void CPU::push()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::call()
 {
 	auto function_call = [this](bool should_call) -> void {
@@ -1488,18 +1456,18 @@ void CPU::call()
 		m_pc = data;
 	};
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
-	case 0xc4: /* CALL NZ,i16 */ function_call(!m_zf); break;
-	case 0xcc: /* CALL Z,i16 */ function_call(m_zf); break;
+	case 0xc4: /* CALL NZ,i16 */ function_call(!zf()); break;
+	case 0xcc: /* CALL Z,i16 */ function_call(zf()); break;
 	case 0xcd: /* CALL i16 */ function_call(true); break;
-	case 0xd4: /* CALL NC,i16 */ function_call(!m_cf); break;
-	case 0xdc: /* CALL C,i16 */ function_call(m_cf); break;
+	case 0xd4: /* CALL NC,i16 */ function_call(!cf()); break;
+	case 0xdc: /* CALL C,i16 */ function_call(cf()); break;
 	default:
 		VERIFY_NOT_REACHED();
 	}
 }
 
+template<uint8_t opcode>
 void CPU::jp16()
 {
 	auto jump = [this](bool should_jump) -> void {
@@ -1518,13 +1486,12 @@ void CPU::jp16()
 		m_pc = data;
 	};
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
-	case 0xc2: /* JP NZ,a16 */ jump(!m_zf); break;
+	case 0xc2: /* JP NZ,a16 */ jump(!zf()); break;
 	case 0xc3: /* JP a16 */ jump(true); break;
-	case 0xca: /* JP Z,a16 */ jump(m_zf); break;
-	case 0xd2: /* JP NC,a16 */ jump(!m_cf); break;
-	case 0xda: /* JP C,a16 */ jump(m_cf); break;
+	case 0xca: /* JP Z,a16 */ jump(zf()); break;
+	case 0xd2: /* JP NC,a16 */ jump(!cf()); break;
+	case 0xda: /* JP C,a16 */ jump(cf()); break;
 	case 0xe9: // JP HL
 		m_wait_cycles += 4;
 
@@ -1536,6 +1503,7 @@ void CPU::jp16()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::jrs8()
 {
 	auto jump_relative = [this](bool should_jump) -> void {
@@ -1554,18 +1522,18 @@ void CPU::jrs8()
 		m_pc = (m_pc + signed_data) & 0xffff;
 	};
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x18: /* JR s8 */ jump_relative(true); break;
-	case 0x20: /* JR NZ,s8 */ jump_relative(!m_zf); break;
-	case 0x28: /* JR Z,s8 */ jump_relative(m_zf); break;
-	case 0x30: /* JR NC,s8 */ jump_relative(!m_cf); break;
-	case 0x38: /* JR C,s8 */ jump_relative(m_cf); break;
+	case 0x20: /* JR NZ,s8 */ jump_relative(!zf()); break;
+	case 0x28: /* JR Z,s8 */ jump_relative(zf()); break;
+	case 0x30: /* JR NC,s8 */ jump_relative(!cf()); break;
+	case 0x38: /* JR C,s8 */ jump_relative(cf()); break;
 	default:
 		VERIFY_NOT_REACHED();
 	}
 }
 
+template<uint8_t opcode>
 void CPU::ret()
 {
 	auto function_return = [this](bool should_call) -> void {
@@ -1585,13 +1553,12 @@ void CPU::ret()
 		m_sp = (m_sp + 1) & 0xffff;
 	};
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
-	case 0xc0: /* RET NZ,i16 */ function_return(!m_zf); break;
-	case 0xc8: /* RET Z,i16 */ function_return(m_zf); break;
+	case 0xc0: /* RET NZ,i16 */ function_return(!zf()); break;
+	case 0xc8: /* RET Z,i16 */ function_return(zf()); break;
 	case 0xc9: /* RET i16 */ function_return(true); break;
-	case 0xd0: /* RET NC,i16 */ function_return(!m_cf); break;
-	case 0xd8: /* RET C,i16 */ function_return(m_cf); break;
+	case 0xd0: /* RET NC,i16 */ function_return(!cf()); break;
+	case 0xd8: /* RET C,i16 */ function_return(cf()); break;
 	case 0xd9: /* RETI */ {
 		// Return from subroutine
 		function_return(true);
@@ -1603,6 +1570,7 @@ void CPU::ret()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::rst()
 {
 	auto function_call = [this](uint32_t fixed_address) -> void {
@@ -1619,7 +1587,6 @@ void CPU::rst()
 		m_pc = fixed_address;
 	};
 
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0xc7: /* RST 0x00 */ function_call(0x00); break;
 	case 0xcf: /* RST 0x08 */ function_call(0x08); break;
@@ -1634,10 +1601,27 @@ void CPU::rst()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::misc()
 {
-	uint8_t opcode = pcRead();
 	switch (opcode) {
+	case 0x10: { // STOP
+		m_wait_cycles += 4;
+
+		// Skip the padding byte
+		pcRead();
+
+		// On CGB, STOP performs the speed switch if it was armed in KEY1
+		uint8_t key1 = read(0xff4d);
+		if (Emu::the().mode() == Emu::Mode::CGB && (key1 & 0x1)) {
+			write(0xff4d, (key1 ^ 0x80) & 0xfe);
+			break;
+		}
+
+		// Enter very low power mode, until a button is pressed, see update()
+		m_stopped = true;
+		break;
+	}
 	case 0x2f: // CPL, flags: - 1 1 -
 		m_wait_cycles += 4;
 
@@ -1645,22 +1629,26 @@ void CPU::misc()
 		m_a = (~m_a) & 0xff;
 
 		// Set flags
-		m_nf = m_hf = 1;
+		setFlags(zf(), 1, 1, cf());
 		break;
 	case 0x37: // SCF, flags: - 0 0 1
 		m_wait_cycles += 4;
 
 		// Set flags
-		m_nf = m_hf = 0;
-		m_cf = 1;
+		setFlags(zf(), 0, 0, 1);
 		break;
 	case 0x3f: // CCF, flags: - 0 0 C
 		m_wait_cycles += 4;
 
-		// Set flags
-		m_nf = m_hf = 0;
-		// Invert carry
-		m_cf = (m_cf) ? 0 : 1;
+		// Set flags, invert carry
+		setFlags(zf(), 0, 0, !cf());
+		break;
+	case 0x76: // HALT
+		m_wait_cycles += 4;
+
+		// Enter low power mode until an interrupt is pending, which is then
+		// serviced if IME is set. Note: the HALT bug is not emulated
+		m_halted = true;
 		break;
 	case 0xf3: // DI
 		m_wait_cycles += 4;
@@ -1680,9 +1668,9 @@ void CPU::misc()
 	}
 }
 
+template<uint8_t opcode>
 void CPU::nop()
 {
-	uint8_t opcode = pcRead();
 	switch (opcode) {
 	case 0x0: /* NOP */ m_wait_cycles += 4; break;
 	default:
@@ -1690,6 +1678,12 @@ void CPU::nop()
 	}
 }
 
+void CPU::illegal()
+{
+	print("illegal opcode {:#04x}\n", read((m_pc - 1) & 0xffff));
+	VERIFY_NOT_REACHED();
+}
+
 // -----------------------------------------
 
 void CPU::setBC(uint32_t value)
@@ -1710,34 +1704,116 @@ void CPU::setHL(uint32_t value)
 	m_h = (value & 0xff00) >> 8;
 }
 
+template<CPU::Operand operand>
+uint8_t& CPU::register8()
+{
+	static_assert(operand != Operand::HL && operand != Operand::Immediate, "Operand is not a register");
+
+	if constexpr (operand == Operand::B) {
+		return m_b;
+	}
+	else if constexpr (operand == Operand::C) {
+		return m_c;
+	}
+	else if constexpr (operand == Operand::D) {
+		return m_d;
+	}
+	else if constexpr (operand == Operand::E) {
+		return m_e;
+	}
+	else if constexpr (operand == Operand::H) {
+		return m_h;
+	}
+	else if constexpr (operand == Operand::L) {
+		return m_l;
+	}
+	else {
+		return m_a;
+	}
+}
+
+template<CPU::Operand operand>
+uint8_t CPU::operand8()
+{
+	if constexpr (operand == Operand::HL) {
+		m_wait_cycles += 4;
+		return read(hl());
+	}
+	else if constexpr (operand == Operand::Immediate) {
+		m_wait_cycles += 4;
+		return pcRead();
+	}
+	else {
+		return register8<operand>();
+	}
+}
+
+template<CPU::Operand operand>
+void CPU::setOperand8(uint8_t value)
+{
+	static_assert(operand != Operand::Immediate, "Immediate operand is read-only");
+
+	if constexpr (operand == Operand::HL) {
+		m_wait_cycles += 4;
+		write(hl(), value);
+	}
+	else {
+		register8<operand>() = value;
+	}
+}
+
 // -----------------------------------------
 
 uint32_t CPU::pcRead()
 {
-	uint32_t data = Emu::the().readMemory(m_pc) & 0xff;
+	uint32_t data = Emu::the().readMemory(m_pc);
 	m_pc = (m_pc + 1) & 0xffff;
 	return data;
 }
 
 void CPU::write(uint32_t address, uint32_t value)
 {
-	Emu::the().writeMemory(address, value & 0xff);
+#ifdef GARBAGE_JIT
+	if (m_defer_writes) {
+		m_deferred_writes.emplace_back(address, value);
+		m_deferred_side_effects |= Emu::the().writeHasSideEffects(address);
+		return;
+	}
+	if (m_record_writes) {
+		m_recorded_writes.emplace_back(address, value);
+	}
+#endif
+
+	Emu::the().writeMemory(address, value);
 }
 
 uint32_t CPU::read(uint32_t address)
 {
-	// FIXME: Figure out where HL gets set to above 0xffff
-	return Emu::the().readMemory(address & 0xffff) & 0xff;
+	if (Emu::the().readIsVolatile(address)) {
+		m_volatile_reads++;
+	}
+
+#ifdef GARBAGE_JIT
+	if (m_defer_writes) {
+		for (auto it = m_deferred_writes.rbegin(); it != m_deferred_writes.rend(); ++it) {
+			if (it->first == address) {
+				return it->second;
+			}
+		}
+	}
+#endif
+
+	return Emu::the().readMemory(address);
 }
 
 void CPU::ffWrite(uint32_t address, uint32_t value)
 {
-	Emu::the().writeMemory(address | (0xff << 8), value & 0xff);
+	write(address | (0xff << 8), value);
 }
 
 uint32_t CPU::ffRead(uint32_t address)
 {
-	return Emu::the().readMemory(address | (0xff << 8)) & 0xff;
+	return read(address | (0xff << 8));
 }
 
 bool CPU::isCarry(uint32_t limit_bit, uint32_t first, uint32_t second, uint32_t third)
@@ -1750,6 +1826,62 @@ bool CPU::isCarrySubtraction(uint32_t limit_bit, uint32_t lhs, uint32_t rhs, uin
 	return (lhs & limit_bit) < (rhs & limit_bit) + (rhs_extra & limit_bit);
 }
 
+uint8_t CPU::flags() const
+{
+	bool subtraction = false;
+	bool half_carry = false;
+
+	switch (m_flag_operation) {
+	case FlagOperation::None:
+		return m_f;
+	case FlagOperation::Add:
+		half_carry = isCarry(0xf, m_flag_lhs, m_flag_rhs, m_flag_carry);
+		break;
+	case FlagOperation::Subtract:
+		subtraction = true;
+		half_carry = isCarrySubtraction(0xf, m_flag_lhs, m_flag_rhs, m_flag_carry);
+		break;
+	case FlagOperation::And:
+		half_carry = true;
+		break;
+	case FlagOperation::Or:
+		break;
+	case FlagOperation::Increment:
+		half_carry = isCarry(0xf, m_flag_lhs, 1);
+		break;
+	case FlagOperation::Decrement:
+		subtraction = true;
+		half_carry = isCarrySubtraction(0xf, m_flag_lhs, 1);
+		break;
+	default:
+		VERIFY_NOT_REACHED();
+	}
+
+	return (m_flag_result == 0) << 7 | subtraction << 6 | half_carry << 5 | carry() << 4;
+}
+
+bool CPU::carry() const
+{
+	switch (m_flag_operation) {
+	case FlagOperation::None:
+		return (m_f & Flag::Carry) != 0;
+	case FlagOperation::Add:
+		return isCarry(0xff, m_flag_lhs, m_flag_rhs, m_flag_carry);
+	case FlagOperation::Subtract:
+		return isCarrySubtraction(0xff, m_flag_lhs, m_flag_rhs, m_flag_carry);
+	case FlagOperation::And:
+	case FlagOperation::Or:
+		return false;
+	case FlagOperation::Increment:
+	case FlagOperation::Decrement:
+		return m_flag_carry;
+	default:
+		VERIFY_NOT_REACHED();
+	}
+
+	return false;
+}
+
 // -----------------------------------------
 
 void Formatter<CPU>::parse(Parser& parser)
@@ -7,10 +7,16 @@
 
 #pragma once
 
-#include <cstdint>    // int8_t, uint8_t, uint32_t
+#include <array>
+#include <cstddef>    // size_t
+#include <cstdint>    // uint8_t, uint16_t, uint32_t
 #include <functional> // std::function
 #include <unordered_map>
+#include <utility> // std::index_sequence, std::pair
+#include <vector>
 
+#include "interrupt-controller.h"
+#include "jit.h"
 #include "processing-unit.h"
 #include "ruc/format/formatter.h"
 
@@ -22,73 +28,115 @@ public:
 	explicit CPU(uint32_t frequency);
 	virtual ~CPU();
 
-	void handleInterrupt(uint32_t interrupt_flag, uint8_t interrupt_source, uint8_t address);
-	void update() override;
+	void handleInterrupt(InterruptController::Interrupt interrupt);
+	uint32_t update() override;
+	void saveState(StateWriter& state) const override;
+	void loadState(StateReader& state) override;
 
 	// -------------------------------------
 	// Arithmetic and Logic Instructions
 
 	// 8-bit
+	template<uint8_t opcode>
 	void adc8();
+	template<uint8_t opcode>
 	void add8();
+	template<uint8_t opcode>
 	void and8();
+	template<uint8_t opcode>
 	void cp();
+	template<uint8_t opcode>
 	void daa();
+	template<uint8_t opcode>
 	void dec8();
+	template<uint8_t opcode>
 	void inc8();
+	template<uint8_t opcode>
 	void or8();
+	template<uint8_t opcode>
 	void sbc8();
+	template<uint8_t opcode>
 	void sub8();
+	template<uint8_t opcode>
 	void xor8();
 
 	// 16-bit
+	template<uint8_t opcode>
 	void addr16();
+	template<uint8_t opcode>
 	void adds8();
+	template<uint8_t opcode>
 	void dec16();
+	template<uint8_t opcode>
 	void inc16();
 
 	// -------------------------------------
 	// Bit Operations Instructions
 
+	template<uint8_t opcode>
 	void bit();
+	template<uint8_t opcode>
 	void res();
+	template<uint8_t opcode>
 	void set();
+	template<uint8_t opcode>
 	void swap();
 
 	// -------------------------------------
 	// Bit Shift Instructions
 
+	template<uint8_t opcode>
 	void ra();
+	template<uint8_t opcode>
 	void rl();
+	template<uint8_t opcode>
 	void rlc();
+	template<uint8_t opcode>
 	void rr();
+	template<uint8_t opcode>
 	void rrc();
+	template<uint8_t opcode>
 	void sla();
+	template<uint8_t opcode>
 	void sra();
+	template<uint8_t opcode>
 	void srl();
 
 	// -------------------------------------
 	// Load Instructions
 
 	// 8-bit
+	template<uint8_t opcode>
 	void lda8();
+	template<uint8_t opcode>
 	void ldff8();
+	template<uint8_t opcode>
 	void ldi8();
+	template<uint8_t opcode>
 	void ldr8();
 
 	// 16-bit
+	template<uint8_t opcode>
 	void ldi16();
+	template<uint8_t opcode>
 	void ldr16();
+	template<uint8_t opcode>
 	void pop();
+	template<uint8_t opcode>
 	void push();
 
 	// -------------------------------------
 	// Jumps and Subroutines
 
+	template<uint8_t opcode>
 	void call();
+	template<uint8_t opcode>
 	void jp16();
+	template<uint8_t opcode>
 	void jrs8();
+	template<uint8_t opcode>
 	void ret();
+	template<uint8_t opcode>
 	void rst();
 
 	// -------------------------------------
@@ -97,7 +145,9 @@ public:
 	// -------------------------------------
 	// Miscellaneous Instructions
 
+	template<uint8_t opcode>
 	void misc();
+	template<uint8_t opcode>
 	void nop();
 	void prefix();
 
@@ -107,23 +157,99 @@ public:
 	uint32_t b() const { return m_b; }
 	uint32_t c() const { return m_c; }
 
-	uint32_t af() const { return (m_cf << 4 | m_hf << 5 | m_nf << 6 | m_zf << 7) | m_a << 8; }
+	uint32_t af() const { return flags() | m_a << 8; }
 	uint32_t bc() const { return m_c | m_b << 8; }
 	uint32_t de() const { return m_e | m_d << 8; }
 	uint32_t hl() const { return m_l | m_h << 8; }
 	uint32_t pc() const { return m_pc; }
 	uint32_t sp() const { return m_sp; }
 
-	uint32_t zf() const { return m_zf; }
-	uint32_t nf() const { return m_nf; }
-	uint32_t hf() const { return m_hf; }
-	uint32_t cf() const { return m_cf; }
+	// Every ALU result is stored, so the zero flag is cheap to evaluate
+	uint32_t zf() const { return (m_flag_operation != FlagOperation::None) ? m_flag_result == 0 : (m_f & Flag::Zero) != 0; }
+	uint32_t nf() const { return (flags() & Flag::Subtraction) != 0; }
+	uint32_t hf() const { return (flags() & Flag::HalfCarry) != 0; }
+	uint32_t cf() const { return carry(); }
 
 	void setBC(uint32_t value);
 	void setDE(uint32_t value);
 	void setHL(uint32_t value);
 
+#ifdef GARBAGE_JIT
+	void setJIT(bool enabled) { m_jit_enabled = enabled; }
+	// Also run every native block through the interpreter and verify both
+	// end up with the same registers, program counter and cycles
+	void setJITDifferential(bool enabled) { m_jit_differential = enabled; }
+#endif
+
 private:
+	using Instruction = void (CPU::*)();
+
+	// 8-bit operand, in the order it is encoded in the opcode
+	enum class Operand : uint8_t {
+		B,
+		C,
+		D,
+		E,
+		H,
+		L,
+		HL, // Byte pointed to by HL
+		A,
+		Immediate, // Byte following the opcode
+	};
+
+	// Opcode dispatch, resolved at compile time
+	static constexpr Instruction decode(uint8_t opcode);
+	template<size_t... opcodes>
+	static constexpr std::array<Instruction, 256> prefixTable(std::index_sequence<opcodes...>);
+	template<uint8_t opcode>
+	void executePrefix();
+	static Instruction decodePrefix(uint8_t opcode);
+
+	// Operand in the lowest 3 bits, the 0xc0-0xff range uses the immediate byte
+	static constexpr Operand sourceOperand(uint8_t opcode)
+	{
+		return (opcode >= 0xc0) ? Operand::Immediate : static_cast<Operand>(opcode & 0x7);
+	}
+	// Operand in bits 3-5
+	static constexpr Operand destinationOperand(uint8_t opcode) { return static_cast<Operand>((opcode >> 3) & 0x7); }
+
+	template<Operand operand>
+	uint8_t& register8();
+	template<Operand operand>
+	uint8_t operand8();
+	template<Operand operand>
+	void setOperand8(uint8_t value);
+
+	void illegal();
+
+	// Straight-line run of ROM code, decoded once
+	struct Block {
+		std::vector<Instruction> instructions;
+#ifdef GARBAGE_JIT
+		std::vector<uint16_t> addresses; // Address of every instruction
+		JIT::Code code { nullptr };
+		uint32_t executions { 0 };
+#endif
+	};
+
+	static constexpr uint32_t instructionLength(uint8_t opcode);
+	static constexpr bool endsBlock(uint8_t opcode);
+
+	Block* findBlock();
+	Block buildBlock() const;
+	void runBlock(Block& block);
+	void interpretBlock(Block& block);
+
+#ifdef GARBAGE_JIT
+	// Number of runs before a block is compiled to native code
+	static constexpr uint32_t jit_threshold = 16;
+
+	void compileBlock(Block& block);
+	bool emitBlock(Block& block);
+	void runBlockDifferential(Block& block);
+	static bool jitContinue(void* context);
+#endif
+
 	uint32_t pcRead();
 	uint32_t pcRead16() { return pcRead() | (pcRead() << 8); }
 
@@ -133,29 +259,95 @@ private:
 	void ffWrite(uint32_t address, uint32_t value);
 	uint32_t ffRead(uint32_t address);
 
-	bool isCarry(uint32_t limit_bit, uint32_t first, uint32_t second, uint32_t third = 0x0);
-	bool isCarrySubtraction(uint32_t limit_bit, uint32_t lhs, uint32_t rhs, uint32_t rhs_extra = 0x0);
+	static bool isCarry(uint32_t limit_bit, uint32_t first, uint32_t second, uint32_t third = 0x0);
+	static bool isCarrySubtraction(uint32_t limit_bit, uint32_t lhs, uint32_t rhs, uint32_t rhs_extra = 0x0);
+
+	// Flag bits in the F register
+	enum Flag : uint8_t {
+		Carry = 0x10,
+		HalfCarry = 0x20,
+		Subtraction = 0x40, // BCD
+		Zero = 0x80,
+	};
+
+	// Operation that set the flags, which are only computed once they are read
+	enum class FlagOperation : uint8_t {
+		None, // Flags are stored in m_f
+		Add,
+		Subtract,
+		And,
+		Or, // Also used by XOR
+		Increment,
+		Decrement,
+	};
+
+	uint8_t flags() const;
+	bool carry() const;
+
+	void setFlags(bool zero, bool subtraction, bool half_carry, bool carry)
+	{
+		m_f = zero << 7 | subtraction << 6 | half_carry << 5 | carry << 4;
+		m_flag_operation = FlagOperation::None;
+	}
+
+	void deferFlags(FlagOperation operation, uint8_t lhs, uint8_t rhs, uint8_t result, uint8_t carry = 0)
+	{
+		m_flag_operation = operation;
+		m_flag_lhs = lhs;
+		m_flag_rhs = rhs;
+		m_flag_result = result;
+		m_flag_carry = carry;
+	}
 
 	// Registers
-	uint32_t m_a { 0 };  // Accumulator
-	uint32_t m_b { 0 };  // B
-	uint32_t m_c { 0 };  // C
-	uint32_t m_d { 0 };  // D
-	uint32_t m_e { 0 };  // E
-	uint32_t m_h { 0 };  // H
-	uint32_t m_l { 0 };  // L
-	uint32_t m_pc { 0 }; // Program Counter
-	uint32_t m_sp { 0 }; // Stack Pointer
+	uint8_t m_a { 0 };   // Accumulator
+	uint8_t m_b { 0 };   // B
+	uint8_t m_c { 0 };   // C
+	uint8_t m_d { 0 };   // D
+	uint8_t m_e { 0 };   // E
+	uint8_t m_h { 0 };   // H
+	uint8_t m_l { 0 };   // L
+	uint16_t m_pc { 0 }; // Program Counter
+	uint16_t m_sp { 0 }; // Stack Pointer
 
 	// Flags
-	uint32_t m_zf { 0 };  // Zero flag
-	uint32_t m_nf { 0 };  // Subtraction flag (BCD)
-	uint32_t m_hf { 0 };  // Half Carry flag (BCD)
-	uint32_t m_cf { 0 };  // Carry flag
+	uint8_t m_f { 0 };    // Zero, Subtraction, Half Carry and Carry flag
 	uint32_t m_ime { 0 }; // Interrupt Master Enable flag
 
+	// Last deferred flag operation
+	FlagOperation m_flag_operation { FlagOperation::None };
+	uint8_t m_flag_lhs { 0 };
+	uint8_t m_flag_rhs { 0 };
+	uint8_t m_flag_result { 0 };
+	uint8_t m_flag_carry { 0 }; // Carry into the operation, or the carry kept by INC/DEC
+
 	bool m_should_enable_ime { 0 };
-	int8_t m_wait_cycles { 0 };
+	bool m_halted { false };  // HALT, waiting for an interrupt
+	bool m_stopped { false }; // STOP, waiting for a button press, or an interrupt
+	uint32_t m_wait_cycles { 0 }; // Cycles taken by the current instruction, or block
+	uint32_t m_volatile_reads { 0 }; // Reads of registers that the other units change
+
+	// Decoded ROM code, keyed on the host memory of its first opcode, as
+	// that identifies both the bank and the address
+	std::unordered_map<const uint8_t*, Block> m_blocks;
+	uint32_t m_blocks_generation { 0 };
+
+#ifdef GARBAGE_JIT
+	JIT m_jit { 4 * 1024 * 1024 };
+	bool m_jit_enabled { true };
+	uint32_t m_block_trapped_writes { 0 }; // Trapped writes when the running native block was entered
+	uint32_t m_block_volatile_reads { 0 };
+
+	// Native code runs ahead of the interpreter in differential mode, its
+	// writes are kept here instead of reaching memory
+	bool m_jit_differential { false };
+	bool m_defer_writes { false };
+	bool m_deferred_side_effects { false };
+	std::vector<std::pair<uint16_t, uint8_t>> m_deferred_writes;
+	bool m_record_writes { false }; // The interpreter writes through, but keeps them here to compare
+	std::vector<std::pair<uint16_t, uint8_t>> m_recorded_writes;
+	std::vector<uint8_t> m_differential_state;
+#endif
 };
 
 template<>
@@ -5,65 +5,585 @@
  * SPDX-License-Identifier: MIT
  */
 
-#include <cstdint> // uint32_t
+#include <algorithm> // std::fill, std::max, std::min
+#include <chrono>    // std::chrono::nanoseconds
+#include <cstdint>   // int64_t, uint8_t, uint16_t, uint32_t, uint64_t
+#include <cstring>   // memcmp, memcpy
 #include <string_view>
-#include <utility> // std::move
+#include <thread>    // std::this_thread::sleep_for
+#include <utility>   // std::move, std::pair
 #include <vector>
 
 #include "cpu.h"
 #include "emu.h"
 #include "loader.h"
+#include "ppu.h"
 #include "ruc/format/log.h"
 #include "ruc/format/print.h"
 #include "ruc/meta/assert.h"
+#include "save-state.h"
 
 void Emu::init(uint32_t frequency)
 {
 	m_frequency = frequency;
-	m_timestep = 1.0 / m_frequency * 1000000;
+
+	// The PPU draws a frame every 70224 clocks of the 4 MHz system clock
+	m_frame_cycles = static_cast<uint64_t>(CLOCKS_PER_FRAME) * m_frequency / 4000000;
+	m_frame_time = m_frame_cycles * 1000000000.0 / m_frequency;
 }
 
 void Emu::update()
 {
-	double time = m_timer.elapsedNanoseconds() / 1000.0;
-	m_cycle_time += (time - m_previous_time);
-	m_previous_time = time;
-	if (m_cycle_time > m_timestep) {
-		for (auto unit : m_processing_units) {
-			if (m_cycle % (m_frequency / unit.second->frequency()) == 0) {
-				unit.second->update();
-			}
-		}
-		m_cycle_time -= m_timestep;
-		m_cycle++;
+	// The clock is only read once per frame, not for every cycle
+	run(m_frame_cycles);
+	sync();
+}
+
+void Emu::run(uint64_t cycles)
+{
+	// Run as fast as the host allows, without syncing to the wall clock
+	uint64_t target = m_cycle + cycles;
+	while (!m_events.empty() && m_events.top().cycle < target) {
+		step();
 	}
+	m_cycle = target;
 }
 
 void Emu::addProcessingUnit(std::string_view name, std::shared_ptr<ProcessingUnit> processing_unit)
 {
-	m_processing_units.emplace(name, processing_unit);
+	if (!m_processing_units.emplace(name, processing_unit).second) {
+		return;
+	}
+
+	m_events.push({
+		.cycle = m_cycle,
+		.order = static_cast<uint32_t>(m_processing_units.size()),
+		.clock_divider = m_frequency / processing_unit->frequency(),
+		.processing_unit = processing_unit.get(),
+	});
 }
 
 void Emu::addMemorySpace(std::string_view name, uint32_t start_address, uint32_t end_adress, uint32_t amount_of_banks)
 {
-	uint32_t bank_length = 1 + end_adress - start_address;
+	uint32_t bank_size = 1 + end_adress - start_address;
+	MemorySpace memory_space {
+		.memory = std::vector<uint8_t>(amount_of_banks * bank_size),
+		.amount_of_banks = amount_of_banks,
+		.active_bank = 0,
+		.start_address = start_address,
+		.end_address = end_adress,
+	};
+
+	m_memory_spaces.emplace(name, std::move(memory_space));
+	updatePageTable();
+}
+
+void Emu::addMemorySpace(std::string_view name, uint32_t start_address, uint32_t end_adress, uint32_t amount_of_banks, uint8_t* memory)
+{
 	MemorySpace memory_space {
-		.memory = BankedMemory(amount_of_banks, std::vector<uint32_t>(bank_length)),
+		.memory = {},
+		.external_memory = memory,
+		.amount_of_banks = amount_of_banks,
 		.active_bank = 0,
 		.start_address = start_address,
 		.end_address = end_adress,
 	};
 
 	m_memory_spaces.emplace(name, std::move(memory_space));
+	updatePageTable();
 }
 
 void Emu::removeMemorySpace(std::string_view name)
 {
 	m_memory_spaces.erase(name);
+	updatePageTable();
+}
+
+void Emu::switchBank(std::string_view name, uint32_t bank)
+{
+	auto& memory_space = m_memory_spaces.at(name);
+	VERIFY(bank < memory_space.amount_of_banks, "switching to non-existent bank '{}' of '{}'", bank, name);
+
+	memory_space.active_bank = bank;
+	mapMemorySpace(memory_space);
+	m_map_generation++;
+}
+
+void Emu::setCartridgeRamTrapped(bool trapped)
+{
+	if (trapped == m_cartridge_ram_trapped) {
+		return;
+	}
+
+	m_cartridge_ram_trapped = trapped;
+	if (trapped) {
+		std::fill(m_read_pages.begin() + 0xa0, m_read_pages.begin() + 0xc0, nullptr);
+		std::fill(m_write_pages.begin() + 0xa0, m_write_pages.begin() + 0xc0, nullptr);
+	}
+	else if (hasMemorySpace("CARTRAM")) {
+		mapMemorySpace(m_memory_spaces.at("CARTRAM"));
+	}
+	m_map_generation++;
+}
+
+void Emu::vsync()
+{
+	m_vsyncs.fetch_add(1, std::memory_order_release);
+	m_vsyncs.notify_one();
+}
+
+void Emu::wake()
+{
+	for (Event& event : m_idle_events) {
+		// Resume at the first cycle of the unit that has not passed yet
+		if (event.cycle < m_cycle) {
+			uint64_t clocks = (m_cycle - event.cycle + event.clock_divider - 1) / event.clock_divider;
+			event.cycle += clocks * event.clock_divider;
+		}
+		m_events.push(event);
+	}
+	m_idle_events.clear();
+}
+
+// -----------------------------------------
+
+// "GBST", changes to the layout of any of the parts bump the version
+static constexpr uint32_t state_magic = 0x54534247;
+static constexpr uint16_t state_version = 2;
+// Granularity at which incremental snapshots store memory
+static constexpr uint32_t state_page_size = 256;
+
+static bool isStateMemorySpace(const MemorySpace& memory_space)
+{
+	// ROM does not change, only the selected bank is stored
+	return memory_space.start_address >= 0x8000;
+}
+
+void Emu::saveState(std::vector<uint8_t>& buffer, Snapshot snapshot)
+{
+	// Without a previous snapshot there is nothing to compare against
+	if (snapshot == Snapshot::Incremental && m_snapshot_id == 0) {
+		snapshot = Snapshot::Full;
+	}
+
+	bool detached = snapshot == Snapshot::Detached;
+	uint32_t base_id = (detached) ? 0 : m_snapshot_id; // Base of an incremental snapshot
+	uint32_t id = (detached) ? 0 : ++m_snapshot_count;
+
+	StateWriter state(buffer);
+	state.write(state_magic);
+	state.write(state_version);
+	state.write(snapshot);
+	state.write(base_id);
+	state.write(id);
+	if (!detached) {
+		m_snapshot_id = id;
+	}
+
+	state.write(hasMemorySpace("BOOTROM1"));
+	state.write(m_cycle);
+	state.write(m_interrupts.enable());
+	state.write(m_interrupts.flag());
+	state.write(m_lcd_register_writes);
+	state.write(m_palette_writes);
+	state.write(m_cartridge_ram_trapped);
+
+	state.write(static_cast<uint32_t>(m_memory_spaces.size()));
+	for (auto& [name, memory_space] : m_memory_spaces) {
+		state.writeString(name);
+		state.write(memory_space.active_bank);
+
+		uint32_t size = isStateMemorySpace(memory_space) ? memory_space.amount_of_banks * memory_space.bankSize() : 0;
+		state.write(size);
+		if (size == 0) {
+			continue;
+		}
+
+		// Memory spaces added since the previous snapshot are stored in full
+		const uint8_t* memory = memory_space.data();
+		std::vector<uint8_t>& snapshot_memory = m_snapshot_memory[name];
+		bool full = snapshot != Snapshot::Incremental || snapshot_memory.size() != size;
+		state.write(full);
+		if (full) {
+			if (!detached) {
+				snapshot_memory.assign(memory, memory + size);
+			}
+			state.writeBytes(memory, size);
+			continue;
+		}
+
+		// Compare against the previous snapshot, this is cheaper than
+		// tracking every write on the fast path of writeMemory
+		m_changed_pages.clear();
+		for (uint32_t offset = 0; offset < size; offset += state_page_size) {
+			uint32_t page_size = std::min(state_page_size, size - offset);
+			if (memcmp(memory + offset, snapshot_memory.data() + offset, page_size) != 0) {
+				memcpy(snapshot_memory.data() + offset, memory + offset, page_size);
+				m_changed_pages.push_back(offset / state_page_size);
+			}
+		}
+
+		state.write(static_cast<uint32_t>(m_changed_pages.size()));
+		for (uint32_t page : m_changed_pages) {
+			uint32_t offset = page * state_page_size;
+			state.write(page);
+			state.writeBytes(memory + offset, std::min(state_page_size, size - offset));
+		}
+	}
+
+	state.write(m_cartridge != nullptr);
+	if (m_cartridge) {
+		m_cartridge->saveState(state);
+	}
+
+	state.write(static_cast<uint32_t>(m_processing_units.size()));
+	for (const auto& [name, processing_unit] : m_processing_units) {
+		state.writeString(name);
+		processing_unit->saveState(state);
+	}
+
+	// Scheduler, the units are stored by name
+	std::vector<std::pair<Event, bool>> events;
+	for (auto queue = m_events; !queue.empty(); queue.pop()) {
+		events.push_back({ queue.top(), false });
+	}
+	for (const Event& event : m_idle_events) {
+		events.push_back({ event, true });
+	}
+
+	state.write(static_cast<uint32_t>(events.size()));
+	for (const auto& [event, idle] : events) {
+		for (const auto& [name, processing_unit] : m_processing_units) {
+			if (processing_unit.get() == event.processing_unit) {
+				state.writeString(name);
+				break;
+			}
+		}
+		state.write(event.cycle);
+		state.write(event.order);
+		state.write(event.clock_divider);
+		state.write(idle);
+	}
+}
+
+void Emu::loadState(std::span<const uint8_t> buffer)
+{
+	StateReader state(buffer);
+	VERIFY(state.read<uint32_t>() == state_magic, "not a save state");
+	VERIFY(state.read<uint16_t>() == state_version, "unsupported save state version");
+
+	auto snapshot = state.read<Snapshot>();
+	uint32_t base_id = state.read<uint32_t>();
+	uint32_t id = state.read<uint32_t>();
+	VERIFY(snapshot != Snapshot::Incremental || base_id == m_snapshot_id, "incremental save state is not based on the last snapshot");
+
+	// Incremental snapshots only store the pages that differ from the base
+	// memory, so they still load correctly after memory changed in between
+	bool detached = snapshot == Snapshot::Detached;
+
+	// The bootrom is mapped over the start of the cartridge ROM
+	bool bootrom = state.read<bool>();
+	if (bootrom != hasMemorySpace("BOOTROM1")) {
+		if (bootrom) {
+			Loader::the().enableBootrom();
+		}
+		else {
+			Loader::the().disableBootrom();
+		}
+	}
+
+	state.read(m_cycle);
+	m_interrupts.setEnable(state.read<uint8_t>());
+	m_interrupts.setFlag(state.read<uint8_t>());
+	state.read(m_lcd_register_writes);
+	state.read(m_palette_writes);
+	state.read(m_cartridge_ram_trapped);
+
+	uint32_t memory_spaces = state.read<uint32_t>();
+	for (uint32_t i = 0; i < memory_spaces; ++i) {
+		std::string_view name = state.readString();
+		auto it = m_memory_spaces.find(name);
+		VERIFY(it != m_memory_spaces.end(), "save state contains unknown memory space '{}'", name);
+
+		MemorySpace& memory_space = it->second;
+		state.read(memory_space.active_bank);
+		VERIFY(memory_space.active_bank < memory_space.amount_of_banks, "save state selects non-existent bank of '{}'", name);
+
+		uint32_t size = state.read<uint32_t>();
+		if (size == 0) {
+			continue;
+		}
+		VERIFY(size == memory_space.amount_of_banks * memory_space.bankSize(), "save state has wrong size for '{}'", name);
+
+		uint8_t* memory = memory_space.data();
+		bool full = state.read<bool>();
+		if (detached) {
+			memcpy(memory, state.readBytes(size).data(), size);
+			continue;
+		}
+
+		std::vector<uint8_t>& snapshot_memory = m_snapshot_memory[it->first];
+		if (full) {
+			snapshot_memory.resize(size);
+			memcpy(snapshot_memory.data(), state.readBytes(size).data(), size);
+			memcpy(memory, snapshot_memory.data(), size);
+			continue;
+		}
+
+		// Start from the base snapshot, then apply the pages that changed since
+		VERIFY(snapshot_memory.size() == size, "incremental save state is not based on the last snapshot");
+		uint32_t pages = state.read<uint32_t>();
+		for (uint32_t j = 0; j < pages; ++j) {
+			uint32_t offset = state.read<uint32_t>() * state_page_size;
+			VERIFY(offset < size, "save state has invalid page for '{}'", name);
+			uint32_t page_size = std::min(state_page_size, size - offset);
+			memcpy(snapshot_memory.data() + offset, state.readBytes(page_size).data(), page_size);
+		}
+		memcpy(memory, snapshot_memory.data(), size);
+	}
+
+	bool cartridge = state.read<bool>();
+	VERIFY(cartridge == (m_cartridge != nullptr), "save state is of a different cartridge");
+	if (m_cartridge) {
+		m_cartridge->loadState(state);
+	}
+
+	uint32_t processing_units = state.read<uint32_t>();
+	for (uint32_t i = 0; i < processing_units; ++i) {
+		std::string_view name = state.readString();
+		VERIFY(m_processing_units.find(name) != m_processing_units.end(), "save state contains unknown processing unit '{}'", name);
+		m_processing_units.at(name)->loadState(state);
+	}
+
+	m_events = {};
+	m_idle_events.clear();
+	uint32_t events = state.read<uint32_t>();
+	for (uint32_t i = 0; i < events; ++i) {
+		std::string_view name = state.readString();
+		VERIFY(m_processing_units.find(name) != m_processing_units.end(), "save state contains unknown processing unit '{}'", name);
+
+		Event event { .processing_unit = m_processing_units.at(name).get() };
+		state.read(event.cycle);
+		state.read(event.order);
+		state.read(event.clock_divider);
+		if (state.read<bool>()) {
+			m_idle_events.push_back(event);
+		}
+		else {
+			m_events.push(event);
+		}
+	}
+	VERIFY(state.atEnd(), "save state has trailing data");
+
+	if (!detached) {
+		m_snapshot_id = id;
+	}
+
+	// Banks and contents changed, drop everything derived from memory
+	updatePageTable();
 }
 
-void Emu::writeMemory(uint32_t address, uint32_t value)
+// -----------------------------------------
+
+void Emu::step()
 {
+	if (m_events.empty()) {
+		return;
+	}
+
+	Event event = m_events.top();
+	m_events.pop();
+	m_cycle = event.cycle;
+	m_update_order = event.order;
+
+	uint32_t cycles = event.processing_unit->update();
+	if (cycles == ProcessingUnit::idle) {
+		m_idle_events.push_back(event);
+		return;
+	}
+
+	event.cycle += std::max(cycles, 1u) * event.clock_divider;
+	m_events.push(event);
+}
+
+void Emu::replay(ProcessingUnit* processing_unit, uint64_t cycle)
+{
+	std::vector<Event> events;
+	Event replayed;
+	while (!m_events.empty()) {
+		if (m_events.top().processing_unit == processing_unit) {
+			replayed = m_events.top();
+		}
+		else {
+			events.push_back(m_events.top());
+		}
+		m_events.pop();
+	}
+	for (const Event& event : events) {
+		m_events.push(event);
+	}
+	VERIFY(replayed.processing_unit, "only scheduled units can be replayed");
+
+	// Units that come first have already been updated at the current cycle
+	replayed.cycle = cycle + replayed.clock_divider;
+	while (replayed.cycle < m_cycle || (replayed.cycle == m_cycle && replayed.order < m_update_order)) {
+		uint32_t cycles = processing_unit->update();
+		if (cycles == ProcessingUnit::idle) {
+			m_idle_events.push_back(replayed);
+			return;
+		}
+		replayed.cycle += std::max(cycles, 1u) * replayed.clock_divider;
+	}
+	m_events.push(replayed);
+}
+
+void Emu::sync()
+{
+	switch (m_sync) {
+	case Sync::WallClock: {
+		m_next_frame_time += m_frame_time;
+		double time = m_timer.elapsedNanoseconds();
+
+		// Too far behind to catch up, for example after the process was
+		// suspended, continue from now instead of running frames back to back
+		if (time > m_next_frame_time + m_frame_time * 4) {
+			m_next_frame_time = time;
+			break;
+		}
+
+		if (time < m_next_frame_time) {
+			std::this_thread::sleep_for(std::chrono::nanoseconds(static_cast<int64_t>(m_next_frame_time - time)));
+		}
+		break;
+	}
+	case Sync::VSync:
+		// At most one frame per presented frame, missed ones are dropped
+		m_vsyncs.wait(m_handled_vsyncs, std::memory_order_acquire);
+		m_handled_vsyncs = m_vsyncs.load(std::memory_order_acquire);
+		break;
+	default:
+		VERIFY_NOT_REACHED();
+	}
+}
+
+static bool isTrappedPage(uint32_t page)
+{
+	// I/O registers, these have side effects when accessed
+	return page == 0xff;
+}
+
+static bool isLcdRegister(uint16_t address)
+{
+	// Registers the background is drawn with: LCDC, SCY, SCX, BGP, WY and WX
+	switch (address) {
+	case 0xff40:
+	case 0xff42:
+	case 0xff43:
+	case 0xff47:
+	case 0xff4a:
+	case 0xff4b:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool isRomPage(uint32_t page)
+{
+	// Cartridge ROM, writes are trapped so code cached by the CPU can be invalidated
+	return page < 0x80;
+}
+
+static bool isTileDataPage(uint32_t page)
+{
+	// VRAM tile data, writes are trapped so tiles decoded by the PPU can be invalidated
+	return page >= 0x80 && page <= 0x97;
+}
+
+static bool isCartridgeRamPage(uint32_t page)
+{
+	// Cartridge RAM, trapped while disabled or while the controller maps registers there
+	return page >= 0xa0 && page <= 0xbf;
+}
+
+static bool isEchoPage(uint32_t page)
+{
+	// ECHO RAM, 0xe000~0xfdff is a mirror of 0xc000~0xddff
+	return page >= 0xe0 && page <= 0xfd;
+}
+
+void Emu::updatePageTable()
+{
+	m_read_pages.fill(nullptr);
+	m_write_pages.fill(nullptr);
+
+	for (auto& memory_space : m_memory_spaces) {
+		mapMemorySpace(memory_space.second);
+	}
+
+	m_map_generation++;
+	m_rom_generation++;
+	m_tile_cache.invalidateAll();
+}
+
+void Emu::mapMemorySpace(MemorySpace& memory_space)
+{
+	uint32_t first_page = memory_space.start_address >> 8;
+	uint32_t last_page = memory_space.end_address >> 8;
+	for (uint32_t page = first_page; page <= last_page; ++page) {
+		// Only map pages that are fully covered by this memory space
+		uint32_t page_address = page << 8;
+		if (page_address < memory_space.start_address || (page_address | 0xff) > memory_space.end_address
+		    || isTrappedPage(page) || isEchoPage(page) || (isCartridgeRamPage(page) && m_cartridge_ram_trapped)) {
+			continue;
+		}
+
+		uint8_t* data = memory_space.bank(memory_space.active_bank) + (page_address - memory_space.start_address);
+		m_read_pages[page] = data;
+		m_write_pages[page] = (isRomPage(page) || isTileDataPage(page)) ? nullptr : data;
+
+		// Mirror into ECHO RAM
+		if (isEchoPage(page + 0x20)) {
+			m_read_pages[page + 0x20] = data;
+			m_write_pages[page + 0x20] = data;
+		}
+	}
+}
+
+bool Emu::writeHasSideEffects(uint16_t address) const
+{
+	// Tile data is only trapped to invalidate decoded tiles
+	if (m_write_pages[address >> 8] || (isTileDataPage(address >> 8) && m_read_pages[address >> 8])) {
+		return false;
+	}
+
+	// HRAM shares the trapped page with the I/O registers
+	return address < 0xff80 || address == 0xffff;
+}
+
+bool Emu::readIsVolatile(uint16_t address) const
+{
+	if (m_read_pages[address >> 8]) {
+		return false;
+	}
+
+	// HRAM shares the trapped page with the I/O registers
+	return address < 0xff80 || address == 0xffff;
+}
+
+void Emu::writeTrappedMemory(uint16_t address, uint8_t value)
+{
+	if (writeHasSideEffects(address)) {
+		m_trapped_writes++;
+	}
+
+	// Tile data is still mapped for reading, so write through that
+	if (isTileDataPage(address >> 8) && m_read_pages[address >> 8]) {
+		m_tile_cache.invalidate(address);
+		m_read_pages[address >> 8][address & 0xff] = value;
+		return;
+	}
+
 	// Bail if the CPU tries to write to a read-only address
 	switch (address) {
 	case 0xff44:
@@ -74,49 +594,118 @@ void Emu::writeMemory(uint32_t address, uint32_t value)
 		break;
 	}
 
-	for (auto& memory_space : m_memory_spaces) {
-		auto& memory = memory_space.second;
-		if (address >= memory.start_address && address <= memory.end_address) {
-			// Note: ECHO RAM hack
-			if (address >= 0xc000 && address <= 0xddff) {
-				writeMemory(address + (0xe000 - 0xc000), value);
-			}
+	// Registers of the memory bank controller
+	if (m_cartridge && isRomPage(address >> 8)) {
+		m_cartridge->write(address, value);
+		return;
+	}
+	if (m_cartridge && isCartridgeRamPage(address >> 8)) {
+		m_cartridge->writeRam(address, value);
+		return;
+	}
 
-			memory.memory[memory.active_bank][address - memory.start_address] = value;
+	if (isRomPage(address >> 8)) {
+		m_map_generation++;
+		m_rom_generation++;
+	}
 
-			if (address == 0xff50) {
-				print("DISABLING BOOTROM\n");
-				Loader::the().disableBootrom();
+	if (isLcdRegister(address)) {
+		// The scanline renderer draws lines ahead, have the pixel FIFO draw
+		// the current one again up to this write, with the old values
+		auto it = m_processing_units.find("PPU");
+		if (it != m_processing_units.end()) {
+			PPU* ppu = static_cast<PPU*>(it->second.get());
+			if (ppu->rewindScanline()) {
+				replay(ppu, ppu->pixelTransferCycle());
 			}
+		}
+		m_lcd_register_writes++;
+	}
+	if ((address >= 0xff47 && address <= 0xff49) || (address >= 0xff68 && address <= 0xff6b)) {
+		m_palette_writes++;
+	}
 
-			// Write serial data from linkport I/O, used for blargg's test ROMs
-			if (address == 0xff02 && value == 0x81) {
-				uint32_t data = readMemory(0xff01);
-				print("{:c}", (data >= 58 && data <= 64) ? data + 7 : data);
-			}
+	// Registers that are not backed by memory
+	switch (address) {
+	case 0xff0f:
+		m_interrupts.setFlag(value);
+		return;
+	case 0xffff:
+		m_interrupts.setEnable(value);
+		return;
+	default:
+		break;
+	}
 
-			return;
+	uint16_t mapped_address = isEchoPage(address >> 8) ? address - 0x2000 : address;
+
+	bool written = false;
+	for (auto& memory_space : m_memory_spaces) {
+		auto& memory = memory_space.second;
+		if (mapped_address >= memory.start_address && mapped_address <= memory.end_address) {
+			memory.bank(memory.active_bank)[mapped_address - memory.start_address] = value;
+			written = true;
+			break;
 		}
 	}
 
-	ruc::error("writing into address '{:#06x}' which is not in a memory space!", address);
+	if (!written) {
+		ruc::error("writing into address '{:#06x}' which is not in a memory space!", address);
+		VERIFY_NOT_REACHED();
+		return;
+	}
 
-	VERIFY_NOT_REACHED();
+	switch (address) {
+	case 0xff02:
+		// Write serial data from linkport I/O, used for blargg's test ROMs
+		if (value == 0x81) {
+			uint8_t data = readMemory(0xff01);
+			char character = (data >= 58 && data <= 64) ? data + 7 : data;
+			m_serial_output += character;
+			print("{:c}", character);
+
+			// The transfer completes instantly
+			m_interrupts.raise(InterruptController::Serial);
+		}
+		break;
+	case 0xff40:
+		// The PPU idles while the LCD is off
+		if (value & 0x80) {
+			wake();
+		}
+		break;
+	case 0xff50:
+		print("DISABLING BOOTROM\n");
+		Loader::the().disableBootrom();
+		break;
+	default:
+		break;
+	}
 }
 
-uint32_t Emu::readMemory(uint32_t address) const
+uint8_t Emu::readTrappedMemory(uint16_t address) const
 {
 	switch (address) {
+	case 0xff0f:
+		return m_interrupts.flag();
 	case 0xff44:
 		return *m_processing_units.at("PPU")->sharedRegister("LY");
+	case 0xffff:
+		return m_interrupts.enable();
 	default:
 		break;
 	};
 
+	if (m_cartridge && isCartridgeRamPage(address >> 8)) {
+		return m_cartridge->readRam(address);
+	}
+
+	uint16_t mapped_address = isEchoPage(address >> 8) ? address - 0x2000 : address;
+
 	for (const auto& memory_space : m_memory_spaces) {
 		const auto& memory = memory_space.second;
-		if (address >= memory.start_address && address <= memory.end_address) {
-			return memory.memory[memory.active_bank][address - memory.start_address];
+		if (mapped_address >= memory.start_address && mapped_address <= memory.end_address) {
+			return memory.bank(memory.active_bank)[mapped_address - memory.start_address];
 		}
 	}
 
@@ -7,23 +7,51 @@
 
 #pragma once
 
-#include <cstdint> // uint32_t
-#include <memory>  // std::shared_ptr
+#include <array>
+#include <atomic>
+#include <cstdint>    // uint8_t, uint16_t, uint32_t, uint64_t
+#include <functional> // std::greater
+#include <memory>     // std::shared_ptr, std::unique_ptr
+#include <queue>
+#include <span>
+#include <string>
 #include <string_view>
 #include <unordered_map>
+#include <utility> // std::move
 #include <vector>
 
+#include "cartridge.h"
+#include "interrupt-controller.h"
 #include "processing-unit.h"
 #include "ruc/singleton.h"
 #include "ruc/timer.h"
-
-using BankedMemory = std::vector<std::vector<uint32_t>>;
+#include "tile-cache.h"
 
 struct MemorySpace {
-	BankedMemory memory;
+	std::vector<uint8_t> memory;          // Banks are laid out back to back
+	uint8_t* external_memory { nullptr }; // Used instead of memory if set, not owned
+	uint32_t amount_of_banks { 1 };
 	uint32_t active_bank { 0 };
 	uint32_t start_address { 0 };
 	uint32_t end_address { 0 };
+
+	uint32_t bankSize() const { return 1 + end_address - start_address; }
+	uint8_t* bank(uint32_t bank) { return data() + bank * bankSize(); }
+	const uint8_t* bank(uint32_t bank) const { return data() + bank * bankSize(); }
+	uint8_t* data() { return (external_memory) ? external_memory : memory.data(); }
+	const uint8_t* data() const { return (external_memory) ? external_memory : memory.data(); }
+};
+
+struct Event {
+	uint64_t cycle { 0 };         // Emulator cycle at which the unit needs to be updated
+	uint32_t order { 0 };         // Tiebreaker, units update in the order they were added
+	uint32_t clock_divider { 1 }; // Emulator cycles per cycle of the unit
+	ProcessingUnit* processing_unit { nullptr };
+
+	bool operator>(const Event& rhs) const
+	{
+		return cycle > rhs.cycle || (cycle == rhs.cycle && order > rhs.order);
+	}
 };
 
 class Emu final : public ruc::Singleton<Emu> {
@@ -35,33 +63,162 @@ public:
 		CGB, // Game Boy Color
 	};
 
+	// What update() waits for after emulating a frame
+	enum class Sync : uint8_t {
+		WallClock, // Sleep until the frame is due on the host clock
+		VSync,     // Until the front-end has presented a frame, see vsync()
+	};
+
 	void init(uint32_t frequency);
 
+	// Emulate a frame as fast as the host allows, then wait for the sync source
 	void update();
+	void run(uint64_t cycles);
+	// Update the processing unit that is next in line
+	void step();
+	// Update the unit again from its first clock after the given cycle, up to the
+	// current cycle. For units that skipped ahead, but have to see a write at the
+	// cycle it happens
+	void replay(ProcessingUnit* processing_unit, uint64_t cycle);
+
+	// Kind of save state
+	enum class Snapshot : uint8_t {
+		Full,        // Complete state
+		Incremental, // Only memory changed since the previous snapshot, loads on top of it
+		Detached,    // Complete state, saving or loading it leaves the base of incremental snapshots as is
+	};
+
+	// Append the state of the core, the units and the cartridge to the buffer.
+	// The ROM is not part of the state, neither is the frame being drawn.
+	void saveState(std::vector<uint8_t>& buffer, Snapshot snapshot = Snapshot::Full);
+	void loadState(std::span<const uint8_t> buffer);
+
+	void setSync(Sync sync) { m_sync = sync; }
+	// Called by the front-end, possibly from another thread, after presenting a frame
+	void vsync();
 
 	void addProcessingUnit(std::string_view name, std::shared_ptr<ProcessingUnit> processing_unit);
 	void addMemorySpace(std::string_view name, uint32_t start_address, uint32_t end_address, uint32_t amount_of_banks = 1);
+	// Backed by memory of the caller, which has to stay valid until the memory space is removed
+	void addMemorySpace(std::string_view name, uint32_t start_address, uint32_t end_address, uint32_t amount_of_banks, uint8_t* memory);
 	void removeMemorySpace(std::string_view name);
-
-	void writeMemory(uint32_t address, uint32_t value);
-	uint32_t readMemory(uint32_t address) const;
+	void switchBank(std::string_view name, uint32_t bank);
+
+	// Handles writes to the ROM area and to cartridge RAM while it is trapped
+	void setCartridge(std::unique_ptr<Cartridge> cartridge) { m_cartridge = std::move(cartridge); }
+	// Unmap 0xa000~0xbfff, so accesses go through the cartridge instead of CARTRAM
+	void setCartridgeRamTrapped(bool trapped);
+
+	// Resume all idle processing units
+	void wake();
+
+	void writeMemory(uint16_t address, uint8_t value)
+	{
+		if (uint8_t* page = m_write_pages[address >> 8]) {
+			page[address & 0xff] = value;
+			return;
+		}
+		writeTrappedMemory(address, value);
+	}
+
+	uint8_t readMemory(uint16_t address) const
+	{
+		if (const uint8_t* page = m_read_pages[address >> 8]) {
+			return page[address & 0xff];
+		}
+		return readTrappedMemory(address);
+	}
+
+	// Host memory backing the address, nullptr if the page is trapped
+	const uint8_t* readPointer(uint16_t address) const
+	{
+		const uint8_t* page = m_read_pages[address >> 8];
+		return (page) ? page + (address & 0xff) : nullptr;
+	}
 
 	// -------------------------------------
 
 	Mode mode() const { return m_mode; }
+	InterruptController& interrupts() { return m_interrupts; }
+	TileCache& tileCache() { return m_tile_cache; }
+	uint64_t cycle() const { return m_cycle; }
+	std::string_view serialOutput() const { return m_serial_output; }
 	std::shared_ptr<ProcessingUnit> processingUnit(std::string_view name) const { return m_processing_units.at(name); }
-	MemorySpace memorySpace(std::string_view name) { return m_memory_spaces[name]; }
+	MemorySpace& memorySpace(std::string_view name) { return m_memory_spaces.at(name); }
+	const MemorySpace& memorySpace(std::string_view name) const { return m_memory_spaces.at(name); }
+	bool hasMemorySpace(std::string_view name) const { return m_memory_spaces.find(name) != m_memory_spaces.end(); }
+	Cartridge* cartridge() const { return m_cartridge.get(); }
+
+	// Amount of writes to the LCD registers the background is drawn with:
+	// LCDC, SCY, SCX, BGP, WY and WX
+	uint32_t lcdRegisterWrites() const { return m_lcd_register_writes; }
+	// Amount of writes to the palette registers, 0xff47~0xff49 and 0xff68~0xff6b
+	uint32_t paletteWrites() const { return m_palette_writes; }
+
+	// Amount of writes that can have side effects: to I/O registers, IE and
+	// the cartridge. The memory map only changes through these
+	uint32_t trappedWrites() const { return m_trapped_writes; }
+	// Whether a write to the address counts towards trappedWrites()
+	bool writeHasSideEffects(uint16_t address) const;
+	// Whether a read of the address can see a value that the other units change
+	bool readIsVolatile(uint16_t address) const;
+	// Changes whenever the memory map changes, bank switches included
+	uint32_t mapGeneration() const { return m_map_generation; }
+	// Changes whenever memory spaces are added or removed, or ROM is written to
+	// without a cartridge, a cartridge turns those writes into register writes
+	uint32_t romGeneration() const { return m_rom_generation; }
 
 private:
+	void sync();
+
+	void updatePageTable();
+	void mapMemorySpace(MemorySpace& memory_space);
+
+	void writeTrappedMemory(uint16_t address, uint8_t value);
+	uint8_t readTrappedMemory(uint16_t address) const;
+
 	Mode m_mode { Mode::DMG };
 	uint32_t m_frequency { 0 };
-	double m_timestep { 0 };
-	uint32_t m_cycle { 0 };
-	double m_cycle_time { 0 };
-	double m_previous_time { 0 };
+	uint64_t m_cycle { 0 };
+	uint32_t m_update_order { 0 }; // Order of the unit being updated, see Event
 
+	Sync m_sync { Sync::WallClock };
+	uint64_t m_frame_cycles { 0 };
+	double m_frame_time { 0 };      // Nanoseconds
+	double m_next_frame_time { 0 }; // Nanoseconds since the timer started
 	ruc::Timer m_timer;
+	std::atomic<uint32_t> m_vsyncs { 0 };
+	uint32_t m_handled_vsyncs { 0 };
+
+	std::string m_serial_output;
+
+	InterruptController m_interrupts;
+	TileCache m_tile_cache;
+
+	std::unique_ptr<Cartridge> m_cartridge;
+	bool m_cartridge_ram_trapped { false };
+
+	// Memory as of the last saved or loaded snapshot, incremental snapshots only store the pages that differ
+	std::unordered_map<std::string_view, std::vector<uint8_t>> m_snapshot_memory;
+	uint32_t m_snapshot_id { 0 };   // Snapshot the memory above belongs to, 0 if none
+	uint32_t m_snapshot_count { 0 }; // Ids are never reused, so a snapshot is only loaded on top of its base
+	std::vector<uint32_t> m_changed_pages;
 
 	std::unordered_map<std::string_view, std::shared_ptr<ProcessingUnit>> m_processing_units;
+	std::priority_queue<Event, std::vector<Event>, std::greater<Event>> m_events;
+	std::vector<Event> m_idle_events; // Units waiting for an interrupt
 	std::unordered_map<std::string_view, MemorySpace> m_memory_spaces;
+
+	// The address space is split into 256 pages of 256 bytes, each entry
+	// points to the start of the page in host memory. Pages that are not
+	// fully covered by a single memory space or contain registers with side
+	// effects are trapped (nullptr) and go through the slow path.
+	std::array<uint8_t*, 256> m_read_pages {};
+	std::array<uint8_t*, 256> m_write_pages {};
+
+	uint32_t m_map_generation { 0 };
+	uint32_t m_rom_generation { 0 };
+	uint32_t m_trapped_writes { 0 };
+	uint32_t m_lcd_register_writes { 0 };
+	uint32_t m_palette_writes { 0 };
 };
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <cstdint> // uint8_t
+
+#include "emu.h"
+#include "interrupt-controller.h"
+
+InterruptController::InterruptController()
+{
+}
+
+InterruptController::~InterruptController()
+{
+}
+
+// -----------------------------------------
+
+void InterruptController::raise(Interrupt interrupt)
+{
+	m_flag |= interrupt;
+	update();
+}
+
+void InterruptController::acknowledge(Interrupt interrupt)
+{
+	m_flag &= ~interrupt;
+	update();
+}
+
+void InterruptController::setEnable(uint8_t value)
+{
+	m_enable = value;
+	update();
+}
+
+void InterruptController::setFlag(uint8_t value)
+{
+	m_flag = value & 0x1f;
+	update();
+}
+
+// -----------------------------------------
+
+void InterruptController::update()
+{
+	uint8_t previous = m_pending;
+	m_pending = m_enable & m_flag & 0x1f;
+
+	// Units waiting in HALT or STOP might be able to resume
+	if (m_pending & ~previous) {
+		Emu::the().wake();
+	}
+}
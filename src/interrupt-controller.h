@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <cstdint> // uint8_t
+
+#include "ruc/meta/core.h"
+
+// IE and IF registers, the units that request interrupts raise them here
+// directly and the CPU only has to check a single cached value
+class InterruptController {
+public:
+	InterruptController();
+	virtual ~InterruptController();
+
+	// Bits in IE and IF, in order of priority
+	enum Interrupt : uint8_t {
+		None = 0,
+		VBlank = BIT(0),
+		LCDStat = BIT(1),
+		Timer = BIT(2),
+		Serial = BIT(3),
+		Joypad = BIT(4),
+	};
+
+	void raise(Interrupt interrupt);
+	void acknowledge(Interrupt interrupt);
+
+	// Highest priority interrupt that is both enabled and requested
+	Interrupt next() const { return static_cast<Interrupt>(m_pending & -m_pending); }
+
+	bool pending() const { return m_pending != 0; }
+	uint8_t pendingInterrupts() const { return m_pending; }
+
+	uint8_t enable() const { return m_enable; }
+	uint8_t flag() const { return m_flag | 0xe0; } // Unused bits read as 1
+	void setEnable(uint8_t value);
+	void setFlag(uint8_t value);
+
+private:
+	void update();
+
+	uint8_t m_enable { 0 };  // IE, 0xffff
+	uint8_t m_flag { 0 };    // IF, 0xff0f
+	uint8_t m_pending { 0 }; // IE & IF
+};
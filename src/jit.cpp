@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifdef GARBAGE_JIT
+
+#include <cstddef> // size_t
+#include <cstdint> // int32_t, int64_t, INT32_MAX, INT32_MIN, uint8_t, uint16_t, uint32_t, uint64_t, uintptr_t
+#include <cstring> // memcpy
+#include <initializer_list>
+#include <sys/mman.h> // mmap, mprotect, munmap
+
+#include "jit.h"
+#include "ruc/meta/assert.h"
+
+// Address somewhere in the text segment of the program
+static uintptr_t textAddress()
+{
+	return reinterpret_cast<uintptr_t>(&textAddress);
+}
+
+JIT::JIT(size_t size)
+	: m_size(size)
+{
+	// Try to place the buffer right below the program, so the interpreter can
+	// be reached with direct calls, which predict a lot better than indirect ones
+	uintptr_t hint = (textAddress() & ~static_cast<uintptr_t>(0xfffff)) - m_size;
+	void* memory = mmap(reinterpret_cast<void*>(hint), m_size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	VERIFY(memory != MAP_FAILED, "could not allocate JIT memory");
+
+	m_memory = static_cast<uint8_t*>(memory);
+}
+
+JIT::~JIT()
+{
+	munmap(m_memory, m_size);
+}
+
+// -----------------------------------------
+
+void JIT::reset()
+{
+	m_used = 0;
+}
+
+void JIT::begin()
+{
+	mprotect(m_memory, m_size, PROT_READ | PROT_WRITE);
+
+	m_start = m_used;
+	m_position = m_used;
+	m_exits.clear();
+
+	// Prologue, keep the context in a callee-saved register
+	emit({ 0x53 });             // push rbx
+	emit({ 0x48, 0x89, 0xfb }); // mov rbx, rdi
+}
+
+JIT::Code JIT::end()
+{
+	// Epilogue
+	size_t epilogue = m_position;
+	emit({ 0x5b }); // pop rbx
+	emit({ 0xc3 }); // ret
+
+	Code code = nullptr;
+	if (m_position <= m_size) {
+		for (size_t exit : m_exits) {
+			int32_t offset = static_cast<int32_t>(epilogue - (exit + 4));
+			memcpy(m_memory + exit, &offset, sizeof(offset));
+		}
+
+		code = reinterpret_cast<Code>(m_memory + m_start);
+		m_used = m_position;
+	}
+
+	mprotect(m_memory, m_size, PROT_READ | PROT_EXEC);
+
+	return code;
+}
+
+void JIT::load8(Register destination, int32_t displacement)
+{
+	// Zero extend, writing only AL would make every load depend on the previous one
+	emit({ 0x0f, 0xb6, static_cast<uint8_t>(0x83 | destination << 3) }); // movzx r32, byte [rbx + disp32]
+	emit32(displacement);
+}
+
+void JIT::store8(int32_t displacement, Register source)
+{
+	emit({ 0x88, static_cast<uint8_t>(0x83 | source << 3) }); // mov [rbx + disp32], r8
+	emit32(displacement);
+}
+
+void JIT::store8(int32_t displacement, uint8_t value)
+{
+	emit({ 0xc6, 0x83 }); // mov byte [rbx + disp32], imm8
+	emit32(displacement);
+	emit({ value });
+}
+
+void JIT::add16(int32_t displacement, uint16_t value)
+{
+	emit({ 0x66, 0x81, 0x83 }); // add word [rbx + disp32], imm16
+	emit32(displacement);
+	emit16(value);
+}
+
+void JIT::add32(int32_t displacement, uint32_t value)
+{
+	emit({ 0x81, 0x83 }); // add dword [rbx + disp32], imm32
+	emit32(displacement);
+	emit32(value);
+}
+
+void JIT::move32(Register destination, uint32_t value)
+{
+	emit({ static_cast<uint8_t>(0xb8 + destination) }); // mov r32, imm32
+	emit32(value);
+}
+
+void JIT::operation8(Operation operation)
+{
+	emit({ static_cast<uint8_t>(operation), 0xc8 }); // op al, cl
+}
+
+void JIT::call(const void* function)
+{
+	emit({ 0x48, 0x89, 0xdf }); // mov rdi, rbx
+
+	// Relative to the end of the call instruction
+	int64_t offset = reinterpret_cast<int64_t>(function) - reinterpret_cast<int64_t>(m_memory + m_position + 5);
+	if (offset >= INT32_MIN && offset <= INT32_MAX) {
+		emit({ 0xe8 }); // call rel32
+		emit32(offset);
+		return;
+	}
+
+	emit({ 0x48, 0xb8 }); // mov rax, imm64
+	emit64(reinterpret_cast<uint64_t>(function));
+	emit({ 0xff, 0xd0 }); // call rax
+}
+
+void JIT::callOrExit(Function function)
+{
+	call(reinterpret_cast<const void*>(function));
+	emit({ 0x84, 0xc0 });       // test al, al
+	emit({ 0x0f, 0x84 });       // jz rel32
+	m_exits.push_back(m_position);
+	emit32(0);
+}
+
+// -----------------------------------------
+
+void JIT::emit(std::initializer_list<uint8_t> bytes)
+{
+	for (uint8_t byte : bytes) {
+		// Keep counting when out of space, so end() can detect it
+		if (m_position < m_size) {
+			m_memory[m_position] = byte;
+		}
+		m_position++;
+	}
+}
+
+void JIT::emit16(uint16_t value)
+{
+	emit({ static_cast<uint8_t>(value), static_cast<uint8_t>(value >> 8) });
+}
+
+void JIT::emit32(uint32_t value)
+{
+	emit16(value & 0xffff);
+	emit16(value >> 16);
+}
+
+void JIT::emit64(uint64_t value)
+{
+	emit32(value & 0xffffffff);
+	emit32(value >> 32);
+}
+
+#endif
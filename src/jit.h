@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#ifdef GARBAGE_JIT
+
+#include <cstddef> // size_t
+#include <cstdint> // int32_t, uint8_t, uint16_t, uint32_t, uint64_t
+#include <initializer_list>
+#include <vector>
+
+// Emits x86-64 functions into a buffer of executable memory. The buffer is
+// either writable or executable, never both at the same time.
+//
+// Emitted functions take a single context pointer, which is kept in RBX and
+// used as the base of all memory accesses.
+class JIT {
+public:
+	using Code = void (*)(void* context);
+	using Function = bool (*)(void* context);
+
+	// Scratch registers
+	enum Register : uint8_t {
+		EAX = 0,
+		ECX = 1,
+	};
+
+	// 8-bit arithmetic, encoded as the opcode of the r/m8, r8 form
+	enum class Operation : uint8_t {
+		Add = 0x00,
+		Or = 0x08,
+		And = 0x20,
+		Subtract = 0x28,
+		Xor = 0x30,
+	};
+
+	explicit JIT(size_t size);
+	virtual ~JIT();
+
+	// Drop all emitted functions
+	void reset();
+
+	// Start emitting a new function
+	void begin();
+	// Finish the current function, returns nullptr if it did not fit
+	Code end();
+
+	// Memory accesses relative to the context
+	void load8(Register destination, int32_t displacement);
+	void store8(int32_t displacement, Register source);
+	void store8(int32_t displacement, uint8_t value);
+	void add16(int32_t displacement, uint16_t value);
+	void add32(int32_t displacement, uint32_t value);
+
+	void move32(Register destination, uint32_t value);
+	// AL = AL operation CL
+	void operation8(Operation operation);
+
+	// Call function(context)
+	void call(const void* function);
+	// Call function(context), return from the emitted function if it returns false
+	void callOrExit(Function function);
+
+private:
+	void emit(std::initializer_list<uint8_t> bytes);
+	void emit16(uint16_t value);
+	void emit32(uint32_t value);
+	void emit64(uint64_t value);
+
+	uint8_t* m_memory { nullptr };
+	size_t m_size { 0 };
+	size_t m_used { 0 };     // End of the last finished function
+	size_t m_position { 0 }; // Write position of the current function
+	size_t m_start { 0 };    // Start of the current function
+
+	// Jumps to the epilogue, patched when the function is finished
+	std::vector<size_t> m_exits;
+};
+
+#endif
@@ -4,37 +4,68 @@
  * SPDX-License-Identifier: MIT
  */
 
-#include <cstddef> // size_t
-#include <cstdint> // uint32_t
-#include <memory>  // std::make_shared
-
+#include <algorithm>  // std::max, std::min
+#include <cstddef>    // size_t
+#include <cstdint>    // uint8_t, uint32_t
+#include <cstring>    // memcpy
+#include <fcntl.h>    // open
+#include <filesystem> // std::filesystem::path
+#include <memory>     // std::make_shared
+#include <string>
+#include <string_view>
+#include <sys/mman.h> // mmap, munmap
+#include <sys/stat.h> // fstat
+#include <unistd.h>   // close, pread
+#include <utility>    // std::move
+
+#include "cartridge.h"
 #include "cpu.h"
 #include "emu.h"
 #include "loader.h"
 #include "ppu.h"
 #include "ruc/file.h"
+#include "ruc/format/log.h"
 #include "ruc/format/print.h"
+#include "ruc/meta/assert.h"
 
 void Loader::loadRom(std::string_view rom_path)
 {
+	unloadRom();
+
 	if (!rom_path.empty()) {
-		m_rom_data = ruc::File(rom_path).data();
+		mapRom(rom_path);
+		m_save_path = std::filesystem::path(rom_path).replace_extension(".sav").string();
 	}
 
 	init();
 }
 
+void Loader::unloadRom()
+{
+	// The memory spaces of the previous ROM point into its mappings
+	destroy();
+	m_save_file.close();
+	unmapRom();
+}
+
+void Loader::enableBootrom()
+{
+	Emu::the().removeMemorySpace("CARTROM1");
+
+	Emu::the().addMemorySpace("BOOTROM1", 0x0000, 0x00ff); // 256B
+	loadCartridgeHeader();
+	Emu::the().addMemorySpace("BOOTROM2", 0x0200, 0x08ff); // 1792B
+	loadBootrom();
+}
+
 void Loader::disableBootrom()
 {
 	Emu::the().removeMemorySpace("BOOTROM1");
 	Emu::the().removeMemorySpace("CARTHEADER");
 	Emu::the().removeMemorySpace("BOOTROM2");
 
-	// Load cartridge bank 0
-	Emu::the().addMemorySpace("CARTROM1", 0x0000, 0x3fff); // 16KiB
-	for (size_t i = 0x0000; i <= 0x3fff; ++i) {
-		Emu::the().writeMemory(i, m_rom_data[i]);
-	}
+	// Map cartridge bank 0, any bank can be mapped here by MBC1
+	Emu::the().addMemorySpace("CARTROM1", 0x0000, 0x3fff, m_rom_size / (16 * 1024), m_rom_data); // 16KiB * banks
 }
 
 // -----------------------------------------
@@ -58,25 +89,25 @@ void Loader::init()
 	Emu::the().addMemorySpace("BOOTROM2", 0x0200, 0x08ff); // 1792B
 	loadCartridgeBanks();
 	Emu::the().addMemorySpace("VRAM", 0x8000, 0x9fff, 2);    // 8KiB * 2 banks
-	Emu::the().addMemorySpace("CARTRAM", 0xa000, 0xbfff, 1); // 8KiB * ? banks, if any
+	loadCartridgeRam();
 	Emu::the().addMemorySpace("WRAM1", 0xc000, 0xcfff);      // 4 KiB, Work RAM
 	Emu::the().addMemorySpace("WRAM2", 0xd000, 0xdfff, 7);   // 4 KiB * 7 banks, Work RAM
-	Emu::the().addMemorySpace("ECHORAM", 0xe000, 0xfdff);    // 7680B, Mirror of 0xc000~0xddff
+	// 0xe000~0xfdff, 7680B ECHO RAM, is mapped by the Emu as a mirror of 0xc000~0xddff
 	Emu::the().addMemorySpace("OAM", 0xfe00, 0xfe9f);        // 160B, Object Attribute Memory (VRAM Sprite Attribute Table)
 	Emu::the().addMemorySpace("Not Usable", 0xfea0, 0xfeff); // 96B, Nintendo probibits this area
 	Emu::the().addMemorySpace("IO", 0xff00, 0xff7f);         // 128B, I/O Registers
 	Emu::the().addMemorySpace("HRAM", 0xff80, 0xfffe);       // 127B, High RAM (CPU cache)
 	Emu::the().addMemorySpace("IE", 0xffff, 0xffff);         // 1B, Interrupt Enable register
 
-	// Load bootrom
-	auto bootrom = ruc::File(m_bootrom_path).data();
-	for (size_t i = 0; i < bootrom.length(); ++i) {
-		// Skip cartridge header memory range
-		if (i >= 0x0100 && i <= 0x01ff) {
-			continue;
-		}
+	loadBootrom();
 
-		Emu::the().writeMemory(i, bootrom[i]);
+	// From here on writes to ROM go to the controller
+	if (m_rom_data) {
+		auto cartridge = Cartridge::create(m_rom_data[0x0147], m_rom_size / (16 * 1024), cartridgeRamBanks());
+		if (m_battery_data) {
+			cartridge->setBatteryData(m_battery_data);
+		}
+		Emu::the().setCartridge(std::move(cartridge));
 	}
 }
 
@@ -85,36 +116,133 @@ void Loader::destroy()
 	Emu::destroy();
 }
 
-void Loader::loadCartridgeHeader()
+void Loader::mapRom(std::string_view rom_path)
+{
+	int file = open(std::string(rom_path).c_str(), O_RDONLY);
+	VERIFY(file != -1, "could not open ROM '{}'", rom_path);
+
+	struct stat status;
+	VERIFY(fstat(file, &status) == 0, "could not stat ROM '{}'", rom_path);
+	size_t file_size = status.st_size;
+
+	// Reserve the size the cartridge header claims, ROM dumps can be
+	// smaller, the part not in the file reads as 0
+	uint8_t size_code = 0;
+	if (file_size > 0x0148) {
+		VERIFY(pread(file, &size_code, 1, 0x0148) == 1, "could not read ROM '{}'", rom_path);
+	}
+	m_rom_size = file_size;
+	if (size_code <= 0x08) { // 32KiB~8MiB
+		m_rom_size = std::max<size_t>(32 * 1024 * (1 << size_code), file_size);
+	}
+	else {
+		ruc::warn("invalid ROM size code {:#04x} in the header of '{}', using the file size", size_code, rom_path);
+	}
+
+	// Whole 16KiB banks, a partial last bank is padded
+	m_rom_size = (m_rom_size + 16 * 1024 - 1) / (16 * 1024) * (16 * 1024);
+
+	// Read-only, every write to ROM goes to the cartridge controller instead,
+	// so a stray write faults rather than silently changing the ROM
+	void* memory = mmap(nullptr, m_rom_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	VERIFY(memory != MAP_FAILED, "could not reserve memory for ROM '{}'", rom_path);
+
+	// Pages are shared with the page cache
+	if (file_size > 0) {
+		void* rom = mmap(memory, file_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, file, 0);
+		VERIFY(rom != MAP_FAILED, "could not map ROM '{}'", rom_path);
+	}
+	close(file);
+
+	m_rom_data = static_cast<uint8_t*>(memory);
+}
+
+void Loader::unmapRom()
 {
-	if (m_rom_data.empty()) {
+	if (!m_rom_data) {
 		return;
 	}
 
-	Emu::the().addMemorySpace("CARTHEADER", 0x100, 0x14f); // 80B
+	munmap(m_rom_data, m_rom_size);
+	m_rom_data = nullptr;
+	m_rom_size = 0;
+}
 
-	for (size_t i = 0x0100; i <= 0x014f; ++i) {
-		Emu::the().writeMemory(i, m_rom_data[i]);
+void Loader::loadBootrom()
+{
+	// Copied into the memory spaces, as writes to ROM go to the cartridge,
+	// the cartridge header memory range is skipped
+	auto bootrom = ruc::File(m_bootrom_path).data();
+	for (std::string_view name : { "BOOTROM1", "BOOTROM2" }) {
+		MemorySpace& memory_space = Emu::the().memorySpace(name);
+		if (bootrom.length() > memory_space.start_address) {
+			size_t size = std::min<size_t>(bootrom.length() - memory_space.start_address, memory_space.bankSize());
+			memcpy(memory_space.data(), bootrom.data() + memory_space.start_address, size);
+		}
+	}
+}
+
+void Loader::loadCartridgeHeader()
+{
+	if (!m_rom_data) {
+		return;
 	}
+
+	Emu::the().addMemorySpace("CARTHEADER", 0x100, 0x14f, 1, m_rom_data + 0x100); // 80B
 }
 
 void Loader::loadCartridgeBanks()
 {
-	if (m_rom_data.empty()) {
+	if (!m_rom_data) {
 		return;
 	}
 
-	uint32_t rom_size = 32 * 1024 * (1 << m_rom_data[0x0148]);
-	uint32_t rom_banks = rom_size / (16 * 1024) - 1;
-	Emu::the().addMemorySpace("CARTROM2", 0x4000, 0x7fff, rom_banks); // 16KiB * banks
+	// Map cartridge bank 1~NN, bank n of the memory space is bank n of the
+	// ROM, so the controller switches banks without copying
+	uint32_t rom_banks = m_rom_size / (16 * 1024);
+	Emu::the().addMemorySpace("CARTROM2", 0x4000, 0x7fff, rom_banks, m_rom_data); // 16KiB * banks
+	Emu::the().switchBank("CARTROM2", 1);
+}
 
-	// Load cartridge bank 1~NN
-	auto rom_memory_spaces = Emu::the().memorySpace("CARTROM2");
-	for (size_t i = 0; i < rom_banks; ++i) {
-		for (size_t i = 0x4000; i <= 0x7fff; ++i) {
-			Emu::the().writeMemory(i, m_rom_data[i]);
-		}
-		rom_memory_spaces.active_bank += 1;
+void Loader::loadCartridgeRam()
+{
+	m_battery_data = nullptr;
+
+	uint8_t type = (m_rom_data) ? m_rom_data[0x0147] : 0x00;
+	uint32_t ram_banks = cartridgeRamBanks();
+	uint32_t bank_size = Cartridge::ramBankSize(type);
+	uint32_t end_address = 0xa000 + bank_size - 1;
+	if (!m_rom_data || !Cartridge::hasBattery(type)) {
+		Emu::the().addMemorySpace("CARTRAM", 0xa000, end_address, ram_banks); // 8KiB * banks, or 512B
+		return;
+	}
+
+	// Battery-backed, writes go into the save file without copying, the
+	// clock of the cartridge is kept after the RAM
+	uint32_t ram_size = ram_banks * bank_size;
+	uint8_t* ram = m_save_file.open(m_save_path, ram_size + Cartridge::batteryDataSize(type));
+	Emu::the().addMemorySpace("CARTRAM", 0xa000, end_address, ram_banks, ram); // 8KiB * banks, or 512B
+	if (Cartridge::batteryDataSize(type) > 0) {
+		m_battery_data = ram + ram_size;
+	}
+}
+
+uint32_t Loader::cartridgeRamBanks() const
+{
+	if (!m_rom_data) {
+		return 1;
+	}
+
+	// https://gbdev.io/pandocs/The_Cartridge_Header.html#0149--ram-size
+	switch (m_rom_data[0x0149]) {
+	case 0x03:
+		return 4;
+	case 0x04:
+		return 16;
+	case 0x05:
+		return 8;
+	default:
+		// No RAM still gets a bank, MBC2 has its RAM built into the controller
+		return 1;
 	}
-	rom_memory_spaces.active_bank = 0;
 }
@@ -6,16 +6,23 @@
 
 #pragma once
 
+#include <cstddef> // size_t
+#include <cstdint> // uint8_t, uint32_t
 #include <string>
 #include <string_view>
 
 #include "ruc/singleton.h"
+#include "save-file.h"
 
 class Loader final : public ruc::Singleton<Loader> {
 public:
 	Loader(s) {}
 
 	void loadRom(std::string_view rom_path);
+	// Stop emulating and release the ROM, flushes the save file
+	void unloadRom();
+	// Map the bootrom again, for save states taken before it was disabled
+	void enableBootrom();
 	void disableBootrom();
 
 	void setBootromPath(std::string_view bootrom_path) { m_bootrom_path = bootrom_path; }
@@ -24,9 +31,23 @@ private:
 	void init();
 	void destroy();
 
+	void mapRom(std::string_view rom_path);
+	void unmapRom();
+
+	void loadBootrom();
 	void loadCartridgeHeader();
 	void loadCartridgeBanks();
+	void loadCartridgeRam();
+	uint32_t cartridgeRamBanks() const;
 
 	std::string_view m_bootrom_path;
-	std::string m_rom_data;
+
+	// The ROM file mapped into memory, read-only
+	uint8_t* m_rom_data { nullptr };
+	size_t m_rom_size { 0 };
+
+	// Cartridge RAM of cartridges with a battery, next to the ROM file
+	std::string m_save_path;
+	SaveFile m_save_file;
+	uint8_t* m_battery_data { nullptr }; // After the RAM in the save file, see Cartridge::batteryDataSize()
 };
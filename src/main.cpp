@@ -5,10 +5,22 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include <array>
+#include <atomic>
+#include <cstdint> // uint32_t, uint8_t
+#include <cstring> // memcpy
+#include <memory>  // std::make_shared, std::make_unique, std::shared_ptr, std::unique_ptr
 #include <string_view>
+#include <thread>
 
+#include "glad/glad.h"
+#include "glm/ext/vector_float4.hpp" // glm::vec4
 #include "inferno.h"
+#include "inferno/component/spritecomponent.h"
 #include "inferno/entrypoint.h"
+#include "inferno/io/input.h"
+#include "inferno/keycodes.h"
+#include "inferno/scene/scene.h"
 #include "ppu.h"
 #include "ruc/argparser.h"
 #include "ruc/format/print.h"
@@ -16,6 +28,7 @@
 
 #include "emu.h"
 #include "loader.h"
+#include "rewind.h"
 
 class GarbAGE final : public Inferno::Application {
 public:
@@ -24,33 +37,123 @@ public:
 	{
 		std::string_view bootrom_path = "gbc_bios.bin";
 		std::string_view rom_path;
+		bool vsync = false;
+		unsigned int rewind_seconds = 60;
 
 		ruc::ArgParser argParser;
 		argParser.addOption(bootrom_path, 'b', "bootrom", nullptr, nullptr, "", ruc::ArgParser::Required::Yes);
 		argParser.addOption(rom_path, 'r', "rom", nullptr, nullptr, "", ruc::ArgParser::Required::Yes);
+		argParser.addOption(vsync, 'v', "vsync", "Emulate a frame for every frame the display shows", nullptr);
+		argParser.addOption(rewind_seconds, 'w', "rewind", "Seconds that can be rewound by holding backspace, default 60", nullptr, "", ruc::ArgParser::Required::Yes);
 		argParser.parse(argc, argv);
 
+		m_entity = scene().findEntity("Screen");
+
 		Loader::the().setBootromPath(bootrom_path);
 		Loader::the().loadRom(rom_path);
+		Emu::the().setSync(vsync ? Emu::Sync::VSync : Emu::Sync::WallClock);
+		if (rewind_seconds > 0) {
+			m_rewind = std::make_unique<Rewind>(rewind_seconds * 60);
+		}
+
+		// Uploads without conversion
+		m_ppu = static_cast<PPU*>(Emu::the().processingUnit("PPU").get());
+		m_ppu->setFormat(PPU::Format::RGBA);
+
+		// The screen is drawn into a single texture, which is updated in place
+		uint8_t* screen = const_cast<uint8_t*>(m_ppu->screen().data());
+		m_texture = std::make_shared<Inferno::Texture>(screen, SCREEN_WIDTH, SCREEN_HEIGHT, m_ppu->formatSize());
+		scene().removeComponent<Inferno::SpriteComponent>(m_entity);
+		scene().addComponent<Inferno::SpriteComponent>(m_entity, glm::vec4 { 1.0f }, m_texture);
+
+		glGenBuffers(m_pixel_buffers.size(), m_pixel_buffers.data());
+		for (uint32_t pixel_buffer : m_pixel_buffers) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pixel_buffer);
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, m_ppu->screen().size(), screen, GL_STREAM_DRAW);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		// The emulator runs on its own thread, so it keeps its pace when the
+		// window blocks, the PPU hands over completed frames. Every update is
+		// a frame, followed by waiting for the sync source
+		m_emulation = std::thread([this]() {
+			while (m_running.load(std::memory_order_relaxed)) {
+				if (!m_rewind) {
+					Emu::the().update();
+					continue;
+				}
+
+				// Go back two frames and emulate one, so the screen shows the
+				// frame that was rewound to
+				if (m_rewinding.load(std::memory_order_relaxed) && m_rewind->frames() >= 2) {
+					m_rewind->pop();
+					m_rewind->pop();
+				}
+
+				Emu::the().update();
+				m_rewind->push();
+			}
+		});
 	}
 
 	~GarbAGE()
 	{
+		m_running = false;
+		Emu::the().vsync(); // Could be waiting on the next frame
+		m_emulation.join();
+
+		// Flush the save file
+		Loader::the().unloadRom();
+
+		glDeleteBuffers(m_pixel_buffers.size(), m_pixel_buffers.data());
 	}
 
 	void update() override
 	{
-		// 154 scanlines * 456 cycles = 70224 cycles per frame
-		for (int i = 0; i < (144 * 456 + 10 * 456); ++i) {
-			Emu::the().update();
-		}
+		// Picked up by the emulation thread at its next frame
+		m_rewinding = Inferno::Input::isKeyPressed(Inferno::keyCode("GLFW_KEY_BACKSPACE"));
 	}
 
 	void render() override
 	{
-		auto* ppu = static_cast<PPU*>(Emu::the().processingUnit("PPU").get());
-		ppu->render();
+		auto screen = m_ppu->screen();
+
+		// Two pixel buffers take turns, the texture is updated from the one
+		// filled last frame, so the upload does not stall on the copy below
+		uint32_t upload_buffer = m_pixel_buffers[m_pixel_buffer_index];
+		m_pixel_buffer_index ^= 1;
+		uint32_t fill_buffer = m_pixel_buffers[m_pixel_buffer_index];
+
+		glBindTexture(GL_TEXTURE_2D, m_texture->id());
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload_buffer);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, m_texture->dataFormat(), GL_UNSIGNED_BYTE, nullptr);
+
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, fill_buffer);
+		void* pixels = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, screen.size(), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (pixels) {
+			memcpy(pixels, screen.data(), screen.size());
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		}
+
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		Emu::the().vsync();
 	}
+
+private:
+	uint32_t m_entity { 0 };
+	PPU* m_ppu { nullptr };
+
+	std::thread m_emulation;
+	std::atomic<bool> m_running { true };
+
+	std::unique_ptr<Rewind> m_rewind; // Only used by the emulation thread
+	std::atomic<bool> m_rewinding { false };
+
+	std::shared_ptr<Inferno::Texture> m_texture;
+	std::array<uint32_t, 2> m_pixel_buffers {};
+	uint32_t m_pixel_buffer_index { 0 };
 };
 
 Inferno::Application* Inferno::createApplication(int argc, char* argv[])
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <cstdint> // uint8_t, uint32_t
+#include <cstring> // memcpy
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "ppu.h"
+
+// Convert a scanline of color indices to pixels, a palette lookup per pixel
+
+static void colorizeRGB(const uint8_t* color_indices, const PPU::PaletteColors& colors, uint8_t* pixels)
+{
+	for (uint32_t x = 0; x < SCREEN_WIDTH; ++x) {
+		uint32_t color = colors[color_indices[x] & 0x3];
+		pixels[0] = color & 0xff;
+		pixels[1] = (color >> 8) & 0xff;
+		pixels[2] = (color >> 16) & 0xff;
+		pixels += 3;
+	}
+}
+
+#if defined(__x86_64__)
+
+// SSE2 is part of x86-64, select the palette color with a compare per color index
+static void colorizeRGBA(const uint8_t* color_indices, const PPU::PaletteColors& colors, uint8_t* pixels)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i palette[4] = {
+		_mm_set1_epi32(colors[0]),
+		_mm_set1_epi32(colors[1]),
+		_mm_set1_epi32(colors[2]),
+		_mm_set1_epi32(colors[3]),
+	};
+
+	for (uint32_t x = 0; x < SCREEN_WIDTH; x += 4) {
+		// Widen 4 color indices to 32-bit
+		int four_indices;
+		memcpy(&four_indices, color_indices + x, sizeof(four_indices));
+		__m128i indices = _mm_cvtsi32_si128(four_indices);
+		indices = _mm_unpacklo_epi16(_mm_unpacklo_epi8(indices, zero), zero);
+
+		__m128i result = _mm_and_si128(_mm_cmpeq_epi32(indices, zero), palette[0]);
+		for (int i = 1; i < 4; ++i) {
+			result = _mm_or_si128(result, _mm_and_si128(_mm_cmpeq_epi32(indices, _mm_set1_epi32(i)), palette[i]));
+		}
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + x * 4), result);
+	}
+}
+
+// The color indices are used directly as the shuffle control, 8 pixels per instruction
+__attribute__((target("avx2"))) static void colorizeRGBAAVX2(const uint8_t* color_indices, const PPU::PaletteColors& colors, uint8_t* pixels)
+{
+	__m256i palette = _mm256_setr_epi32(colors[0], colors[1], colors[2], colors[3], colors[0], colors[1], colors[2], colors[3]);
+
+	for (uint32_t x = 0; x < SCREEN_WIDTH; x += 8) {
+		__m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(color_indices + x)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(pixels + x * 4), _mm256_permutevar8x32_epi32(palette, indices));
+	}
+}
+
+#else
+
+static void colorizeRGBA(const uint8_t* color_indices, const PPU::PaletteColors& colors, uint8_t* pixels)
+{
+	for (uint32_t x = 0; x < SCREEN_WIDTH; ++x) {
+		uint32_t color = colors[color_indices[x] & 0x3];
+		pixels[0] = color & 0xff;
+		pixels[1] = (color >> 8) & 0xff;
+		pixels[2] = (color >> 16) & 0xff;
+		pixels[3] = color >> 24;
+		pixels += 4;
+	}
+}
+
+#endif
+
+// -----------------------------------------
+
+void PPU::colorizeLine(const uint8_t* color_indices, const PaletteColors& colors, uint32_t y)
+{
+	uint8_t* pixels = m_frames.back().data() + y * SCREEN_WIDTH * formatSize();
+
+	if (m_format == Format::RGB) {
+		colorizeRGB(color_indices, colors, pixels);
+		return;
+	}
+
+#if defined(__x86_64__)
+	static const bool avx2 = __builtin_cpu_supports("avx2");
+	if (avx2) {
+		colorizeRGBAAVX2(color_indices, colors, pixels);
+		return;
+	}
+#endif
+
+	colorizeRGBA(color_indices, colors, pixels);
+}
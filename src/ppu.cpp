@@ -5,39 +5,35 @@
  * SPDX-License-Identifier: MIT
  */
 
-#include <cstdint> // uint8_t, uint16_t, uint32_t
-#include <memory>  // std::make_shared
-
-#include "glm/ext/vector_float3.hpp" // glm::vec3
-#include "glm/ext/vector_float4.hpp" // glm::vec4
-#include "inferno/application.h"
-#include "inferno/component/spritecomponent.h"
-#include "inferno/component/transformcomponent.h"
-#include "inferno/scene/scene.h"
+#include <array>
+#include <cstdint> // uint8_t, uint16_t, uint32_t, uint64_t
+#include <cstring> // memcpy
+
 #include "ruc/format/print.h"
 
 #include "emu.h"
+#include "interrupt-controller.h"
 #include "ppu.h"
 #include "ruc/meta/assert.h"
+#include "save-state.h"
+#include "tile-cache.h"
 
 PPU::PPU(uint32_t frequency)
 	: ProcessingUnit(frequency)
 {
 	m_shared_registers.emplace("LY", &m_lcd_y_coordinate);
-
-	auto& scene = Inferno::Application::the().scene();
-	m_entity = scene.findEntity("Screen");
 }
 
 PPU::~PPU()
 {
 }
 
-void PPU::update()
+uint32_t PPU::update()
 {
 	LCDC lcd_control = static_cast<LCDC>(Emu::the().readMemory(0xff40));
 	if (!(lcd_control & LCDC::LCDandPPUEnable)) {
-		return;
+		// Nothing to draw until the LCD is turned back on, which wakes the PPU
+		return ProcessingUnit::idle;
 	}
 
 	// print("PPU update\n");
@@ -53,13 +49,32 @@ void PPU::update()
 			m_pixel_fifo = {};
 
 			m_state = State::PixelTransfer;
+			m_lcd_register_writes = Emu::the().lcdRegisterWrites();
+			m_pixel_transfer_cycle = Emu::the().cycle();
+
+			// Draw the scanline with the registers as they are at the start of the
+			// pixel transfer and skip to its end. A write before then rewinds the
+			// line, see rewindScanline()
+			m_scanline_rendering = m_renderer == Renderer::Scanline && !m_fifo_fallback;
+			if (m_scanline_rendering) {
+				renderScanline();
+				return skipClocks(172);
+			}
+			break;
 		}
-		break;
+
+		return skipClocks(80 - m_clocks_into_frame % 80);
 	case State::PixelTransfer:
+		if (m_scanline_rendering) {
+			m_state = State::HBlank;
+			break;
+		}
+
 		updatePixelFifo();
 
 		if (m_lcd_x_coordinate == 160) {
 			m_lcd_x_coordinate = 0;
+			checkRegisterWrites();
 			m_state = State::HBlank;
 		}
 		break;
@@ -70,12 +85,25 @@ void PPU::update()
 			m_lcd_y_coordinate++;
 			if (m_lcd_y_coordinate == 144) {
 				m_state = State::VBlank;
+
+				// Request the V-Blank interrupt
+				Emu::the().interrupts().raise(InterruptController::VBlank);
+
+				// When Bit 0 is cleared, both background and window become blank (white)
+				if (!(lcd_control & LCDC::BGandWindowEnable)) {
+					clearScreen();
+				}
+
+				// Hand the frame to the front-end, the next one is drawn into another buffer
+				m_frames.publish();
 			}
 			else {
 				m_state = State::OAMSearch;
 			}
+			break;
 		}
-		break;
+
+		return skipClocks((80 + 172 + 204) - m_clocks_into_frame % (80 + 172 + 204));
 	case State::VBlank:
 		// V-Blank logic goes here..
 
@@ -84,32 +112,15 @@ void PPU::update()
 			if (m_lcd_y_coordinate == 154) {
 				resetFrame();
 			}
+			break;
 		}
 
-		break;
+		return skipClocks((80 + 172 + 204) - m_clocks_into_frame % (80 + 172 + 204));
 	default:
 		VERIFY_NOT_REACHED();
 	};
-}
-
-void PPU::render()
-{
-	LCDC lcd_control = static_cast<LCDC>(Emu::the().readMemory(0xff40));
-
-	if (!(lcd_control & LCDC::BGandWindowEnable)) {
-		// When Bit 0 is cleared, both background and window become blank (white)
-		auto pixel = getPixelColor(0, Palette::BGP);
-		for (size_t i = 0; i < m_screen.size(); i += 3) {
-			m_screen[i + 0] = pixel[0];
-			m_screen[i + 1] = pixel[1];
-			m_screen[i + 2] = pixel[2];
-		}
-	}
 
-	auto& scene = Inferno::Application::the().scene();
-	auto texture = std::make_shared<Inferno::Texture>(m_screen.data(), SCREEN_WIDTH, SCREEN_HEIGHT, FORMAT_SIZE);
-	scene.removeComponent<Inferno::SpriteComponent>(m_entity);
-	scene.addComponent<Inferno::SpriteComponent>(m_entity, glm::vec4 { 1.0f }, texture);
+	return 1;
 }
 
 void PPU::resetFrame()
@@ -118,6 +129,44 @@ void PPU::resetFrame()
 	m_clocks_into_frame = 0;
 	m_lcd_x_coordinate = 0;
 	m_lcd_y_coordinate = 0;
+
+	// Games with mid-scanline effects tend to use them every frame, so keep
+	// using the pixel FIFO until a frame passes without them
+	m_fifo_fallback = m_mid_scanline_writes;
+	m_mid_scanline_writes = false;
+}
+
+void PPU::saveState(StateWriter& state) const
+{
+	state.write(m_state);
+	state.write(m_clocks_into_frame);
+	state.write(m_lcd_x_coordinate);
+	state.write(m_lcd_y_coordinate);
+	state.write(m_pixel_fifo);
+
+	state.write(m_scanline_rendering);
+	state.write(m_fifo_fallback);
+	state.write(m_mid_scanline_writes);
+	state.write(m_lcd_register_writes);
+	state.write(m_pixel_transfer_cycle);
+}
+
+void PPU::loadState(StateReader& state)
+{
+	state.read(m_state);
+	state.read(m_clocks_into_frame);
+	state.read(m_lcd_x_coordinate);
+	state.read(m_lcd_y_coordinate);
+	state.read(m_pixel_fifo);
+
+	state.read(m_scanline_rendering);
+	state.read(m_fifo_fallback);
+	state.read(m_mid_scanline_writes);
+	state.read(m_lcd_register_writes);
+	state.read(m_pixel_transfer_cycle);
+
+	// The palette registers were restored with the rest of the memory
+	m_palette_writes = ~static_cast<uint32_t>(0);
 }
 
 // -----------------------------------------
@@ -144,34 +193,48 @@ uint32_t PPU::getBgTileDataAddress(uint8_t tile_index)
 	};
 };
 
-std::array<uint8_t, 3> PPU::getPixelColor(uint8_t color_index, Palette palette)
+const PPU::PaletteColors& PPU::getPalette(Palette palette)
 {
-	VERIFY(color_index < 4, "trying to fetch invalid color index '{}'", color_index);
+	// Only decode the palettes again after they have been written to
+	if (m_palette_writes != Emu::the().paletteWrites()) {
+		updatePalettes();
+	}
+
+	return m_palettes[palette - Palette::BGP];
+}
+
+uint32_t PPU::getPixelColor(uint8_t color_index, Palette palette)
+{
+	return getPalette(palette)[color_index];
+}
+
+void PPU::updatePalettes()
+{
+	m_palette_writes = Emu::the().paletteWrites();
 
 	switch (Emu::the().mode()) {
 	case Emu::Mode::DMG: {
-		uint8_t palette_data = Emu::the().readMemory(palette) & 0xff;
-		uint8_t palette_value = palette_data >> (color_index * 2) & 0x3;
-		switch (palette_value) {
-		case 0:
-			return { 200, 199, 168 };
-		case 1:
-			return { 160, 160, 136 };
-		case 2:
-			return { 104, 104, 80 };
-		case 3:
-			return { 39, 40, 24 };
-		default:
-			VERIFY_NOT_REACHED();
+		static constexpr uint32_t shades[4] = {
+			rgba(200, 199, 168),
+			rgba(160, 160, 136),
+			rgba(104, 104, 80),
+			rgba(39, 40, 24),
 		};
+
+		for (Palette palette : { Palette::BGP, Palette::OBP0, Palette::OBP1 }) {
+			uint8_t palette_data = Emu::the().readMemory(palette);
+			for (uint8_t color_index = 0; color_index < 4; ++color_index) {
+				uint8_t palette_value = palette_data >> (color_index * 2) & 0x3;
+				m_palettes[palette - Palette::BGP][color_index] = shades[palette_value];
+			}
+		}
+		break;
 	}
 	case Emu::Mode::CGB:
 		VERIFY_NOT_REACHED();
 	default:
 		VERIFY_NOT_REACHED();
 	}
-
-	return {};
 }
 
 void PPU::updatePixelFifo()
@@ -199,6 +262,20 @@ void PPU::updatePixelFifo()
 	pushPixel();
 }
 
+// Bit of the color index of every pixel in a tile cache line, leftmost pixel in the highest bit
+static uint8_t bitplane(uint64_t line, uint32_t bit)
+{
+	// Moves bit 0 of byte x to bit 63 - x, the products do not overlap
+	return (((line >> bit) & 0x0101010101010101) * 0x8040201008040201) >> 56;
+}
+
+uint64_t PPU::tileLine()
+{
+	// Background tiles are always in the first VRAM bank on the DMG
+	uint32_t tile = (getBgTileDataAddress(m_pixel_fifo.tile_index) - 0x8000) / TILE_SIZE;
+	return Emu::the().tileCache().line(0, tile, m_pixel_fifo.tile_line);
+}
+
 void PPU::tileIndex()
 {
 	if (!m_pixel_fifo.step) {
@@ -222,9 +299,9 @@ void PPU::tileIndex()
 		m_pixel_fifo.viewport_x = Emu::the().readMemory(0xff43); // TODO: only read lower 3-bits at beginning of scanline
 		m_pixel_fifo.viewport_y = Emu::the().readMemory(0xff42);
 
-		// Read the tile map index
-		uint16_t offset = (((m_pixel_fifo.viewport_y + m_lcd_y_coordinate) / TILE_HEIGHT) * 32)
-		                  + ((m_pixel_fifo.viewport_x + m_pixel_fifo.x_coordinate) / TILE_WIDTH);
+		// Read the tile map index, the 32x32 tile map wraps around
+		uint16_t offset = ((static_cast<uint8_t>(m_pixel_fifo.viewport_y + m_lcd_y_coordinate) / TILE_HEIGHT) * 32)
+		                  + ((m_pixel_fifo.viewport_x + m_pixel_fifo.x_coordinate) / TILE_WIDTH) % 32;
 		m_pixel_fifo.x_coordinate += 8;
 		m_pixel_fifo.tile_index = Emu::the().readMemory(bg_tile_map_address + offset);
 
@@ -243,9 +320,7 @@ void PPU::tileDataLow()
 		m_pixel_fifo.state = PixelFifo::State::TileDataHigh;
 
 		// Read tile data
-		m_pixel_fifo.pixels_lsb = Emu::the().readMemory(
-			getBgTileDataAddress(m_pixel_fifo.tile_index)
-			+ m_pixel_fifo.tile_line * 2); // Each tile line is 2 bytes
+		m_pixel_fifo.pixels_lsb = bitplane(tileLine(), 0);
 	}
 }
 
@@ -259,16 +334,13 @@ void PPU::tileDataHigh()
 		m_pixel_fifo.state = PixelFifo::State::Sleep;
 
 		// Read tile data
-		m_pixel_fifo.pixels_msb = Emu::the().readMemory(
-			getBgTileDataAddress(m_pixel_fifo.tile_index)
-			+ m_pixel_fifo.tile_line * 2 // Each tile line is 2 bytes
-			+ 1);
+		m_pixel_fifo.pixels_msb = bitplane(tileLine(), 1);
 	}
 }
 
 void PPU::sleep()
 {
-	if (m_pixel_fifo.background.size() <= TILE_WIDTH + 1) {
+	if (m_pixel_fifo.background.size <= TILE_WIDTH + 1) {
 		m_pixel_fifo.state = PixelFifo::State::Push;
 	}
 }
@@ -276,27 +348,96 @@ void PPU::sleep()
 void PPU::pushFifo()
 {
 	m_pixel_fifo.state = PixelFifo::State::TileIndex;
-
-	for (uint8_t i = 0; i < TILE_WIDTH; ++i) {
-		uint8_t color_index = (m_pixel_fifo.pixels_lsb >> (7 - i)
-		                       | ((m_pixel_fifo.pixels_msb >> (7 - i)) << 1))
-		                      & 0x3;
-		m_pixel_fifo.background.push({ color_index, Palette::BGP });
-	}
+	m_pixel_fifo.background.push(m_pixel_fifo.pixels_lsb, m_pixel_fifo.pixels_msb);
 }
 
 void PPU::pushPixel()
 {
 	// The pixel FIFO needs to contain more than 8 pixels to shift one out
-	if (m_pixel_fifo.background.size() > 8) {
-		auto pixel = m_pixel_fifo.background.front();
-		m_pixel_fifo.background.pop();
-
-		uint32_t index = (m_lcd_y_coordinate * SCREEN_WIDTH + m_lcd_x_coordinate) * FORMAT_SIZE;
-		auto color = getPixelColor(pixel.first, pixel.second);
-		m_screen[index + 0] = color[0];
-		m_screen[index + 1] = color[1];
-		m_screen[index + 2] = color[2];
+	if (m_pixel_fifo.background.size > 8) {
+		auto pixel = m_pixel_fifo.background.pop();
+
+		uint8_t* destination = m_frames.back().data() + (m_lcd_y_coordinate * SCREEN_WIDTH + m_lcd_x_coordinate) * formatSize();
+		uint32_t color = getPixelColor(pixel.first, Palette::BGP);
+		destination[0] = color & 0xff;
+		destination[1] = (color >> 8) & 0xff;
+		destination[2] = (color >> 16) & 0xff;
+		if (m_format == Format::RGBA) {
+			destination[3] = color >> 24;
+		}
 		m_lcd_x_coordinate++;
 	}
 }
+
+void PPU::renderScanline()
+{
+	// Same output as the pixel FIFO, with every register read once per scanline
+
+	LCDC lcd_control = static_cast<LCDC>(Emu::the().readMemory(0xff40));
+	uint32_t bg_tile_map_address = (lcd_control & LCDC::BGTileMapArea) ? 0x9c00 : 0x9800;
+	m_pixel_fifo.tile_data_address = (lcd_control & LCDC::BGandWindowTileDataArea) ? 0x8000 : 0x8800;
+
+	uint8_t viewport_x = Emu::the().readMemory(0xff43);
+	uint8_t viewport_y = Emu::the().readMemory(0xff42);
+	uint8_t y = viewport_y + m_lcd_y_coordinate;
+	uint32_t tile_map_row = bg_tile_map_address + (y / TILE_HEIGHT) * 32;
+	uint32_t tile_line = y % TILE_HEIGHT;
+	TileCache& tile_cache = Emu::the().tileCache();
+
+	std::array<uint8_t, SCREEN_WIDTH> color_indices;
+	for (uint32_t x = 0; x < SCREEN_WIDTH; x += TILE_WIDTH) {
+		uint8_t tile_index = Emu::the().readMemory(tile_map_row + ((viewport_x + x) / TILE_WIDTH) % 32);
+
+		// Background tiles are always in the first VRAM bank on the DMG
+		uint32_t tile = (getBgTileDataAddress(tile_index) - 0x8000) / TILE_SIZE;
+		uint64_t line = tile_cache.line(0, tile, tile_line);
+		memcpy(color_indices.data() + x, &line, sizeof(line));
+	}
+
+	colorizeLine(color_indices.data(), getPalette(Palette::BGP), m_lcd_y_coordinate);
+}
+
+bool PPU::rewindScanline()
+{
+	if (m_state != State::PixelTransfer || !m_scanline_rendering) {
+		return false;
+	}
+
+	// Same state as the pixel FIFO has at the start of the pixel transfer, the
+	// pixels it draws again before the write are the same as the ones drawn
+	m_clocks_into_frame -= m_clocks_into_frame % (80 + 172 + 204) - 80;
+	m_lcd_x_coordinate = 0;
+	m_pixel_fifo = {};
+	m_scanline_rendering = false;
+
+	// Draw the rest of the frame with the pixel FIFO
+	m_mid_scanline_writes = true;
+	m_fifo_fallback = true;
+
+	return true;
+}
+
+void PPU::checkRegisterWrites()
+{
+	// Draw the next frame with the pixel FIFO as well
+	if (Emu::the().lcdRegisterWrites() != m_lcd_register_writes) {
+		m_mid_scanline_writes = true;
+		m_fifo_fallback = true;
+	}
+}
+
+void PPU::clearScreen()
+{
+	std::array<uint8_t, SCREEN_WIDTH> color_indices {};
+	for (uint32_t y = 0; y < SCREEN_HEIGHT; ++y) {
+		colorizeLine(color_indices.data(), getPalette(Palette::BGP), y);
+	}
+}
+
+uint32_t PPU::skipClocks(uint32_t clocks)
+{
+	// Nothing happens until the given amount of clocks have passed, so
+	// account for them now and get updated again once they're over
+	m_clocks_into_frame += clocks - 1;
+	return clocks;
+}
@@ -8,20 +8,22 @@
 #pragma once
 
 #include <array>
-#include <cstdint> // uint8_t, uint16_t, uint32_t
-#include <queue>
+#include <cstdint> // uint8_t, uint16_t, uint32_t, uint64_t
+#include <span>
 #include <utility> // std::pair
 
+#include "ruc/meta/assert.h"
 #include "ruc/meta/core.h"
 
 #include "processing-unit.h"
+#include "triple-buffer.h"
 
 #define SCREEN_WIDTH 160
 #define SCREEN_HEIGHT 144
-#define FORMAT_SIZE 3
 #define TILE_WIDTH 8
 #define TILE_HEIGHT 8
 #define TILE_SIZE 16
+#define CLOCKS_PER_FRAME 70224 // 154 scanlines * 456 clocks
 
 class PPU final : public ProcessingUnit {
 public:
@@ -73,21 +75,97 @@ public:
 		uint8_t pixels_lsb { 0 };
 		uint8_t pixels_msb { 0 };
 
-		using Fifo = std::queue<std::pair<uint8_t, Palette>>; // colorID, source
+		// Up to 16 pixels, stored as bitplanes with the front pixel in the highest bit
+		struct Fifo {
+			uint16_t lsb { 0 };
+			uint16_t msb { 0 };
+			uint16_t palette { 0 }; // OBJ palette, 0 = OBP0, 1 = OBP1
+			uint8_t size { 0 };
+
+			// Append the 8 pixels of a tile line, leftmost pixel in the highest bit
+			void push(uint8_t pixels_lsb, uint8_t pixels_msb, uint8_t pixels_palette = 0)
+			{
+				VERIFY(size <= 8, "pixel FIFO overflow");
+				uint8_t shift = 8 - size;
+				lsb |= pixels_lsb << shift;
+				msb |= pixels_msb << shift;
+				palette |= pixels_palette << shift;
+				size += 8;
+			}
+
+			std::pair<uint8_t, uint8_t> pop() // colorID, OBJ palette
+			{
+				std::pair<uint8_t, uint8_t> pixel = { static_cast<uint8_t>((lsb >> 15) | ((msb >> 15) << 1)), static_cast<uint8_t>(palette >> 15) };
+				lsb <<= 1;
+				msb <<= 1;
+				palette <<= 1;
+				size--;
+				return pixel;
+			}
+		};
 
 		Fifo background;
 		Fifo oam;
 	};
 
-	void update() override;
-	void render();
+	// How the background is drawn
+	enum class Renderer : uint8_t {
+		Fifo,     // Dot by dot through the pixel FIFO
+		Scanline, // Whole scanline at once, falls back to the FIFO when registers change mid-scanline
+	};
+
+	// Pixel layout of the screen
+	enum class Format : uint8_t {
+		RGB = 3,  // 3 bytes per pixel
+		RGBA = 4, // 4 bytes per pixel, alpha is always opaque
+	};
+
+	// Color of every color index, red in the lowest byte and alpha in the highest
+	using PaletteColors = std::array<uint32_t, 4>;
+	static constexpr uint32_t rgba(uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha = 255)
+	{
+		return red | green << 8 | blue << 16 | static_cast<uint32_t>(alpha) << 24;
+	}
+
+	uint32_t update() override;
 	void resetFrame();
 
+	// The frame being drawn is not part of the state, the screen is complete again after a frame
+	void saveState(StateWriter& state) const override;
+	void loadState(StateReader& state) override;
+
+	void setRenderer(Renderer renderer) { m_renderer = renderer; }
+	// Takes effect from the next pixel drawn, so the current frame is a mix of both
+	void setFormat(Format format) { m_format = format; }
+
+	// Called before a write to a register the background is drawn with. If the
+	// current line was drawn ahead by the scanline renderer, go back to the start
+	// of its pixel transfer with the pixel FIFO, to be replayed up to the write
+	bool rewindScanline();
+	// Cycle of the core at the start of the pixel transfer
+	uint64_t pixelTransferCycle() const { return m_pixel_transfer_cycle; }
+
+	State state() const { return m_state; }
+	Renderer renderer() const { return m_renderer; }
+	Format format() const { return m_format; }
+	uint32_t formatSize() const { return static_cast<uint32_t>(m_format); }
+
+	// Latest completed frame, may be called from another thread than the one
+	// running the emulator, but only from one
+	std::span<const uint8_t> screen()
+	{
+		m_frames.update();
+		return { m_frames.front().data(), SCREEN_WIDTH * SCREEN_HEIGHT * formatSize() };
+	}
+
 private:
 	uint32_t getBgTileDataAddress(uint8_t tile_index);
-	std::array<uint8_t, 3> getPixelColor(uint8_t color_index, Palette palette);
+	const PaletteColors& getPalette(Palette palette);
+	uint32_t getPixelColor(uint8_t color_index, Palette palette);
+	void updatePalettes();
 
 	void updatePixelFifo();
+	uint64_t tileLine();
 	void tileIndex();
 	void tileDataLow();
 	void tileDataHigh();
@@ -95,6 +173,13 @@ private:
 	void pushFifo();
 	void pushPixel();
 
+	void renderScanline();
+	void colorizeLine(const uint8_t* color_indices, const PaletteColors& colors, uint32_t y);
+	void checkRegisterWrites();
+
+	void clearScreen();
+	uint32_t skipClocks(uint32_t clocks);
+
 	// -------------------------------------
 
 	State m_state { State::OAMSearch };
@@ -104,6 +189,16 @@ private:
 
 	PixelFifo m_pixel_fifo;
 
-	uint32_t m_entity { 0 };
-	std::array<uint8_t, SCREEN_WIDTH * SCREEN_HEIGHT * FORMAT_SIZE> m_screen;
+	Renderer m_renderer { Renderer::Scanline };
+	bool m_scanline_rendering { false };  // Current scanline skips the pixel FIFO
+	bool m_fifo_fallback { false };       // Use the pixel FIFO for the rest of the frame
+	bool m_mid_scanline_writes { false }; // Registers changed mid-scanline this frame
+	uint32_t m_lcd_register_writes { 0 }; // Write count at the start of the pixel transfer
+	uint64_t m_pixel_transfer_cycle { 0 };
+
+	std::array<PaletteColors, 3> m_palettes;                  // BGP, OBP0, OBP1
+	uint32_t m_palette_writes { ~static_cast<uint32_t>(0) }; // Write count when the palettes were decoded
+
+	Format m_format { Format::RGB };
+	TripleBuffer<std::array<uint8_t, SCREEN_WIDTH * SCREEN_HEIGHT * 4>> m_frames; // Large enough for every format
 };
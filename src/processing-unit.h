@@ -11,12 +11,25 @@
 #include <string_view>
 #include <unordered_map>
 
+class StateReader;
+class StateWriter;
+
 class ProcessingUnit {
 public:
 	ProcessingUnit(uint32_t frequency);
 	virtual ~ProcessingUnit();
 
-	virtual void update() = 0;
+	// Returns the amount of cycles (at the frequency of the unit) until the
+	// unit has to be updated again, the core skips ahead to that cycle
+	virtual uint32_t update() = 0;
+
+	// Returned by update() to not be updated until the core wakes the unit,
+	// which happens whenever an interrupt becomes pending
+	static constexpr uint32_t idle = 0xffffffff;
+
+	// Everything needed to resume the unit, see Emu::saveState()
+	virtual void saveState(StateWriter&) const {}
+	virtual void loadState(StateReader&) {}
 
 	// -------------------------------------
 
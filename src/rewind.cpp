@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <algorithm> // std::min
+#include <cstddef>   // size_t
+#include <cstdint>   // uint8_t, uint32_t, uint64_t
+#include <cstring>   // memcpy
+#include <utility>   // std::swap
+#include <vector>
+
+#include "emu.h"
+#include "rewind.h"
+#include "ruc/meta/assert.h"
+
+Rewind::Rewind(uint32_t frames)
+	: m_deltas(frames)
+{
+	VERIFY(frames > 0, "rewind needs room for at least one frame");
+}
+
+Rewind::~Rewind()
+{
+}
+
+// -----------------------------------------
+
+static void writeVarint(std::vector<uint8_t>& buffer, size_t value)
+{
+	while (value >= 0x80) {
+		buffer.push_back(static_cast<uint8_t>(value) | 0x80);
+		value >>= 7;
+	}
+	buffer.push_back(static_cast<uint8_t>(value));
+}
+
+static size_t readVarint(const uint8_t*& data)
+{
+	size_t value = 0;
+	for (uint32_t shift = 0;; shift += 7) {
+		uint8_t byte = *data++;
+		value |= static_cast<size_t>(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			return value;
+		}
+	}
+}
+
+// Stores older XOR newer, with newer padded with zeroes to the size of older, as
+// runs of: amount of zeroes, amount of literal bytes, literal bytes
+static void encodeDelta(const std::vector<uint8_t>& older, const std::vector<uint8_t>& newer, std::vector<uint8_t>& delta)
+{
+	size_t size = older.size();
+	size_t common_size = std::min(size, newer.size());
+	auto byte = [&](size_t i) -> uint8_t { return older[i] ^ ((i < common_size) ? newer[i] : 0); };
+
+	delta.clear();
+	uint32_t older_size = size;
+	delta.resize(sizeof(older_size));
+	memcpy(delta.data(), &older_size, sizeof(older_size));
+
+	size_t i = 0;
+	while (i < size) {
+		// Most of the state is unchanged, so compare 8 bytes at a time
+		size_t zeros_start = i;
+		uint64_t lhs;
+		uint64_t rhs;
+		while (i + 8 <= common_size) {
+			memcpy(&lhs, older.data() + i, 8);
+			memcpy(&rhs, newer.data() + i, 8);
+			if (lhs != rhs) {
+				break;
+			}
+			i += 8;
+		}
+		while (i < size && byte(i) == 0) {
+			i++;
+		}
+
+		// Short runs of zeroes are cheaper to keep in the literal than to start a new run
+		size_t literal_start = i;
+		size_t zero_run = 0;
+		while (i < size && zero_run < 8) {
+			zero_run = (byte(i) == 0) ? zero_run + 1 : 0;
+			i++;
+		}
+		i -= zero_run;
+
+		writeVarint(delta, literal_start - zeros_start);
+		writeVarint(delta, i - literal_start);
+		for (size_t j = literal_start; j < i; ++j) {
+			delta.push_back(byte(j));
+		}
+	}
+}
+
+// Turns newer into older, in place
+static void applyDelta(const std::vector<uint8_t>& delta, std::vector<uint8_t>& state)
+{
+	uint32_t older_size;
+	memcpy(&older_size, delta.data(), sizeof(older_size));
+	state.resize(older_size);
+
+	const uint8_t* data = delta.data() + sizeof(older_size);
+	const uint8_t* end = delta.data() + delta.size();
+	size_t i = 0;
+	while (data < end) {
+		i += readVarint(data);
+		size_t literals = readVarint(data);
+		VERIFY(i + literals <= older_size, "rewind delta is corrupt");
+		for (size_t j = 0; j < literals; ++j) {
+			state[i++] ^= *data++;
+		}
+	}
+}
+
+// -----------------------------------------
+
+void Rewind::push()
+{
+	// Detached, so incremental snapshots taken in between keep their base
+	m_next_state.clear();
+	Emu::the().saveState(m_next_state, Emu::Snapshot::Detached);
+
+	if (!m_state.empty()) {
+		// Overwrites the oldest frame once the ring is full
+		m_newest = (m_newest + 1) % m_deltas.size();
+		encodeDelta(m_state, m_next_state, m_deltas[m_newest]);
+		m_size = std::min<uint32_t>(m_size + 1, m_deltas.size());
+	}
+
+	std::swap(m_state, m_next_state);
+}
+
+bool Rewind::pop()
+{
+	if (m_size == 0) {
+		return false;
+	}
+
+	// Only the newest delta is applied, so this does not depend on the length of the history
+	applyDelta(m_deltas[m_newest], m_state);
+	m_newest = (m_newest + m_deltas.size() - 1) % m_deltas.size();
+	m_size--;
+
+	Emu::the().loadState(m_state);
+	return true;
+}
+
+void Rewind::clear()
+{
+	m_state.clear();
+	m_size = 0;
+}
+
+size_t Rewind::memoryUsage() const
+{
+	size_t size = m_state.size();
+	for (uint32_t i = 0; i < m_size; ++i) {
+		size += m_deltas[(m_newest + m_deltas.size() - i) % m_deltas.size()].size();
+	}
+	return size;
+}
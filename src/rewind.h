@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <cstddef> // size_t
+#include <cstdint> // uint32_t
+#include <vector>
+
+// History of the most recent frames, to step the emulation back in time.
+// Only the latest save state is kept in full, every older frame is stored
+// as the XOR with the frame after it. Consecutive frames barely differ, so
+// this is mostly zeroes, which are run-length encoded. The states are
+// detached snapshots, recording or rewinding does not change the base of
+// incremental snapshots.
+class Rewind {
+public:
+	explicit Rewind(uint32_t frames);
+	virtual ~Rewind();
+
+	// Record the current state, call once per frame
+	void push();
+	// Restore the frame before the last recorded one, which becomes the last
+	// recorded one. Returns false if there is no older frame.
+	bool pop();
+	void clear();
+
+	uint32_t frames() const { return m_size; }
+	uint32_t capacity() const { return m_deltas.size(); }
+	// Bytes used by the stored frames
+	size_t memoryUsage() const;
+
+private:
+	std::vector<uint8_t> m_state; // Latest recorded state
+	std::vector<uint8_t> m_next_state;
+
+	// Ring of deltas, from newer to older frames
+	std::vector<std::vector<uint8_t>> m_deltas;
+	uint32_t m_newest { 0 };
+	uint32_t m_size { 0 };
+};
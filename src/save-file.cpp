@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <cstddef>    // size_t
+#include <cstdint>    // uint8_t
+#include <fcntl.h>    // open
+#include <mutex>      // std::lock_guard, std::unique_lock
+#include <string>
+#include <sys/mman.h> // mmap, msync, munmap
+#include <sys/stat.h> // fstat
+#include <thread>
+#include <unistd.h>   // close, ftruncate
+
+#include "ruc/format/log.h"
+#include "ruc/meta/assert.h"
+#include "save-file.h"
+
+SaveFile::SaveFile()
+{
+}
+
+SaveFile::~SaveFile()
+{
+	close();
+}
+
+// -----------------------------------------
+
+uint8_t* SaveFile::open(std::string_view path, size_t size)
+{
+	close();
+
+	int file = ::open(std::string(path).c_str(), O_RDWR | O_CREAT, 0644);
+	VERIFY(file != -1, "could not open save file '{}'", path);
+
+	// Accessing the mapping past the end of the file is an error, so grow it first
+	struct stat status;
+	VERIFY(fstat(file, &status) == 0, "could not stat save file '{}'", path);
+	if (static_cast<size_t>(status.st_size) < size) {
+		VERIFY(ftruncate(file, size) == 0, "could not resize save file '{}'", path);
+	}
+
+	// Shared, so writes end up in the file
+	void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+	VERIFY(memory != MAP_FAILED, "could not map save file '{}'", path);
+	::close(file);
+
+	m_data = static_cast<uint8_t*>(memory);
+	m_size = size;
+
+	m_closing = false;
+	m_flusher = std::thread(&SaveFile::flushPeriodically, this);
+
+	return m_data;
+}
+
+void SaveFile::close()
+{
+	if (!m_data) {
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_closing = true;
+	}
+	m_closing_condition.notify_one();
+	m_flusher.join();
+
+	flush();
+	munmap(m_data, m_size);
+	m_data = nullptr;
+	m_size = 0;
+}
+
+void SaveFile::flush()
+{
+	if (!m_data) {
+		return;
+	}
+
+	// Only the pages written to since the last flush are written back
+	if (msync(m_data, m_size, MS_SYNC) != 0) {
+		ruc::error("could not flush save file");
+	}
+}
+
+void SaveFile::flushPeriodically()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_closing_condition.wait_for(lock, flushInterval, [this]() { return m_closing; })) {
+		flush();
+	}
+}
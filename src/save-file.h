@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <chrono> // std::chrono::milliseconds
+#include <condition_variable>
+#include <cstddef> // size_t
+#include <cstdint> // uint8_t
+#include <mutex>
+#include <string_view>
+#include <thread>
+
+// File mapped into memory, used as battery-backed cartridge RAM. Writes go
+// straight into the page cache, the kernel keeps track of the dirty pages.
+// These are written back by a background thread, so the emulation thread
+// never waits on the disk.
+class SaveFile {
+public:
+	SaveFile();
+	virtual ~SaveFile();
+
+	// Time between flushes of the dirty pages to disk
+	static constexpr std::chrono::milliseconds flushInterval { 1000 };
+
+	// Created if it does not exist, extended with zeroes if it is too small
+	uint8_t* open(std::string_view path, size_t size);
+	// Flushes and unmaps the file
+	void close();
+	// Write the dirty pages to disk, blocks until done
+	void flush();
+
+	uint8_t* data() const { return m_data; }
+	size_t size() const { return m_size; }
+
+private:
+	void flushPeriodically();
+
+	uint8_t* m_data { nullptr };
+	size_t m_size { 0 };
+
+	std::thread m_flusher;
+	std::mutex m_mutex;
+	std::condition_variable m_closing_condition;
+	bool m_closing { false };
+};
@@ -0,0 +1,99 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <cstddef> // size_t
+#include <cstdint> // uint8_t
+#include <cstring> // memcpy
+#include <span>
+#include <string_view>
+#include <type_traits> // std::is_trivially_copyable_v
+#include <vector>
+
+#include "ruc/meta/assert.h"
+
+// Binary encoding of save states, values are stored as they are laid out
+// in host memory, so a state only loads on the same kind of host.
+
+class StateWriter {
+public:
+	// Appends to the buffer, so its capacity is reused between states
+	explicit StateWriter(std::vector<uint8_t>& buffer)
+		: m_buffer(buffer)
+	{
+	}
+
+	void writeBytes(const void* data, size_t size)
+	{
+		size_t offset = m_buffer.size();
+		m_buffer.resize(offset + size);
+		memcpy(m_buffer.data() + offset, data, size);
+	}
+
+	template<typename T>
+	void write(const T& value)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+		writeBytes(&value, sizeof(T));
+	}
+
+	void writeString(std::string_view string)
+	{
+		write(static_cast<uint8_t>(string.size()));
+		writeBytes(string.data(), string.size());
+	}
+
+	size_t size() const { return m_buffer.size(); }
+
+private:
+	std::vector<uint8_t>& m_buffer;
+};
+
+// -----------------------------------------
+
+class StateReader {
+public:
+	explicit StateReader(std::span<const uint8_t> buffer)
+		: m_buffer(buffer)
+	{
+	}
+
+	std::span<const uint8_t> readBytes(size_t size)
+	{
+		VERIFY(m_offset + size <= m_buffer.size(), "save state is truncated");
+		std::span<const uint8_t> data = m_buffer.subspan(m_offset, size);
+		m_offset += size;
+		return data;
+	}
+
+	template<typename T>
+	void read(T& value)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+		memcpy(&value, readBytes(sizeof(T)).data(), sizeof(T));
+	}
+
+	template<typename T>
+	T read()
+	{
+		T value;
+		read(value);
+		return value;
+	}
+
+	std::string_view readString()
+	{
+		uint8_t size = read<uint8_t>();
+		return { reinterpret_cast<const char*>(readBytes(size).data()), size };
+	}
+
+	bool atEnd() const { return m_offset == m_buffer.size(); }
+
+private:
+	std::span<const uint8_t> m_buffer;
+	size_t m_offset { 0 };
+};
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <cstdint> // uint8_t, uint16_t, uint32_t, uint64_t
+
+#include "emu.h"
+#include "ppu.h"
+#include "tile-cache.h"
+
+TileCache::TileCache()
+{
+	invalidateAll();
+}
+
+TileCache::~TileCache()
+{
+}
+
+// -----------------------------------------
+
+void TileCache::invalidate(uint16_t address)
+{
+	uint32_t tile = (address - 0x8000) / TILE_SIZE;
+	for (uint32_t bank = 0; bank < banks; ++bank) {
+		m_dirty[bank * tiles + tile] = true;
+	}
+}
+
+void TileCache::invalidateAll()
+{
+	m_dirty.fill(true);
+}
+
+// -----------------------------------------
+
+void TileCache::decode(uint32_t bank, uint32_t tile)
+{
+	uint32_t index = bank * tiles + tile;
+	m_dirty[index] = false;
+
+	// Each tile line is 2 bytes, the low and high bit of every color index
+	const uint8_t* data = Emu::the().memorySpace("VRAM").bank(bank) + tile * TILE_SIZE;
+	for (uint32_t y = 0; y < TILE_HEIGHT; ++y) {
+		uint8_t pixels_lsb = data[y * 2];
+		uint8_t pixels_msb = data[y * 2 + 1];
+
+		uint64_t line = 0;
+		for (uint32_t x = 0; x < TILE_WIDTH; ++x) {
+			uint64_t color_index = ((pixels_lsb >> (7 - x)) & 0x1) | (((pixels_msb >> (7 - x)) & 0x1) << 1);
+			line |= color_index << (x * 8);
+		}
+		m_lines[index][y] = line;
+	}
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint> // uint8_t, uint16_t, uint32_t, uint64_t
+
+// Tile data in VRAM decoded to color indices, so a line of 8 pixels is a
+// single load. Tiles are decoded when used after they have been written to.
+class TileCache {
+public:
+	TileCache();
+	virtual ~TileCache();
+
+	static constexpr uint32_t banks = 2;
+	static constexpr uint32_t tiles = 384; // Per bank, 0x8000~0x97ff
+
+	// Color index of pixel x is in byte x, leftmost pixel in the lowest byte
+	uint64_t line(uint32_t bank, uint32_t tile, uint32_t line)
+	{
+		uint32_t index = bank * tiles + tile;
+		if (m_dirty[index]) {
+			decode(bank, tile);
+		}
+		return m_lines[index][line];
+	}
+
+	// Drop the tile at the address, in every bank as the written one is not known
+	void invalidate(uint16_t address);
+	void invalidateAll();
+
+private:
+	void decode(uint32_t bank, uint32_t tile);
+
+	std::array<std::array<uint64_t, 8>, banks * tiles> m_lines {};
+	std::array<bool, banks * tiles> m_dirty {};
+};
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint> // uint8_t
+
+// Hands values from one producer thread to one consumer thread without
+// either waiting on the other. The producer writes into the back buffer and
+// publishes it, the consumer only ever sees the latest published value.
+template<typename T>
+class TripleBuffer {
+public:
+	// Producer
+
+	T& back() { return m_buffers[m_back]; }
+
+	void publish()
+	{
+		m_back = m_middle.exchange(m_back | fresh, std::memory_order_acq_rel) & index;
+	}
+
+	// Consumer
+
+	// Returns true if a newer value than the current front was published
+	bool update()
+	{
+		if (!(m_middle.load(std::memory_order_relaxed) & fresh)) {
+			return false;
+		}
+
+		m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & index;
+		return true;
+	}
+
+	const T& front() const { return m_buffers[m_front]; }
+
+private:
+	static constexpr uint8_t index = 0x3;
+	static constexpr uint8_t fresh = 0x4; // Middle buffer has not been seen by the consumer
+
+	std::array<T, 3> m_buffers {};
+	uint8_t m_back { 0 };
+	uint8_t m_front { 1 };
+	std::atomic<uint8_t> m_middle { 2 };
+};
@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <algorithm> // std::fill
+#include <chrono>    // std::chrono::system_clock
+#include <cstdint>   // int64_t, uint8_t, uint32_t
+#include <cstring>   // memcpy
+#include <vector>
+
+#include "cartridge.h"
+#include "emu.h"
+#include "macro.h"
+#include "testcase.h"
+#include "testsuite.h"
+
+// Every bank starts with its own bank number, the ROM has to outlive the test
+std::vector<uint8_t> setupCartridgeTest(uint8_t type, uint32_t rom_banks, uint32_t ram_banks)
+{
+	std::vector<uint8_t> rom(rom_banks * 0x4000);
+	for (uint32_t bank = 0; bank < rom_banks; ++bank) {
+		rom[bank * 0x4000] = bank & 0xff;
+		rom[bank * 0x4000 + 1] = bank >> 8;
+	}
+
+	Emu::the().destroy();
+	Emu::the().addMemorySpace("CARTROM1", 0x0000, 0x3fff, rom_banks, rom.data());
+	Emu::the().addMemorySpace("CARTROM2", 0x4000, 0x7fff, rom_banks, rom.data());
+	Emu::the().addMemorySpace("CARTRAM", 0xa000, 0xbfff, ram_banks);
+	Emu::the().switchBank("CARTROM2", 1);
+	Emu::the().setCartridge(Cartridge::create(type, rom_banks, ram_banks));
+
+	return rom;
+}
+
+// -----------------------------------------
+
+TEST_CASE(CartridgeMBC1)
+{
+	auto rom = setupCartridgeTest(0x03, 64, 4);
+
+	// Bank 0 selects bank 1
+	Emu::the().writeMemory(0x2000, 0x00);
+	EXPECT_EQ(Emu::the().readMemory(0x4000), 1);
+	Emu::the().writeMemory(0x2000, 0x05);
+	EXPECT_EQ(Emu::the().readMemory(0x4000), 5);
+	EXPECT_EQ(rom[0x4000], 1);
+
+	// Upper bits, which also apply to 0x0000~0x3fff in advanced banking mode
+	Emu::the().writeMemory(0x4000, 0x01);
+	EXPECT_EQ(Emu::the().readMemory(0x4000), 0x25);
+	EXPECT_EQ(Emu::the().readMemory(0x0000), 0);
+	Emu::the().writeMemory(0x6000, 0x01);
+	EXPECT_EQ(Emu::the().readMemory(0x0000), 0x20);
+	EXPECT_EQ(Emu::the().memorySpace("CARTRAM").active_bank, 1);
+
+	// RAM is disabled until enabled
+	Emu::the().writeMemory(0xa000, 0x42);
+	EXPECT_EQ(Emu::the().readMemory(0xa000), 0xff);
+	Emu::the().writeMemory(0x0000, 0x0a);
+	Emu::the().writeMemory(0xa000, 0x42);
+	EXPECT_EQ(Emu::the().readMemory(0xa000), 0x42);
+	EXPECT(Emu::the().readPointer(0xa000) != nullptr);
+	Emu::the().writeMemory(0x0000, 0x00);
+	EXPECT_EQ(Emu::the().readMemory(0xa000), 0xff);
+	EXPECT(Emu::the().readPointer(0xa000) == nullptr);
+}
+
+TEST_CASE(CartridgeMBC2)
+{
+	auto rom = setupCartridgeTest(0x06, 16, 1);
+
+	// Bit 8 of the address selects the ROM bank register
+	Emu::the().writeMemory(0x2100, 0x07);
+	EXPECT_EQ(Emu::the().readMemory(0x4000), 7);
+	Emu::the().writeMemory(0x2000, 0x03);
+	EXPECT_EQ(Emu::the().readMemory(0x4000), 7);
+
+	// Half bytes, repeated every 512 bytes
+	Emu::the().writeMemory(0x0000, 0x0a);
+	Emu::the().writeMemory(0xa005, 0x3c);
+	EXPECT_EQ(Emu::the().readMemory(0xa005), 0xfc);
+	EXPECT_EQ(Emu::the().readMemory(0xa205), 0xfc);
+}
+
+TEST_CASE(CartridgeMBC3)
+{
+	auto rom = setupCartridgeTest(0x10, 128, 4);
+
+	Emu::the().writeMemory(0x2000, 0x7f);
+	EXPECT_EQ(Emu::the().readMemory(0x4000), 0x7f);
+
+	// RAM banks
+	Emu::the().writeMemory(0x0000, 0x0a);
+	Emu::the().writeMemory(0x4000, 0x02);
+	Emu::the().writeMemory(0xa000, 0x22);
+	Emu::the().writeMemory(0x4000, 0x00);
+	EXPECT_EQ(Emu::the().readMemory(0xa000), 0x0);
+	Emu::the().writeMemory(0x4000, 0x02);
+	EXPECT_EQ(Emu::the().readMemory(0xa000), 0x22);
+
+	// Halt the clock so it does not depend on the host, then set it
+	Emu::the().writeMemory(0x4000, 0x0c);
+	Emu::the().writeMemory(0xa000, 0x41);
+	for (uint8_t rtc_register : { 0x08, 0x09, 0x0a, 0x0b }) {
+		Emu::the().writeMemory(0x4000, rtc_register);
+		Emu::the().writeMemory(0xa000, rtc_register * 2);
+	}
+
+	// Registers read the value of the last latch
+	Emu::the().writeMemory(0x4000, 0x08);
+	EXPECT_EQ(Emu::the().readMemory(0xa000), 0x0);
+	Emu::the().writeMemory(0x6000, 0x00);
+	Emu::the().writeMemory(0x6000, 0x01);
+	for (uint8_t rtc_register : { 0x08, 0x09, 0x0a, 0x0b }) {
+		Emu::the().writeMemory(0x4000, rtc_register);
+		EXPECT_EQ(Emu::the().readMemory(0xa000), rtc_register * 2);
+	}
+	Emu::the().writeMemory(0x4000, 0x0c);
+	EXPECT_EQ(Emu::the().readMemory(0xa000), 0x41);
+}
+
+TEST_CASE(CartridgeMBC3Clock)
+{
+	auto rom = setupCartridgeTest(0x10, 128, 4);
+	std::vector<uint8_t> battery(Cartridge::batteryDataSize(0x10));
+	Emu::the().cartridge()->setBatteryData(battery.data());
+
+	// Halt the clock, then set it
+	Emu::the().writeMemory(0x0000, 0x0a);
+	Emu::the().writeMemory(0x4000, 0x0c);
+	Emu::the().writeMemory(0xa000, 0x41);
+	for (uint8_t rtc_register : { 0x08, 0x09, 0x0a, 0x0b }) {
+		Emu::the().writeMemory(0x4000, rtc_register);
+		Emu::the().writeMemory(0xa000, rtc_register * 2);
+	}
+	EXPECT_EQ(battery[0], 0x10);
+	EXPECT_EQ(battery[16], 0x41);
+
+	// Continues from the save file at the next power on
+	Emu::the().setCartridge(Cartridge::create(0x10, 128, 4));
+	Emu::the().cartridge()->setBatteryData(battery.data());
+	Emu::the().writeMemory(0x0000, 0x0a);
+	Emu::the().writeMemory(0x6000, 0x00);
+	Emu::the().writeMemory(0x6000, 0x01);
+	for (uint8_t rtc_register : { 0x08, 0x09, 0x0a, 0x0b }) {
+		Emu::the().writeMemory(0x4000, rtc_register);
+		EXPECT_EQ(Emu::the().readMemory(0xa000), rtc_register * 2);
+	}
+	Emu::the().writeMemory(0x4000, 0x0c);
+	EXPECT_EQ(Emu::the().readMemory(0xa000), 0x41);
+
+	// A running clock kept counting while powered off
+	std::fill(battery.begin(), battery.end(), 0);
+	int64_t timestamp = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count() - 100;
+	memcpy(battery.data() + 40, &timestamp, sizeof(timestamp));
+	Emu::the().setCartridge(Cartridge::create(0x10, 128, 4));
+	Emu::the().cartridge()->setBatteryData(battery.data());
+	Emu::the().writeMemory(0x0000, 0x0a);
+	Emu::the().writeMemory(0x6000, 0x00);
+	Emu::the().writeMemory(0x6000, 0x01);
+	Emu::the().writeMemory(0x4000, 0x09);
+	EXPECT_EQ(Emu::the().readMemory(0xa000), 1);
+}
+
+TEST_CASE(CartridgeMBC5)
+{
+	auto rom = setupCartridgeTest(0x1b, 512, 16);
+
+	// 9-bit bank number, bank 0 can be selected
+	Emu::the().writeMemory(0x2000, 0x00);
+	EXPECT_EQ(Emu::the().readMemory(0x4000), 0);
+	Emu::the().writeMemory(0x3000, 0x01);
+	Emu::the().writeMemory(0x2000, 0x23);
+	EXPECT_EQ(Emu::the().readMemory(0x4000), 0x23);
+	EXPECT_EQ(Emu::the().readMemory(0x4001), 0x1);
+
+	Emu::the().writeMemory(0x4000, 0x0f);
+	EXPECT_EQ(Emu::the().memorySpace("CARTRAM").active_bank, 15);
+}
+
+TEST_CASE(CartridgeMBC5Rumble)
+{
+	auto rom = setupCartridgeTest(0x1e, 64, 8);
+
+	// Bit 3 turns on the motor, it does not select a RAM bank
+	Emu::the().writeMemory(0x4000, 0x0b);
+	EXPECT_EQ(Emu::the().memorySpace("CARTRAM").active_bank, 3);
+}
@@ -4,12 +4,16 @@
  * SPDX-License-Identifier: MIT
  */
 
-#include <memory> // std::make_shared, std::shared_ptr
+#include <cstdint> // uint32_t
+#include <memory>  // std::make_shared, std::shared_ptr
 #include <vector>
 
 #include "cpu.h"
 #include "emu.h"
+#include "interrupt-controller.h"
 #include "macro.h"
+#include "ppu.h"
+#include "processing-unit.h"
 #include "testcase.h"
 #include "testsuite.h"
 
@@ -27,6 +31,30 @@ struct CPUTest {
 	}
 };
 
+// Requests the V-Blank interrupt once, after a delay
+struct VBlankSource final : public ProcessingUnit {
+	VBlankSource()
+		: ProcessingUnit(4000000)
+	{
+	}
+
+	uint32_t update() override
+	{
+		// Idle units are also woken up by writes of other units
+		m_updates++;
+		if (m_updates == 1) {
+			return 10000;
+		}
+		if (m_updates == 2) {
+			Emu::the().interrupts().raise(InterruptController::VBlank);
+		}
+
+		return ProcessingUnit::idle;
+	}
+
+	uint32_t m_updates { 0 };
+};
+
 std::shared_ptr<CPU> runCPUTest(std::vector<uint8_t> test)
 {
 	auto cpu = std::make_shared<CPU>(4000000);
@@ -43,7 +71,25 @@ std::shared_ptr<CPU> runCPUTest(std::vector<uint8_t> test)
 
 	// Run the test
 	while (cpu->pc() < test.size()) {
-		Emu::the().update();
+		Emu::the().step();
+	}
+
+	return cpu;
+}
+
+// Load the test, next to a unit that requests the V-Blank interrupt once
+std::shared_ptr<CPU> setupVBlankCPUTest(std::vector<uint8_t> test)
+{
+	auto cpu = std::make_shared<CPU>(4000000);
+
+	Emu::the().destroy();
+	Emu::the().init(8000000);
+	Emu::the().addProcessingUnit("cpu", cpu);
+	Emu::the().addProcessingUnit("vblank", std::make_shared<VBlankSource>());
+	Emu::the().addMemorySpace("FULL", 0x0000, 0xffff);
+
+	for (size_t i = 0; i < test.size(); ++i) {
+		Emu::the().writeMemory(i, test[i]);
 	}
 
 	return cpu;
@@ -180,3 +226,178 @@ TEST_CASE(CPUPopFromStack)
 	EXPECT_EQ(Emu::the().readMemory(0xfffd), 0x3c);
 	EXPECT_EQ(Emu::the().readMemory(0xfffc), 0x5f);
 }
+
+TEST_CASE(CPUWriteToCachedCode)
+{
+	// Code in ROM is cached, writing to it should invalidate the cache
+
+	std::vector<uint8_t> self_modify = {
+		// clang-format off
+		0x31, 0xfe, 0xff, // LD SP,i16
+		0x06, 0x00,       // LD B,i8
+		0xcd, 0x13, 0x00, // CALL a16, run the subroutine once so it gets cached
+		0x3e, 0x04,       // LD A,i8, INC B opcode
+		0xea, 0x13, 0x00, // LD (a16),A, replace the NOP in the subroutine
+		0xcd, 0x13, 0x00, // CALL a16
+		0xc3, 0x15, 0x00, // JP a16, end of the test
+		0x00,             // NOP
+		0xc9,             // RET
+		// clang-format on
+	};
+	auto cpu = runCPUTest(self_modify);
+	EXPECT_EQ(cpu->b(), 0x01);
+	EXPECT_EQ(cpu->sp(), 0xfffe);
+}
+
+TEST_CASE(CPUHaltUntilInterrupt)
+{
+	std::vector<uint8_t> halt = {
+		// clang-format off
+		0x31, 0xfe, 0xff, // LD SP,i16
+		0x3e, 0x01,       // LD A,i8
+		0xe0, 0xff,       // LDH (a8),A, enable the V-Blank interrupt
+		0xfb,             // EI
+		0x76,             // HALT
+		0xc3, 0x42, 0x00, // JP a16
+		// clang-format on
+	};
+	halt.resize(0x40);
+	halt.insert(halt.end(), {
+		// clang-format off
+		0x04, // INC B, V-Blank interrupt handler
+		0xd9, // RETI
+		0x76, // HALT, end of the test
+		// clang-format on
+	});
+
+	auto cpu = setupVBlankCPUTest(halt);
+
+	// The CPU idles in both HALTs, waiting for an interrupt
+	Emu::the().run(40000);
+	EXPECT_EQ(cpu->pc(), 0x43);
+	EXPECT_EQ(cpu->b(), 0x01);
+	EXPECT_EQ(cpu->sp(), 0xfffe);
+}
+
+TEST_CASE(CPUStopUntilInterrupt)
+{
+	// The joypad is not emulated, so STOP ends like HALT
+
+	std::vector<uint8_t> stop = {
+		// clang-format off
+		0x3e, 0x01,       // LD A,i8
+		0xe0, 0xff,       // LDH (a8),A, enable the V-Blank interrupt
+		0x10, 0x00,       // STOP
+		0x04,             // INC B
+		0x18, 0xfe,       // JR s8
+		// clang-format on
+	};
+
+	auto cpu = setupVBlankCPUTest(stop);
+	Emu::the().run(40000);
+	EXPECT_EQ(cpu->pc(), 0x07);
+	EXPECT_EQ(cpu->b(), 0x01);
+}
+
+TEST_CASE(CPUInterruptAfterEI)
+{
+	// The interrupt is serviced after exactly one instruction following EI
+
+	std::vector<uint8_t> ei = {
+		// clang-format off
+		0x31, 0xfe, 0xff, // LD SP,i16
+		0x3e, 0x01,       // LD A,i8
+		0xe0, 0x0f,       // LDH (a8),A, request the V-Blank interrupt
+		0xe0, 0xff,       // LDH (a8),A, enable the V-Blank interrupt
+		0xfb,             // EI
+		0x04,             // INC B
+		0x04,             // INC B
+		0x04,             // INC B
+		0x18, 0xfe,       // JR s8
+		// clang-format on
+	};
+	ei.resize(0x40);
+	ei.insert(ei.end(), {
+		// clang-format off
+		0xc3, 0x00, 0x01, // JP a16, V-Blank interrupt handler, end of the test
+		// clang-format on
+	});
+
+	auto cpu = runCPUTest(ei);
+	EXPECT_EQ(cpu->b(), 0x01);
+}
+
+TEST_CASE(CPUInterruptAfterRegisterWrite)
+{
+	// Writes to registers through a pointer take effect before the next instruction
+
+	std::vector<uint8_t> indirect = {
+		// clang-format off
+		0x31, 0xfe, 0xff, // LD SP,i16
+		0x3e, 0x01,       // LD A,i8
+		0xe0, 0x0f,       // LDH (a8),A, request the V-Blank interrupt
+		0xfb,             // EI
+		0x00,             // NOP
+		0x21, 0xff, 0xff, // LD HL,i16
+		0x77,             // LD (HL),A, enable the V-Blank interrupt
+		0x04,             // INC B
+		0x04,             // INC B
+		0x18, 0xfe,       // JR s8
+		// clang-format on
+	};
+	indirect.resize(0x40);
+	indirect.insert(indirect.end(), {
+		// clang-format off
+		0xc3, 0x00, 0x01, // JP a16, V-Blank interrupt handler, end of the test
+		// clang-format on
+	});
+
+	auto cpu = runCPUTest(indirect);
+	EXPECT_EQ(cpu->b(), 0x00);
+}
+
+TEST_CASE(CPUPollLYThroughPointer)
+{
+	// Registers read through a pointer have the value of when the instruction
+	// runs. Blocks are split at such reads the first time, so wait twice
+
+	std::vector<uint8_t> poll = {
+		// clang-format off
+		0x21, 0x44, 0xff, // LD HL,i16
+		0x0e, 0x02,       // LD C,i8
+		0x7e,             // LD A,(HL)
+		0xfe, 0x05,       // CP i8
+		0x20, 0xfb,       // JR NZ,s8, until the start of line 5
+		// clang-format on
+	};
+	poll.insert(poll.end(), 119, 0x00); // NOP, past the end of line 5
+	poll.insert(poll.end(), {
+		// clang-format off
+		0x7e,             // LD A,(HL)
+		0x0d,             // DEC C
+		0x20, 0x80,       // JR NZ,s8, wait for line 5 of the next frame
+		// clang-format on
+	});
+
+	auto cpu = std::make_shared<CPU>(4000000);
+
+	Emu::the().destroy();
+	Emu::the().init(4000000);
+	Emu::the().addProcessingUnit("cpu", cpu);
+	Emu::the().addProcessingUnit("PPU", std::make_shared<PPU>(4000000));
+	Emu::the().addMemorySpace("CARTROM", 0x0000, 0x7fff);
+	Emu::the().addMemorySpace("VRAM", 0x8000, 0x9fff);
+	Emu::the().addMemorySpace("IO", 0xff00, 0xff7f);
+	Emu::the().addMemorySpace("IE", 0xffff, 0xffff);
+	Emu::the().writeMemory(0xff40, 0x91);
+
+	for (size_t i = 0; i < poll.size(); ++i) {
+		Emu::the().writeMemory(i, poll[i]);
+	}
+
+	while (cpu->pc() < poll.size()) {
+		Emu::the().step();
+	}
+
+	EXPECT_EQ(cpu->a(), 6);
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <chrono>  // std::chrono::milliseconds
+#include <cstdint> // uint8_t
+#include <memory>  // std::make_shared
+#include <thread>
+#include <vector>
+
+#include "emu.h"
+#include "interrupt-controller.h"
+#include "macro.h"
+#include "ppu.h"
+#include "processing-unit.h"
+#include "testcase.h"
+#include "testsuite.h"
+
+TEST_CASE(EmuEchoRam)
+{
+	Emu::the().destroy();
+	Emu::the().addMemorySpace("WRAM1", 0xc000, 0xcfff);
+	Emu::the().addMemorySpace("WRAM2", 0xd000, 0xdfff, 2);
+
+	// Writes into WRAM are visible in ECHO RAM and vice versa
+	Emu::the().writeMemory(0xc123, 0x42);
+	EXPECT_EQ(Emu::the().readMemory(0xe123), 0x42);
+	Emu::the().writeMemory(0xfd00, 0x24);
+	EXPECT_EQ(Emu::the().readMemory(0xdd00), 0x24);
+
+	// ECHO RAM follows the active bank
+	Emu::the().switchBank("WRAM2", 1);
+	EXPECT_EQ(Emu::the().readMemory(0xfd00), 0x0);
+	Emu::the().writeMemory(0xd000, 0x11);
+	EXPECT_EQ(Emu::the().readMemory(0xf000), 0x11);
+	Emu::the().switchBank("WRAM2", 0);
+	EXPECT_EQ(Emu::the().readMemory(0xfd00), 0x24);
+}
+
+TEST_CASE(EmuPartialPages)
+{
+	Emu::the().destroy();
+	Emu::the().addMemorySpace("OAM", 0xfe00, 0xfe9f);
+	Emu::the().addMemorySpace("Not Usable", 0xfea0, 0xfeff);
+	Emu::the().addMemorySpace("IO", 0xff00, 0xff7f);
+	Emu::the().addMemorySpace("HRAM", 0xff80, 0xfffe);
+	Emu::the().addMemorySpace("IE", 0xffff, 0xffff);
+
+	// Pages that are shared between memory spaces go through the slow path
+	Emu::the().writeMemory(0xfe9f, 0x1);
+	Emu::the().writeMemory(0xfea0, 0x2);
+	Emu::the().writeMemory(0xff80, 0x3);
+	Emu::the().writeMemory(0xffff, 0x4);
+	EXPECT_EQ(Emu::the().readMemory(0xfe9f), 0x1);
+	EXPECT_EQ(Emu::the().readMemory(0xfea0), 0x2);
+	EXPECT_EQ(Emu::the().readMemory(0xff80), 0x3);
+	EXPECT_EQ(Emu::the().readMemory(0xffff), 0x4);
+}
+
+TEST_CASE(EmuExternalMemory)
+{
+	std::vector<uint8_t> rom(3 * 0x4000);
+	rom[0x0000] = 0x11;
+	rom[0x4000] = 0x22;
+	rom[0x8000] = 0x33;
+
+	Emu::the().destroy();
+	Emu::the().addMemorySpace("CARTROM1", 0x0000, 0x3fff, 1, rom.data());
+	Emu::the().addMemorySpace("CARTROM2", 0x4000, 0x7fff, 2, rom.data() + 0x4000);
+
+	// Reads come straight from the memory of the caller, banks included
+	EXPECT_EQ(Emu::the().readMemory(0x0000), 0x11);
+	EXPECT_EQ(Emu::the().readMemory(0x4000), 0x22);
+	Emu::the().switchBank("CARTROM2", 1);
+	EXPECT_EQ(Emu::the().readMemory(0x4000), 0x33);
+	rom[0x8001] = 0x44;
+	EXPECT_EQ(Emu::the().readMemory(0x4001), 0x44);
+}
+
+TEST_CASE(EmuInterruptRegisters)
+{
+	Emu::the().destroy();
+	Emu::the().addMemorySpace("IO", 0xff00, 0xff7f);
+	Emu::the().addMemorySpace("IE", 0xffff, 0xffff);
+
+	auto& interrupts = Emu::the().interrupts();
+
+	// IE and IF are accessible through memory, unused bits of IF read as 1
+	Emu::the().writeMemory(0xffff, InterruptController::Timer | InterruptController::Joypad);
+	interrupts.raise(InterruptController::VBlank);
+	EXPECT_EQ(Emu::the().readMemory(0xffff), 0x14);
+	EXPECT_EQ(Emu::the().readMemory(0xff0f), 0xe1);
+	EXPECT(!interrupts.pending());
+
+	// The lowest enabled bit has priority
+	Emu::the().writeMemory(0xff0f, 0xff);
+	EXPECT(interrupts.pending());
+	EXPECT(interrupts.next() == InterruptController::Timer);
+	interrupts.acknowledge(InterruptController::Timer);
+	EXPECT(interrupts.next() == InterruptController::Joypad);
+	interrupts.acknowledge(InterruptController::Joypad);
+	EXPECT(!interrupts.pending());
+	EXPECT_EQ(Emu::the().readMemory(0xff0f), 0xeb);
+}
+
+TEST_CASE(EmuVSync)
+{
+	struct Counter final : public ProcessingUnit {
+		Counter()
+			: ProcessingUnit(4000000)
+		{
+		}
+
+		uint32_t update() override { return 1000; }
+	};
+
+	Emu::the().destroy();
+	Emu::the().init(4000000);
+	Emu::the().addProcessingUnit("counter", std::make_shared<Counter>());
+	Emu::the().setSync(Emu::Sync::VSync);
+
+	// Every update is a frame, which only starts once the previous one was presented
+	std::thread front_end([]() {
+		for (int i = 0; i < 3; ++i) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			Emu::the().vsync();
+		}
+	});
+	for (int i = 0; i < 3; ++i) {
+		Emu::the().update();
+	}
+	front_end.join();
+
+	EXPECT_EQ(Emu::the().cycle(), CLOCKS_PER_FRAME * 3);
+}
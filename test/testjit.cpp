@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifdef GARBAGE_JIT
+
+#include <cstdint> // uint8_t, uint32_t, uint64_t
+#include <memory>  // std::make_shared, std::shared_ptr
+#include <vector>
+
+#include "cpu.h"
+#include "emu.h"
+#include "macro.h"
+#include "testcase.h"
+#include "testsuite.h"
+
+struct JITResult {
+	uint32_t af;
+	uint32_t bc;
+	uint32_t de;
+	uint32_t hl;
+	uint32_t sp;
+	uint64_t cycle;
+	uint32_t checksum;
+};
+
+// In differential mode the interpreter redoes every native block, so memory
+// only shows the stores of the native code when it is off
+JITResult runJITTest(const std::vector<uint8_t>& test, bool jit, bool differential = false)
+{
+	auto cpu = std::make_shared<CPU>(4000000);
+	cpu->setJIT(jit);
+	cpu->setJITDifferential(differential);
+
+	Emu::the().destroy();
+	Emu::the().init(8000000);
+	Emu::the().addProcessingUnit("cpu", cpu);
+	Emu::the().addMemorySpace("ROM", 0x0000, 0x7fff);
+	Emu::the().addMemorySpace("RAM", 0x8000, 0xffff);
+
+	// Load the test
+	for (size_t i = 0; i < test.size(); ++i) {
+		Emu::the().writeMemory(i, test[i]);
+	}
+
+	// Run the test
+	while (cpu->pc() < test.size()) {
+		Emu::the().step();
+	}
+
+	uint32_t checksum = 0;
+	for (uint32_t address = 0xc000; address < 0xc100; ++address) {
+		checksum = checksum * 31 + Emu::the().readMemory(address);
+	}
+
+	return { cpu->af(), cpu->bc(), cpu->de(), cpu->hl(), cpu->sp(), Emu::the().cycle(), checksum };
+}
+
+// Loop the body often enough for it to be compiled
+std::vector<uint8_t> loopJITTest(const std::vector<uint8_t>& body)
+{
+	std::vector<uint8_t> test = {
+		// clang-format off
+		0x31, 0xfe, 0xff, // LD SP,i16
+		0x3e, 0x40,       // LD A,i8, loop count
+		0xea, 0xff, 0xc0, // LD (a16),A
+		// clang-format on
+	};
+	test.reserve(test.size() + body.size() + 16);
+
+	uint32_t loop = test.size();
+	test.insert(test.end(), body.begin(), body.end());
+
+	test.insert(test.end(), {
+		// clang-format off
+		0x21, 0xff, 0xc0, // LD HL,i16
+		0x35,             // DEC (HL)
+		0xc2,             // JP NZ,a16
+		// clang-format on
+	});
+	test.push_back(loop & 0xff);
+	test.push_back(loop >> 8);
+
+	// JP a16, end of the test
+	uint32_t end = test.size() + 3;
+	test.insert(test.end(), { 0xc3, static_cast<uint8_t>(end & 0xff), static_cast<uint8_t>(end >> 8) });
+
+	return test;
+}
+
+void expectJITEqual(const std::vector<uint8_t>& test)
+{
+	JITResult interpreter = runJITTest(test, false);
+
+	// Once for the memory effects of the native code, once cross-checked with the interpreter
+	for (bool differential : { false, true }) {
+		JITResult jit = runJITTest(test, true, differential);
+
+		EXPECT_EQ(jit.af, interpreter.af);
+		EXPECT_EQ(jit.bc, interpreter.bc);
+		EXPECT_EQ(jit.de, interpreter.de);
+		EXPECT_EQ(jit.hl, interpreter.hl);
+		EXPECT_EQ(jit.sp, interpreter.sp);
+		EXPECT_EQ(jit.cycle, interpreter.cycle);
+		EXPECT_EQ(jit.checksum, interpreter.checksum);
+	}
+}
+
+// -----------------------------------------
+
+TEST_CASE(JITLoads)
+{
+	expectJITEqual(loopJITTest({
+		// clang-format off
+		0x06, 0x12,       // LD B,i8
+		0x0e, 0x34,       // LD C,i8
+		0x50,             // LD D,B
+		0x59,             // LD E,C
+		0x00,             // NOP
+		0x7a,             // LD A,D
+		0x83,             // ADD A,E
+		0x47,             // LD B,A
+		0x21, 0x00, 0xc0, // LD HL,i16
+		0x70,             // LD (HL),B
+		0x7e,             // LD A,(HL)
+		0x3c,             // INC A
+		0x5f,             // LD E,A
+		// clang-format on
+	}));
+}
+
+TEST_CASE(JITArithmetic)
+{
+	// Run with every register dependent on the previous iteration
+	expectJITEqual(loopJITTest({
+		// clang-format off
+		0x80,             // ADD A,B
+		0x89,             // ADC A,C
+		0x47,             // LD B,A
+		0x92,             // SUB A,D
+		0x9b,             // SBC A,E
+		0x4f,             // LD C,A
+		0xa8,             // XOR A,B
+		0xb1,             // OR A,C
+		0x57,             // LD D,A
+		0xcb, 0x12,       // RL D
+		0xcb, 0x3b,       // SRL E
+		0x1c,             // INC E
+		0x1f,             // RRA
+		0x27,             // DAA
+		0xc5,             // PUSH BC
+		0xd1,             // POP DE
+		0xfe, 0x80,       // CP i8
+		// clang-format on
+	}));
+}
+
+TEST_CASE(JITWriteToCachedCode)
+{
+	// Writing to compiled code should throw it away
+
+	std::vector<uint8_t> self_modify = {
+		// clang-format off
+		0x31, 0xfe, 0xff, // LD SP,i16
+		0x3e, 0x20,       // LD A,i8, loop count
+		0xea, 0xff, 0xc0, // LD (a16),A
+		0xcd, 0x1d, 0x00, // CALL a16, run the subroutine until it gets compiled
+		0x21, 0xff, 0xc0, // LD HL,i16
+		0x35,             // DEC (HL)
+		0xc2, 0x08, 0x00, // JP NZ,a16
+		0x3e, 0x04,       // LD A,i8, INC B opcode
+		0xea, 0x1d, 0x00, // LD (a16),A, replace the NOP in the subroutine
+		0xcd, 0x1d, 0x00, // CALL a16
+		0xc3, 0x20, 0x00, // JP a16, end of the test
+		0x00,             // NOP
+		0x0c,             // INC C
+		0xc9,             // RET
+		// clang-format on
+	};
+	JITResult jit = runJITTest(self_modify, true);
+	EXPECT_EQ(jit.bc, 0x0121);
+	EXPECT_EQ(jit.sp, 0xfffe);
+
+	JITResult interpreter = runJITTest(self_modify, false);
+	EXPECT_EQ(jit.cycle, interpreter.cycle);
+
+	JITResult differential = runJITTest(self_modify, true, true);
+	EXPECT_EQ(differential.bc, jit.bc);
+	EXPECT_EQ(differential.cycle, jit.cycle);
+}
+
+#endif
@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <algorithm> // std::equal
+#include <cstddef> // size_t
+#include <cstdint> // uint8_t, uint16_t, uint32_t
+#include <memory>  // std::make_shared, std::shared_ptr
+#include <random>
+#include <vector>
+
+#include "emu.h"
+#include "macro.h"
+#include "ppu.h"
+#include "processing-unit.h"
+#include "testcase.h"
+#include "testsuite.h"
+
+using Screen = std::vector<uint8_t>;
+
+std::shared_ptr<PPU> setupPPUTest(PPU::Renderer renderer, uint8_t lcd_control, uint8_t scx, uint8_t scy, PPU::Format format = PPU::Format::RGB)
+{
+	auto ppu = std::make_shared<PPU>(4000000);
+	ppu->setRenderer(renderer);
+	ppu->setFormat(format);
+
+	Emu::the().destroy();
+	Emu::the().init(4000000);
+	Emu::the().addProcessingUnit("PPU", ppu);
+	Emu::the().addMemorySpace("VRAM", 0x8000, 0x9fff);
+	Emu::the().addMemorySpace("IO", 0xff00, 0xff7f);
+	Emu::the().addMemorySpace("IE", 0xffff, 0xffff);
+
+	// Same tiles and tile maps for every run
+	std::mt19937 random(42);
+	for (uint32_t address = 0x8000; address <= 0x9fff; ++address) {
+		Emu::the().writeMemory(address, random() & 0xff);
+	}
+
+	Emu::the().writeMemory(0xff40, lcd_control);
+	Emu::the().writeMemory(0xff42, scy);
+	Emu::the().writeMemory(0xff43, scx);
+	Emu::the().writeMemory(0xff47, 0xe4);
+
+	return ppu;
+}
+
+Screen renderPPUTest(PPU::Renderer renderer, uint8_t lcd_control, uint8_t scx, uint8_t scy, PPU::Format format = PPU::Format::RGB)
+{
+	auto ppu = setupPPUTest(renderer, lcd_control, scx, scy, format);
+	Emu::the().run(CLOCKS_PER_FRAME);
+	return { ppu->screen().begin(), ppu->screen().end() };
+}
+
+// Changes the horizontal scroll in the middle of the first scanlines
+struct ScrollWriter final : public ProcessingUnit {
+	explicit ScrollWriter(uint32_t lines)
+		: ProcessingUnit(4000000)
+		, m_lines(lines)
+	{
+	}
+
+	uint32_t update() override
+	{
+		if (m_updates++ == 0) {
+			return 80 + 86;
+		}
+		if (m_updates > m_lines + 1) {
+			return ProcessingUnit::idle;
+		}
+
+		Emu::the().writeMemory(0xff43, m_updates * 8);
+		return 80 + 172 + 204;
+	}
+
+	uint32_t m_lines { 0 };
+	uint32_t m_updates { 0 };
+};
+
+// -----------------------------------------
+
+TEST_CASE(PPUScanlineRenderer)
+{
+	// Both tile data areas and tile maps, scrolled so the tile map wraps around
+	for (uint8_t lcd_control : { 0x91, 0x99, 0x81, 0x89 }) {
+		for (auto [scx, scy] : { std::pair<uint8_t, uint8_t> { 0, 0 }, { 8, 16 }, { 136, 200 }, { 248, 120 } }) {
+			Screen fifo = renderPPUTest(PPU::Renderer::Fifo, lcd_control, scx, scy);
+			Screen scanline = renderPPUTest(PPU::Renderer::Scanline, lcd_control, scx, scy);
+			EXPECT(fifo == scanline);
+		}
+	}
+}
+
+TEST_CASE(PPUFramebufferFormats)
+{
+	// Same colors in both formats, with opaque alpha
+	for (auto renderer : { PPU::Renderer::Fifo, PPU::Renderer::Scanline }) {
+		Screen rgb = renderPPUTest(renderer, 0x91, 0, 0, PPU::Format::RGB);
+		Screen rgba = renderPPUTest(renderer, 0x91, 0, 0, PPU::Format::RGBA);
+		EXPECT_EQ(rgba.size(), rgb.size() / 3 * 4);
+
+		bool equal = true;
+		for (size_t i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; ++i) {
+			equal &= rgba[i * 4 + 0] == rgb[i * 3 + 0] && rgba[i * 4 + 1] == rgb[i * 3 + 1]
+			         && rgba[i * 4 + 2] == rgb[i * 3 + 2] && rgba[i * 4 + 3] == 255;
+		}
+		EXPECT(equal);
+	}
+}
+
+TEST_CASE(PPUPaletteWrites)
+{
+	auto ppu = setupPPUTest(PPU::Renderer::Scanline, 0x91, 0, 0);
+	Emu::the().run(CLOCKS_PER_FRAME);
+
+	// Map every color index to the lightest shade
+	Emu::the().writeMemory(0xff47, 0x00);
+	Emu::the().run(CLOCKS_PER_FRAME);
+
+	bool lightest = true;
+	for (size_t i = 0; i < ppu->screen().size(); i += ppu->formatSize()) {
+		lightest &= ppu->screen()[i] == 200 && ppu->screen()[i + 1] == 199 && ppu->screen()[i + 2] == 168;
+	}
+	EXPECT(lightest);
+}
+
+TEST_CASE(PPUTileCache)
+{
+	Emu::the().destroy();
+	Emu::the().addMemorySpace("VRAM", 0x8000, 0x9fff, 2);
+
+	// Line 1 of tile 2, color indices 3 0 2 1 0 0 1 3
+	Emu::the().writeMemory(0x8022, 0b10010011);
+	Emu::the().writeMemory(0x8023, 0b10100001);
+	EXPECT_EQ(Emu::the().tileCache().line(0, 2, 1), 0x0301000001020003);
+
+	// Writes invalidate the decoded tile
+	Emu::the().writeMemory(0x8023, 0b00000000);
+	EXPECT_EQ(Emu::the().tileCache().line(0, 2, 1), 0x0101000001000001);
+	EXPECT_EQ(Emu::the().readMemory(0x8023), 0x0);
+
+	// Banks are decoded separately
+	Emu::the().switchBank("VRAM", 1);
+	Emu::the().writeMemory(0x8022, 0xff);
+	EXPECT_EQ(Emu::the().tileCache().line(1, 2, 1), 0x0101010101010101);
+	EXPECT_EQ(Emu::the().tileCache().line(0, 2, 1), 0x0101000001000001);
+}
+
+TEST_CASE(PPUScanlineRendererFallback)
+{
+	// Changes the horizontal scroll in the middle of every scanline
+	// The scanline renderer can not draw these, so the next frame uses the pixel FIFO
+	Screen frames[2];
+	for (auto renderer : { PPU::Renderer::Fifo, PPU::Renderer::Scanline }) {
+		auto ppu = setupPPUTest(renderer, 0x91, 0, 0);
+		Emu::the().addProcessingUnit("scroll", std::make_shared<ScrollWriter>(154 * 2));
+		Emu::the().run(CLOCKS_PER_FRAME * 2);
+		frames[renderer == PPU::Renderer::Scanline].assign(ppu->screen().begin(), ppu->screen().end());
+	}
+	EXPECT(frames[0] == frames[1]);
+}
+
+TEST_CASE(PPUScanlineRendererMidScanlineWrite)
+{
+	// The line with the write is drawn with the old values left of it and the
+	// new values right of it, the same as the pixel FIFO
+	Screen frames[2];
+	for (auto renderer : { PPU::Renderer::Fifo, PPU::Renderer::Scanline }) {
+		auto ppu = setupPPUTest(renderer, 0x91, 0, 0);
+		Emu::the().addProcessingUnit("scroll", std::make_shared<ScrollWriter>(1));
+		Emu::the().run(CLOCKS_PER_FRAME);
+		frames[renderer == PPU::Renderer::Scanline].assign(ppu->screen().begin(), ppu->screen().end());
+	}
+	EXPECT(frames[0] == frames[1]);
+
+	// Not the same as drawing the whole line with either value
+	auto ppu = setupPPUTest(PPU::Renderer::Scanline, 0x91, 0, 0);
+	Emu::the().run(CLOCKS_PER_FRAME);
+	Screen before(ppu->screen().begin(), ppu->screen().begin() + SCREEN_WIDTH * ppu->formatSize());
+	EXPECT(!std::equal(before.begin(), before.end(), frames[0].begin()));
+}
+
+TEST_CASE(PPULcdOff)
+{
+	auto ppu = setupPPUTest(PPU::Renderer::Scanline, 0x11, 0, 0);
+
+	// Idle while the LCD is off
+	Emu::the().run(CLOCKS_PER_FRAME);
+	EXPECT_EQ(*ppu->sharedRegister("LY"), 0);
+
+	// Turning it on resumes drawing
+	Emu::the().writeMemory(0xff40, 0x91);
+	Emu::the().run(CLOCKS_PER_FRAME / 2);
+	EXPECT(*ppu->sharedRegister("LY") > 0);
+}
+
+TEST_CASE(PPULcdRegisterWrites)
+{
+	setupPPUTest(PPU::Renderer::Scanline, 0x91, 0, 0);
+
+	// STAT, LYC and DMA do not change the background
+	uint32_t writes = Emu::the().lcdRegisterWrites();
+	Emu::the().writeMemory(0xff41, 0x40);
+	Emu::the().writeMemory(0xff45, 0x10);
+	EXPECT_EQ(Emu::the().lcdRegisterWrites(), writes);
+
+	Emu::the().writeMemory(0xff43, 0x08);
+	EXPECT_EQ(Emu::the().lcdRegisterWrites(), writes + 1);
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <cstdint> // uint8_t, uint32_t
+#include <memory>  // std::static_pointer_cast
+#include <vector>
+
+#include "cpu.h"
+#include "emu.h"
+#include "macro.h"
+#include "ppu.h"
+#include "rewind.h"
+#include "testcase.h"
+#include "testsuite.h"
+
+void setupSaveStateTest(); // testsavestate.cpp
+
+std::vector<uint8_t> rewindMachine()
+{
+	auto cpu = std::static_pointer_cast<CPU>(Emu::the().processingUnit("CPU"));
+	std::vector<uint8_t> machine = { static_cast<uint8_t>(cpu->hl()), static_cast<uint8_t>(cpu->hl() >> 8) };
+	for (uint32_t address = 0x8000; address <= 0x9fff; ++address) {
+		machine.push_back(Emu::the().readMemory(address));
+	}
+	return machine;
+}
+
+// -----------------------------------------
+
+TEST_CASE(RewindFrames)
+{
+	setupSaveStateTest();
+
+	Rewind rewind(8);
+	std::vector<std::vector<uint8_t>> machines;
+	for (uint32_t frame = 0; frame < 12; ++frame) {
+		Emu::the().run(CLOCKS_PER_FRAME);
+		rewind.push();
+		machines.push_back(rewindMachine());
+	}
+
+	// Older frames than the capacity are dropped
+	EXPECT_EQ(rewind.frames(), 8);
+
+	for (uint32_t frame = 10; frame >= 3; --frame) {
+		EXPECT(rewind.pop());
+		EXPECT(rewindMachine() == machines[frame]);
+		EXPECT_EQ(Emu::the().cycle(), (frame + 1) * CLOCKS_PER_FRAME);
+	}
+	EXPECT(!rewind.pop());
+
+	// Recording continues from the frame rewound to
+	Emu::the().run(CLOCKS_PER_FRAME);
+	rewind.push();
+	EXPECT(rewindMachine() == machines[4]);
+	EXPECT(rewind.pop());
+	EXPECT(rewindMachine() == machines[3]);
+}
+
+TEST_CASE(RewindMemoryUsage)
+{
+	setupSaveStateTest();
+
+	Rewind rewind(60);
+	for (uint32_t frame = 0; frame < 60; ++frame) {
+		Emu::the().run(CLOCKS_PER_FRAME);
+		rewind.push();
+	}
+
+	// A frame only changes a few KiB, far less than keeping every frame in full
+	std::vector<uint8_t> state;
+	Emu::the().saveState(state);
+	EXPECT(rewind.memoryUsage() < state.size() * 60 / 10);
+}
+
+TEST_CASE(RewindIncrementalSnapshots)
+{
+	setupSaveStateTest();
+
+	Rewind rewind(8);
+	std::vector<uint8_t> full;
+	Emu::the().saveState(full);
+	for (uint32_t frame = 0; frame < 3; ++frame) {
+		Emu::the().run(CLOCKS_PER_FRAME);
+		rewind.push();
+	}
+	EXPECT(rewind.pop());
+
+	// Recording and rewinding did not move the base of the incremental snapshot
+	std::vector<uint8_t> incremental;
+	Emu::the().saveState(incremental, Emu::Snapshot::Incremental);
+	std::vector<uint8_t> machine = rewindMachine();
+
+	Emu::the().run(CLOCKS_PER_FRAME);
+	rewind.push();
+	Emu::the().loadState(full);
+	Emu::the().loadState(incremental);
+	EXPECT(rewindMachine() == machine);
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <cstdint> // uint8_t
+#include <cstdio>  // std::remove
+#include <filesystem>
+#include <string>
+
+#include "macro.h"
+#include "save-file.h"
+#include "testcase.h"
+#include "testsuite.h"
+
+TEST_CASE(SaveFilePersists)
+{
+	std::string path = (std::filesystem::temp_directory_path() / "garbage-test.sav").string();
+	std::remove(path.c_str());
+
+	// Created zeroed at the requested size
+	SaveFile save_file;
+	uint8_t* ram = save_file.open(path, 8 * 1024);
+	EXPECT_EQ(std::filesystem::file_size(path), 8 * 1024);
+	EXPECT_EQ(ram[0x1fff], 0x0);
+	ram[0x0000] = 0x12;
+	ram[0x1fff] = 0x34;
+	save_file.close();
+
+	// Grown to a larger size, the contents are kept
+	ram = save_file.open(path, 32 * 1024);
+	EXPECT_EQ(std::filesystem::file_size(path), 32 * 1024);
+	EXPECT_EQ(ram[0x0000], 0x12);
+	EXPECT_EQ(ram[0x1fff], 0x34);
+	EXPECT_EQ(ram[0x7fff], 0x0);
+	save_file.close();
+
+	std::remove(path.c_str());
+}
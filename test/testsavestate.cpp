@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <cstdint> // uint8_t, uint16_t, uint32_t
+#include <memory>  // std::make_shared, std::shared_ptr
+#include <vector>
+
+#include "cpu.h"
+#include "emu.h"
+#include "macro.h"
+#include "ppu.h"
+#include "testcase.h"
+#include "testsuite.h"
+
+// The CPU keeps incrementing the tile data while the PPU draws
+void setupSaveStateTest()
+{
+	Emu::the().destroy();
+	Emu::the().init(4000000);
+	Emu::the().addProcessingUnit("CPU", std::make_shared<CPU>(4000000));
+	Emu::the().addProcessingUnit("PPU", std::make_shared<PPU>(4000000));
+
+	Emu::the().addMemorySpace("CARTROM", 0x0000, 0x7fff);
+	Emu::the().addMemorySpace("VRAM", 0x8000, 0x9fff, 2);
+	Emu::the().addMemorySpace("WRAM1", 0xc000, 0xcfff);
+	Emu::the().addMemorySpace("WRAM2", 0xd000, 0xdfff, 7);
+	Emu::the().addMemorySpace("IO", 0xff00, 0xff7f);
+	Emu::the().addMemorySpace("HRAM", 0xff80, 0xfffe);
+	Emu::the().addMemorySpace("IE", 0xffff, 0xffff);
+
+	std::vector<uint8_t> program = {
+		// clang-format off
+		0x21, 0x00, 0x80, // LD HL,i16
+		0x34,             // INC (HL)
+		0x23,             // INC HL
+		0xcb, 0xa4,       // RES 4,H, wrap around at 0x9000
+		0x18, 0xfa,       // JR s8
+		// clang-format on
+	};
+	for (uint32_t i = 0; i < program.size(); ++i) {
+		Emu::the().writeMemory(i, program[i]);
+	}
+
+	Emu::the().writeMemory(0xff40, 0x91);
+	Emu::the().writeMemory(0xff47, 0xe4);
+	Emu::the().switchBank("WRAM2", 3);
+}
+
+// Registers and memory that are part of the state
+std::vector<uint8_t> saveStateMachine()
+{
+	auto cpu = std::static_pointer_cast<CPU>(Emu::the().processingUnit("CPU"));
+	std::vector<uint8_t> machine = { static_cast<uint8_t>(cpu->af()), static_cast<uint8_t>(cpu->hl()), static_cast<uint8_t>(cpu->pc()) };
+	for (uint32_t address = 0x8000; address <= 0xffff; ++address) {
+		if (Emu::the().readPointer(address) || (address >= 0xff80)) {
+			machine.push_back(Emu::the().readMemory(address));
+		}
+	}
+
+	return machine;
+}
+
+std::vector<uint8_t> saveStateScreen()
+{
+	auto ppu = std::static_pointer_cast<PPU>(Emu::the().processingUnit("PPU"));
+	return { ppu->screen().begin(), ppu->screen().end() };
+}
+
+// -----------------------------------------
+
+TEST_CASE(SaveStateRestore)
+{
+	setupSaveStateTest();
+	Emu::the().run(CLOCKS_PER_FRAME * 3 / 2);
+
+	std::vector<uint8_t> state;
+	Emu::the().saveState(state);
+	uint64_t cycle = Emu::the().cycle();
+
+	// The frames drawn after the snapshot are drawn again the same way
+	Emu::the().run(CLOCKS_PER_FRAME * 3);
+	std::vector<uint8_t> machine = saveStateMachine();
+	std::vector<uint8_t> screen = saveStateScreen();
+
+	// Out of phase with the snapshot
+	Emu::the().run(12345);
+	Emu::the().switchBank("WRAM2", 0);
+	Emu::the().loadState(state);
+	EXPECT_EQ(Emu::the().cycle(), cycle);
+	EXPECT_EQ(Emu::the().memorySpace("WRAM2").active_bank, 3);
+
+	Emu::the().run(CLOCKS_PER_FRAME * 3);
+	EXPECT(saveStateMachine() == machine);
+	EXPECT(saveStateScreen() == screen);
+}
+
+TEST_CASE(SaveStateIncremental)
+{
+	setupSaveStateTest();
+	Emu::the().run(CLOCKS_PER_FRAME);
+
+	std::vector<uint8_t> full;
+	Emu::the().saveState(full);
+
+	// Only the pages written to are stored
+	std::vector<uint8_t> incremental;
+	Emu::the().run(1000);
+	Emu::the().saveState(incremental, Emu::Snapshot::Incremental);
+	EXPECT(incremental.size() < full.size() / 8);
+	std::vector<uint8_t> machine = saveStateMachine();
+
+	std::vector<uint8_t> next;
+	Emu::the().run(1000);
+	Emu::the().saveState(next, Emu::Snapshot::Incremental);
+
+	// Loads on top of the snapshot it was taken after
+	Emu::the().run(CLOCKS_PER_FRAME);
+	Emu::the().loadState(full);
+	Emu::the().loadState(incremental);
+	EXPECT(saveStateMachine() == machine);
+
+	Emu::the().loadState(next);
+	Emu::the().loadState(full);
+	Emu::the().run(1000);
+	EXPECT(saveStateMachine() == machine);
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2022 Riyyi
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include <cstdint> // uint32_t
+#include <thread>
+
+#include "macro.h"
+#include "testcase.h"
+#include "testsuite.h"
+#include "triple-buffer.h"
+
+TEST_CASE(TripleBufferLatestValue)
+{
+	TripleBuffer<uint32_t> buffer;
+	EXPECT(!buffer.update());
+
+	// Values the consumer did not pick up in time are skipped
+	buffer.back() = 1;
+	buffer.publish();
+	buffer.back() = 2;
+	buffer.publish();
+	EXPECT(buffer.update());
+	EXPECT_EQ(buffer.front(), 2u);
+
+	// The front stays the same until something new is published
+	EXPECT(!buffer.update());
+	EXPECT_EQ(buffer.front(), 2u);
+
+	buffer.back() = 3;
+	buffer.publish();
+	EXPECT(buffer.update());
+	EXPECT_EQ(buffer.front(), 3u);
+}
+
+TEST_CASE(TripleBufferThreads)
+{
+	struct Frame {
+		uint32_t first;
+		uint32_t last;
+	};
+	TripleBuffer<Frame> buffer;
+
+	std::thread producer([&buffer]() {
+		for (uint32_t i = 1; i <= 100000; ++i) {
+			buffer.back().first = i;
+			buffer.back().last = i;
+			buffer.publish();
+		}
+	});
+
+	// Values only ever move forward and are never seen half written
+	bool consistent = true;
+	uint32_t previous = 0;
+	while (previous != 100000) {
+		if (buffer.update()) {
+			consistent &= buffer.front().first == buffer.front().last && buffer.front().first > previous;
+			previous = buffer.front().first;
+		}
+	}
+	producer.join();
+
+	EXPECT(consistent);
+}